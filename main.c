@@ -5,6 +5,7 @@
 // the foreground and background. Tracks all running processes and notifies user of abnormal termination.
 // Implements customer signal handlers for SIGINT and SIGTSTP.
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -12,20 +13,187 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sched.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <pwd.h>
+#include <limits.h>
+#include <sys/sendfile.h>
+#include <pthread.h>
+#include <regex.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#ifndef CLONE_PIDFD
+#define CLONE_PIDFD 0x00001000
+#endif
+#ifndef CLONE_INTO_CGROUP
+#define CLONE_INTO_CGROUP 0x200000000ULL
+#endif
+#ifndef P_PIDFD
+#define P_PIDFD 3
+#endif
+#ifndef SYS_pidfd_send_signal
+#define SYS_pidfd_send_signal 424
+#endif
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+#ifndef SYS_clone3
+#define SYS_clone3 435
+#endif
+
+extern char** environ;
 
 int foregroundOnly = 0;
 int sigTSTPChange = 0;
 int lfStatus = -1234;
-int bgStatus;
-int bgRunning[1000];
+int scriptMode = 0;         // commands come from a script file, no prompts
+int subshell = 0;           // running as a forked child for command substitution
+int backgroundSubshell = 0; // that child is a background job, which SIGINT does not reach
+int jobCgroupFD = -1;       // cgroup v2 directory new jobs are created in, -1 for none
+const char* lfCause = "";   // resource limit that terminated the last foreground process
+
+// settings applied in the child between fork and exec, sent as is to the fork server
+struct spawnAttr {
+    int rlimitMask;                         // bit n set when rlimits[n] applies to the child
+    struct rlimit rlimits[RLIM_NLIMITS];
+    long long memMax;                       // cgroup memory.max in bytes for the job, 0 for none
+    int cpuMaxPercent;                      // cgroup cpu.max as percent of one cpu, 0 for none
+    int useAffinity;                        // pin the child to cpus
+    cpu_set_t cpus;
+    int useNice;                            // add niceIncrement to the child's nice value
+    int niceIncrement;
+    int ioprio;                             // ioprio_set() value, 0 to inherit
+    int schedPolicy;                        // SCHED_BATCH or SCHED_IDLE, SCHED_OTHER to inherit
+};
+
+// shell wide scheduling defaults for background jobs, set with bgpolicy
+struct bgPolicy {
+    int useCpus;                            // restrict background jobs to cpus
+    cpu_set_t cpus;
+    int spread;                             // 0 off, 1 round robin over cpus, 2 over NUMA nodes
+    int nextSlot;                           // round robin position
+    int useNice;
+    int niceIncrement;
+    int ioprio;
+    int schedPolicy;
+};
+struct bgPolicy bgDefaults;
+
+// admission control for background jobs, a threshold of 0 disables that check
+struct admission {
+    int maxJobs;            // running background jobs allowed at once
+    double cpuPressure;     // /proc/pressure/* "some avg10" percentages
+    double memPressure;
+    double ioPressure;
+    double loadAverage;     // 1 minute load average
+};
+struct admission admitLimits;
+struct command* admitQueue[1000];   // background jobs waiting for admission, oldest first
+int admitQueued = 0;
+
+// token bucket limiting how fast commands are spawned, a rate of 0 means unlimited
+struct tokenBucket {
+    double rate;            // tokens added per second
+    double burst;           // bucket capacity
+    double tokens;
+    double last;            // CLOCK_MONOTONIC time of the last refill, comparable across processes
+};
+struct tokenBucket sessionBucket;
+struct tokenBucket* globalBucket = NULL;    // shared by every shell of this user, mapped from /dev/shm
+int globalBucketFD = -1;
+int rateReject = 0;         // reject launches over the rate instead of delaying them
+
+// spawn rate limiter counters, shown by the ratelimit builtin
+struct {
+    long launched;
+    long delayed;
+    long rejected;
+    double delaySeconds;
+} rateStats;
+
+// background job table, pid 0 marks an empty slot
+struct job {
+    pid_t pid;
+    int pidfd;              // process handle for waiting and signalling, -1 if unavailable
+    int rlimitMask;         // limits the job was started with, to name the one that killed it
+    struct rlimit cpuLimit; // its RLIMIT_CPU, checked against the cpu time it used
+    int cgroupFD;           // per job cgroup leaf, -1 if none
+    char* cgroupPath;
+    pid_t owner;            // command a process substitution was started for, -1 until it is
+                            // spawned and 0 for jobs of their own
+    char* coprocName;       // NAME of a coprocess, NULL for other jobs
+    int coprocFDs[2];       // shell's ends of a coprocess's stdout and stdin pipes
+    char command[256];
+};
+struct job bgJobs[1000];
+int forkServerSock = -1;    // shell's end of the fork server socket, -1 when not running
+pid_t forkServerPid = 0;    // pid of the fork server helper process
+
+// children the fork server spawned on the shell's behalf, status filled in once reported
+struct serverChild {
+    pid_t pid;
+    int done;
+    int status;
+    int lost;   // the server went away before reporting it
+};
+struct serverChild serverChildren[1000];
+
+// fork server reply types
+#define FS_SPAWNED 1
+#define FS_EXITED 2
+
+// request header sent to the fork server along with the child's stdin, stdout, stderr
+// and working directory fds, followed by payloadLen bytes of NUL terminated argv then env strings
+struct forkRequest {
+    int background;
+    struct spawnAttr attr;
+    int useCgroup;  // a fifth fd, the cgroup directory to create the child in, is attached
+    int auxCount;   // process substitution pipes attached after those
+    int auxFDs[16]; // fd numbers the child gets them at
+    int argc;
+    int envc;
+    size_t payloadLen;
+};
+
+// reply sent by the fork server, either the result of a spawn or a child's exit.
+// FS_SPAWNED replies carry the child's pidfd as an attached fd when one could be created
+struct forkReply {
+    int type;
+    pid_t pid;
+    int status; // errno of a failed spawn for FS_SPAWNED, wait status for FS_EXITED
+};
 
 // com stucture built from shell user's input command
 struct command {
-    char* args[512];
+    char** args;    // NULL terminated, allocated from the line's arena
     char input[128];
     char output[128];
     int background;
     int numArgs;
+    struct spawnAttr attr;
+    int cwdFD;  // directory a queued job was submitted in, -1 otherwise
+    int outFD;  // pipe stdout is captured through, -1 otherwise
+    int inFD;   // here-document or here-string for stdin, -1 otherwise
+    int auxFDs[16];     // process substitution pipes the command gets as /dev/fd/N
+    pid_t auxPids[16];  // the substitution processes, in the job table until reaped
+    int auxCount;
 };
 
 // redirect stdin to com.input file, return 1 if error occurs 
@@ -75,311 +243,8047 @@ void tstpHandler(int signo) {
     sigTSTPChange = 1;
 }
 
-// gets user command, runs forked child with execvp in foreground or background, I/O redirection enabled
-int runShell() {
-    char* arguments[512];
-    char* line = NULL;
-    size_t len = 2048;
-    int runInBackground = 0;
-    ssize_t nread;
+// bump allocator owning everything built from one command line, released in one go.
+// A string can be built in place at the end of the arena with arenaBegin/arenaAppend/arenaFinish
+struct arenaBlock {
+    struct arenaBlock* next;
+    size_t size;
+    size_t used;
+    char data[];
+};
+struct arena {
+    struct arenaBlock* head;    // block being allocated from, older blocks follow
+    size_t partial;             // offset in head of the string being built, -1 when none
+};
 
-    // instantiate and install foreground only mode handler
-    struct sigaction foregroundMode = { 0 };
-    foregroundMode.sa_handler = tstpHandler;
-    sigfillset(&foregroundMode.sa_mask); // Block all catchable signals while handle_SIGINT is running
-    foregroundMode.sa_flags = 0; // // No flags set
-    sigaction(SIGTSTP, &foregroundMode, NULL);
-    if (sigTSTPChange == 1 && foregroundOnly == 1) {
-        printf("Entering foreground-only mode (& is now ignored)\n");
-        fflush(stdout);
-        sigTSTPChange = 0;
+// make sure the head block has room for n more bytes, moving any string being built along
+void arenaReserve(struct arena* a, size_t n) {
+    struct arenaBlock* head = a->head;
+    if (head != NULL && head->used + n <= head->size)
+        return;
+    size_t keep = (head != NULL && a->partial != (size_t)-1) ? head->used - a->partial : 0;
+    size_t size = head != NULL ? head->size * 2 : 65536;
+    while (size < keep + n)
+        size *= 2;
+    struct arenaBlock* block = malloc(sizeof(struct arenaBlock) + size);
+    block->next = head;
+    block->size = size;
+    block->used = 0;
+    if (keep > 0) {
+        memcpy(block->data, head->data + a->partial, keep);
+        head->used = a->partial;
+        block->used = keep;
+        a->partial = 0;
     }
-    else if (sigTSTPChange == 1 && foregroundOnly == 0) {
-        printf("Exiting foreground-only mode\n");
-        fflush(stdout);
-        sigTSTPChange = 0;
+    a->head = block;
+}
+
+// allocate n bytes from the arena
+void* arenaAlloc(struct arena* a, size_t n) {
+    n = (n + 7) & ~(size_t)7;
+    arenaReserve(a, n);
+    void* p = a->head->data + a->head->used;
+    a->head->used += n;
+    return p;
+}
+
+// copy n bytes of s into the arena as a NUL terminated string
+char* arenaStrndup(struct arena* a, const char* s, size_t n) {
+    char* copy = arenaAlloc(a, n + 1);
+    memcpy(copy, s, n);
+    copy[n] = 0;
+    return copy;
+}
+
+// start building a string at the end of the arena
+void arenaBegin(struct arena* a) {
+    arenaReserve(a, 1);
+    a->partial = a->head->used;
+}
+
+// append n bytes to the string being built
+void arenaAppend(struct arena* a, const char* s, size_t n) {
+    arenaReserve(a, n);
+    memcpy(a->head->data + a->head->used, s, n);
+    a->head->used += n;
+}
+
+// terminate the string being built and return it
+char* arenaFinish(struct arena* a) {
+    arenaAppend(a, "", 1);
+    char* s = a->head->data + a->partial;
+    a->partial = -1;
+    a->head->used = (a->head->used + 7) & ~(size_t)7;
+    if (a->head->used > a->head->size)
+        a->head->used = a->head->size;
+    return s;
+}
+
+// release everything but the most recent block, which is kept for reuse unless it is large
+void arenaReset(struct arena* a) {
+    if (a->head != NULL && a->head->size > (1 << 20)) {
+        struct arenaBlock* large = a->head;
+        a->head = large->next;
+        free(large);
     }
-    // instantiate and install parent ignore SIGINT handler
-    struct sigaction sigIgnore = { 0 };
-    sigIgnore.sa_handler = SIG_IGN;
-    sigaction(SIGINT, &sigIgnore, NULL);
+    if (a->head == NULL)
+        return;
+    struct arenaBlock* old = a->head->next;
+    while (old != NULL) {
+        struct arenaBlock* next = old->next;
+        free(old);
+        old = next;
+    }
+    a->head->next = NULL;
+    a->head->used = 0;
+    a->partial = -1;
+}
 
-    // instantiate a command and initialize data members 
-    struct command com;
-    for (int i = 0; i < 512; i++) {
-        com.args[i] = NULL;
+// release all of the arena's blocks
+void arenaFree(struct arena* a) {
+    while (a->head != NULL) {
+        struct arenaBlock* next = a->head->next;
+        free(a->head);
+        a->head = next;
     }
-    strcpy(com.input, "");
-    strcpy(com.output, "");
-    com.background = 0;
-    com.numArgs = 0;
+    a->partial = -1;
+}
 
-    // checking status of background processes not yet verified to have exited
-    int childStatus;
-    int testPID;
-    for (int ind = 0; ind < (sizeof(bgRunning) / sizeof(int)); ind++) {
-        if (bgRunning[ind] == 0) {
-            continue;
-        }
-        testPID = waitpid(bgRunning[ind], &childStatus, WNOHANG); // returns 0 when PID still running
-        if (testPID != 0) {
-            if (WIFEXITED(childStatus)) { // returns true if the child was terminated normally
-                printf("background pid %d is done. exit value %d\n", bgRunning[ind], WEXITSTATUS(childStatus));
-                fflush(stdout);
-                bgRunning[ind] = 0; // remove PID from bgRunning as it has exited
-            }
-            else if (WIFSIGNALED(childStatus)) { // returns true if the child was terminated abnormally
-                printf("background pid %d is done: terminated by signal %d\n", bgRunning[ind], WTERMSIG(childStatus));
-                fflush(stdout);
-                bgRunning[ind] = 0; // remove PID from bgRunning as it has exited
-            }
+struct arena lineArena = { NULL, -1 };   // current command line's words and fields
+char** shellArgs;       // $0 and the positional parameters, the script's arguments
+int shellArgCount;
+
+// growable byte buffer
+struct buffer {
+    char* data;
+    size_t len;
+    size_t cap;
+};
+
+// make room for at least n more bytes, doubling the capacity and never growing it by less
+// than 64KB
+void bufferReserve(struct buffer* b, size_t n) {
+    if (b->cap - b->len >= n)
+        return;
+    size_t grow = n > 65536 ? n : 65536;
+    b->cap = b->cap * 2 > b->len + grow ? b->cap * 2 : b->len + grow;
+    b->data = realloc(b->data, b->cap);
+}
+
+// append everything read from fd up to end of file to b, reading straight into its spare
+// capacity. Returns -1 on a read error
+int bufferReadFD(struct buffer* b, int fd) {
+    while (1) {
+        bufferReserve(b, 65536);
+        ssize_t n = read(fd, b->data + b->len, b->cap - b->len);
+        if (n == 0)
+            return 0;
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
         }
+        b->len += n;
     }
+}
 
-    // prompt command, get input and remove \n
-    printf(":");
-    fflush(stdout);
-    nread = getline(&line, &len, stdin);
-    // getline returns -1 if interrupted by signal handler functions, clear stdin error and 
-    // get next user command
-    if (nread == -1) {
-        clearerr(stdin);
-        printf("\n");
-        fflush(stdout);
-        return -1;
-    }
-    char* newline = strchr(line, '\n');
-    if (newline)
-        *newline = 0;
-
-    // variable expansion: create duplicate line, replace instances of 
-    // $$ with %d in duplicate line and then string print in to line
-    int expand = 0;
-    pid_t shellPID = getpid();
-    for (int i = 0; i < nread; i++) {
-        if (line[i] == '$' && expand == 0) {
-            expand = 1;
-        }
-        else if (line[i] == '$' && expand == 1) {
-            expand = 0;
-            char* lineDup = strdup(line);
-            lineDup[i - 1] = '%';
-            lineDup[i] = 'd';
-            sprintf(line, lineDup, shellPID);
-            free(lineDup);
-        }
-    }
-
-    //get tokens of user input and store in arguments array
-    char* token = strtok(line, " \t");
-    int i = 0;              // index for arguments array
-    int argIndex = 1000;    // com's argument index, 1000 indicates no args found
-    while (token != NULL) {
-        arguments[i] = token;
-        // ignore comment lines by returning 0
-        if (arguments[i][0] == '#' && i == 0) {
-            printf("\n");
-            fflush(stdout);
-            return 0;
+// buffered line reader over a raw descriptor, filled 64KB at a time rather than with a read
+// per line
+struct reader {
+    int fd;
+    char* data;
+    size_t start;   // first byte not handed out yet
+    size_t end;     // bytes read into data
+    size_t cap;
+    int eof;
+    int exact;      // read a byte at a time, never past the line: for a pipe others read next
+};
+struct reader input = { 0 };    // the commands: stdin, or the script in script mode
+struct reader stdinReader = { 0 };  // stdin for read while the commands come from a script
+
+// append the next line of r, newline included, to b. Returns the bytes appended, 0 at end of
+// file and -1 if a signal interrupted the read; a partial line stays buffered until then
+ssize_t readerLine(struct reader* r, struct buffer* b) {
+    size_t scanned = r->start;
+    while (1) {
+        char* newline = memchr(r->data + scanned, '\n', r->end - scanned);
+        if (newline != NULL || (r->eof && r->end > r->start)) {
+            size_t n = newline != NULL ? newline + 1 - (r->data + r->start) : r->end - r->start;
+            bufferReserve(b, n + 1);
+            memcpy(b->data + b->len, r->data + r->start, n);
+            b->len += n;
+            r->start += n;
+            return n;
         }
-        else if (*(arguments[0] + 0) == '#' && i == 0) {
-            printf("\n");
-            fflush(stdout);
+        if (r->eof)
             return 0;
+        // keep the partial line, moved to the front, and read more after it
+        memmove(r->data, r->data + r->start, r->end - r->start);
+        r->end -= r->start;
+        r->start = 0;
+        scanned = r->end;
+        if (r->cap - r->end < 65536) {
+            r->cap = r->cap * 2 > r->end + 65536 ? r->cap * 2 : r->end + 65536;
+            r->data = realloc(r->data, r->cap);
         }
-        // record the end of the arguments index when redirections are found
-        if (strcmp(arguments[i], "<") == 0 || strcmp(arguments[i], ">") == 0) {
-            if (argIndex == 1000) {
-                argIndex = i - 1;
+        ssize_t n = read(r->fd, r->data + r->end, r->exact ? 1 : r->cap - r->end);
+        if (n == -1 && errno == EINTR)
+            return -1;
+        if (n <= 0)
+            r->eof = 1;
+        else
+            r->end += n;
+    }
+}
+
+// hand what r read past its last line back to its descriptor, so a command run next starts
+// right after that line. Only a seekable descriptor can take it back
+void readerGiveBack(struct reader* r) {
+    if (r->end > r->start && lseek(r->fd, -(off_t)(r->end - r->start), SEEK_CUR) == -1)
+        return;
+    r->start = r->end = 0;
+    r->eof = 0;     // whatever runs next may leave more to read
+}
+
+// shell variable, chained in varTable buckets
+struct var {
+    struct var* next;
+    unsigned hash;
+    int exported;
+    char* name;
+    char* value;
+};
+struct var** varTable = NULL;
+size_t varBuckets = 0;
+size_t varCount = 0;
+unsigned envGeneration = 1;     // bumped whenever the exported set changes
+unsigned envCacheGeneration = 0;
+char** envCache = NULL;         // exported variables as an envp array for exec
+size_t envCacheBytes = 0;       // space envCache takes in a new program's ARG_MAX
+
+// FNV-1a hash of the n byte name
+unsigned varHash(const char* name, size_t n) {
+    unsigned hash = 2166136261u;
+    for (size_t i = 0; i < n; i++) {
+        hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// variable named by the n bytes at name, NULL if unset
+struct var* varLookup(const char* name, size_t n) {
+    if (varCount == 0)
+        return NULL;
+    unsigned hash = varHash(name, n);
+    for (struct var* v = varTable[hash & (varBuckets - 1)]; v != NULL; v = v->next) {
+        if (v->hash == hash && strncmp(v->name, name, n) == 0 && v->name[n] == 0)
+            return v;
+    }
+    return NULL;
+}
+
+// value of variable name, NULL if unset
+char* varGet(const char* name) {
+    struct var* v = varLookup(name, strlen(name));
+    return v != NULL ? v->value : NULL;
+}
+
+// set variable name to value (NULL keeps the current value). exported is 1 to export it,
+// 0 to make it local and -1 to leave the flag as it is
+void varSet(const char* name, const char* value, int exported) {
+    size_t n = strlen(name);
+    struct var* v = varLookup(name, n);
+    if (v == NULL) {
+        // grow the table to keep chains short, rehashing every variable
+        if (varCount + 1 > varBuckets * 3 / 4) {
+            size_t buckets = varBuckets == 0 ? 64 : varBuckets * 2;
+            struct var** table = calloc(buckets, sizeof(struct var*));
+            for (size_t i = 0; i < varBuckets; i++) {
+                while (varTable[i] != NULL) {
+                    struct var* moved = varTable[i];
+                    varTable[i] = moved->next;
+                    moved->next = table[moved->hash & (buckets - 1)];
+                    table[moved->hash & (buckets - 1)] = moved;
+                }
             }
+            free(varTable);
+            varTable = table;
+            varBuckets = buckets;
         }
-        token = strtok(NULL, " ");
-        i++;
+        v = calloc(1, sizeof(struct var));
+        v->hash = varHash(name, n);
+        v->name = strdup(name);
+        v->value = strdup("");
+        v->next = varTable[v->hash & (varBuckets - 1)];
+        varTable[v->hash & (varBuckets - 1)] = v;
+        varCount++;
+    }
+    if (value != NULL) {
+        free(v->value);
+        v->value = strdup(value);
     }
+    int wasExported = v->exported;
+    if (exported != -1)
+        v->exported = exported;
+    if (wasExported || v->exported)
+        envGeneration++;
+}
 
-    // identify if process should run in the background
-    i--;
-    if (strcmp(arguments[i], "&") == 0) {
-        com.background = 1;
+// remove variable name
+void varUnset(const char* name) {
+    if (varCount == 0)
+        return;
+    unsigned hash = varHash(name, strlen(name));
+    struct var** link = &varTable[hash & (varBuckets - 1)];
+    while (*link != NULL) {
+        struct var* v = *link;
+        if (v->hash == hash && strcmp(v->name, name) == 0) {
+            *link = v->next;
+            if (v->exported)
+                envGeneration++;
+            free(v->name);
+            free(v->value);
+            free(v);
+            varCount--;
+            return;
+        }
+        link = &v->next;
     }
-    else {
-        com.background = 0;
+}
+
+// import the environment the shell was started with as exported variables
+void varInit() {
+    for (char** env = environ; *env != NULL; env++) {
+        char* equals = strchr(*env, '=');
+        if (equals == NULL)
+            continue;
+        char* name = strndup(*env, equals - *env);
+        varSet(name, equals + 1, 1);
+        free(name);
     }
+}
 
-    // locates last element index for args and stores the
-    // index+1 in numArgs for our com structure
-    int z;
-    if (argIndex == 1000) {
-        z = i;
-        com.numArgs = z + 1;
+// envp array of the exported variables, rebuilt only when they changed since the last call
+char** buildEnvp() {
+    if (envCacheGeneration == envGeneration)
+        return envCache;
+    if (envCache != NULL) {
+        for (char** env = envCache; *env != NULL; env++) {
+            free(*env);
+        }
+        free(envCache);
     }
-    else {
-        z = argIndex;
-        com.numArgs = z + 1;
+    envCache = malloc(sizeof(char*) * (varCount + 1));
+    envCacheBytes = sizeof(char*);
+    size_t n = 0;
+    for (size_t i = 0; i < varBuckets; i++) {
+        for (struct var* v = varTable[i]; v != NULL; v = v->next) {
+            if (!v->exported)
+                continue;
+            size_t nameLen = strlen(v->name);
+            size_t valueLen = strlen(v->value);
+            char* entry = malloc(nameLen + valueLen + 2);
+            memcpy(entry, v->name, nameLen);
+            entry[nameLen] = '=';
+            memcpy(entry + nameLen + 1, v->value, valueLen + 1);
+            envCache[n++] = entry;
+            envCacheBytes += nameLen + valueLen + 2 + sizeof(char*);
+        }
     }
-    // stores arguments[0:z] in com.args 
-    // index position z stops before tokens <, >, or &
-    for (int j = 0; j <= z; j++) {
-        if (i == j && strcmp(arguments[i], "&") == 0) {
-            continue;
+    envCache[n] = NULL;
+    envCacheGeneration = envGeneration;
+    return envCache;
+}
+
+// install child signal dispositions: ignore SIGTSTP, default SIGINT in the
+// foreground and ignore SIGINT in the background
+void childSignals(int background) {
+    struct sigaction tstpIgnore = { 0 };
+    tstpIgnore.sa_handler = SIG_IGN;
+    sigaction(SIGTSTP, &tstpIgnore, NULL);
+    struct sigaction sigDefault = { 0 };
+    sigDefault.sa_handler = (background == 0) ? SIG_DFL : SIG_IGN;
+    sigaction(SIGINT, &sigDefault, NULL);
+}
+
+// apply the spawn attributes in the child before exec, return 1 if an error occurs
+int applySpawnAttr(struct spawnAttr* attr) {
+    for (int res = 0; res < RLIM_NLIMITS; res++) {
+        if ((attr->rlimitMask & (1 << res)) && setrlimit(res, &attr->rlimits[res]) == -1) {
+            perror("setrlimit");
+            return 1;
         }
-        else {
-            com.args[j] = arguments[j];
+    }
+    if (attr->useAffinity && sched_setaffinity(0, sizeof(cpu_set_t), &attr->cpus) == -1) {
+        perror("sched_setaffinity");
+        return 1;
+    }
+    if (attr->schedPolicy != SCHED_OTHER) {
+        struct sched_param param = { 0 };
+        if (sched_setscheduler(0, attr->schedPolicy, &param) == -1) {
+            perror("sched_setscheduler");
+            return 1;
         }
     }
-    // stores token following redirection requests < > in input and output
-    // of our com structure 
-    for (int j = 0; j < i; j++) {
-        if (strcmp(arguments[j], "<") == 0) {
-            int x = j + 1; //index of output file
-            strcpy(com.input, arguments[x]);
+    errno = 0;
+    if (attr->useNice && nice(attr->niceIncrement) == -1 && errno != 0) {
+        perror("nice");
+        return 1;
+    }
+    if (attr->ioprio != 0 && syscall(SYS_ioprio_set, 1, 0, attr->ioprio) == -1) { // IOPRIO_WHO_PROCESS
+        perror("ioprio_set");
+        return 1;
+    }
+    return 0;
+}
+
+// clone3() argument block, laid out as struct clone_args in linux/sched.h
+struct cloneArgs {
+    uint64_t flags;
+    uint64_t pidfd;
+    uint64_t childTid;
+    uint64_t parentTid;
+    uint64_t exitSignal;
+    uint64_t stack;
+    uint64_t stackSize;
+    uint64_t tls;
+    uint64_t setTid;
+    uint64_t setTidSize;
+    uint64_t cgroup;
+};
+
+// fork a child with clone3(), returning a pidfd for it in *pidfd and creating it directly
+// inside cgroupFD when that is not -1. Where clone3 is unavailable fall back to fork()
+// with pidfd_open() and have the child join the cgroup itself. *pidfd is -1 when the
+// kernel has no pidfd support. Returns like fork()
+pid_t forkWithPidfd(int* pidfd, int cgroupFD) {
+    static int haveClone3 = 1;
+    *pidfd = -1;
+    if (haveClone3) {
+        struct cloneArgs args = { 0 };
+        args.flags = CLONE_PIDFD;
+        args.pidfd = (uint64_t)(uintptr_t)pidfd;
+        args.exitSignal = SIGCHLD;
+        if (cgroupFD != -1) {
+            args.flags |= CLONE_INTO_CGROUP;
+            args.cgroup = cgroupFD;
+        }
+        pid_t pid = syscall(SYS_clone3, &args, sizeof(args));
+        if (pid != -1) {
+            return pid;
+        }
+        if (cgroupFD != -1 && errno != ENOSYS && errno != E2BIG && errno != EAGAIN) {
+            // placement refused, run the job outside the cgroup rather than not at all
+            perror("cgroup");
+            return forkWithPidfd(pidfd, -1);
         }
-        if (strcmp(arguments[j], ">") == 0) {
-            int y = j + 1; //index of input file
-            strcpy(com.output, arguments[y]);
+        if (errno != ENOSYS && errno != EPERM && errno != E2BIG) {
+            return -1;
         }
+        // clone3 unavailable: old kernel (ENOSYS, E2BIG) or a seccomp filter (EPERM, ENOSYS)
+        haveClone3 = 0;
     }
+    pid_t pid = fork();
+    if (pid == 0 && cgroupFD != -1) {
+        // move ourselves in, not atomic with creation but before exec
+        int procsFD = openat(cgroupFD, "cgroup.procs", O_WRONLY | O_CLOEXEC);
+        if (procsFD == -1 || write(procsFD, "0", 1) != 1) {
+            perror("cgroup.procs");
+        }
+        if (procsFD != -1)
+            close(procsFD);
+    }
+    if (pid > 0) {
+        *pidfd = syscall(SYS_pidfd_open, pid, 0);
+    }
+    return pid;
+}
 
-    // the com structure is now fully built, return if no arguments
-    if (com.numArgs == 0) {
-        return 0;
-    };
- 
-    // if in foreground mode ignore requested '&'
-    if (foregroundOnly == 1) {
-        com.background = 0;
+// send sig to a process through its pidfd when available, kill() otherwise
+int signalChild(pid_t pid, int pidfd, int sig) {
+    if (pidfd != -1) {
+        return syscall(SYS_pidfd_send_signal, pidfd, sig, NULL, 0);
     }
+    return kill(pid, sig);
+}
+
+// convert a waitid() result into the status format waitpid() returns
+int siginfoStatus(siginfo_t* info) {
+    if (info->si_code == CLD_EXITED) {
+        return (info->si_status & 0xff) << 8;
+    }
+    if (info->si_code == CLD_DUMPED) {
+        return info->si_status | 0x80;
+    }
+    return info->si_status; // CLD_KILLED
+}
 
-    // "exit" entered: kill all processes and exit
-    if (strcmp(com.args[0], "exit") == 0) {
-        int killReturn;
-        // SIGKILL any processes that have yet to terminate
-        for (int ind = 0; ind < (sizeof(bgRunning) / sizeof(int)); ind++) {
-            if (bgRunning[ind] == 0) {
+// send len bytes on a socket without raising SIGPIPE, return 0 on success and -1 on error
+int sendAll(int sock, const void* buf, size_t len) {
+    const char* p = buf;
+    while (len > 0) {
+        ssize_t n = send(sock, p, len, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR)
                 continue;
-            }
-            printf("Attempting to kill %d\n", bgRunning[ind]);
-            fflush(stdout);
-            killReturn = kill(bgRunning[ind], SIGKILL);
-            if (killReturn == -1) {
-                printf("Process %d was not killed\n", bgRunning[ind]);
-                fflush(stdout);
-            }
-            else {
-                printf("Process %d was killed\n", bgRunning[ind]);
-                fflush(stdout);
-            }
+            return -1;
         }
-        exit(0); //exit the shell
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// read exactly len bytes from fd, return 0 on success and -1 on error or end of file
+int readAll(int fd, void* buf, size_t len) {
+    char* p = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// send buf over a unix socket with nfds file descriptors attached (SCM_RIGHTS)
+int sendWithFds(int sock, const void* buf, size_t len, const int* fds, int nfds) {
+    char control[CMSG_SPACE(sizeof(int) * 24)] = { 0 };
+    struct iovec iov = { (void*)buf, len };
+    struct msghdr msg = { 0 };
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+    ssize_t n;
+    do {
+        n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    } while (n == -1 && errno == EINTR);
+    if (n == -1)
+        return -1;
+    // stream socket: the fds travel with the first byte, push any remainder normally
+    return sendAll(sock, (const char*)buf + n, len - n);
+}
+
+// receive len bytes and up to nfds attached file descriptors, return -1 on error or end of file
+int recvWithFds(int sock, void* buf, size_t len, int* fds, int nfds) {
+    char control[CMSG_SPACE(sizeof(int) * 24)] = { 0 };
+    struct iovec iov = { buf, len };
+    struct msghdr msg = { 0 };
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+    ssize_t n;
+    do {
+        n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    } while (n == -1 && errno == EINTR);
+    if (n <= 0)
+        return -1;
+    for (int i = 0; i < nfds; i++) {
+        fds[i] = -1;
+    }
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        int received = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * (received < nfds ? received : nfds));
+    }
+    return readAll(sock, (char*)buf + n, len - n);
+}
+
+// fork server side: receive one spawn request, fork and exec the child and report its pid.
+// Returns -1 once the shell has closed its end of the socket
+int forkServerServe(int sock, sigset_t* childMask) {
+    struct forkRequest req;
+    int fds[21];
+    if (recvWithFds(sock, &req, sizeof(req), fds, 21) == -1) {
+        return -1;
     }
-    else if (strcmp(com.args[0], "cd") == 0) {
-        //with no arguments, "cd" changes to the directory specified in the HOME environment
-        //variable. Can take 1 arg and works w/both absolute and relative paths
-        if (com.numArgs == 1) {
-            chdir(getenv("HOME"));
+    // a header that cannot be right leaves the stream out of step, so the server gives up
+    // and the shell goes back to forking itself
+    if (req.auxCount < 0 || req.auxCount > 16 || req.argc < 1 || req.envc < 0 ||
+        req.payloadLen > (1 << 30) || (size_t)req.argc + req.envc > req.payloadLen) {
+        for (int i = 0; i < 21; i++) {
+            if (fds[i] != -1)
+                close(fds[i]);
         }
-        else if (com.numArgs == 2) {
-            chdir(com.args[1]);
+        return -1;
+    }
+    int* auxFDs = fds + (req.useCgroup ? 5 : 4);
+    char* payload = malloc(req.payloadLen);
+    char** argv = malloc(sizeof(char*) * (req.argc + 1));
+    char** envp = malloc(sizeof(char*) * (req.envc + 1));
+    int failed = readAll(sock, payload, req.payloadLen) == -1;
+    // payload is argc argv strings then envc env strings, each NUL terminated within it
+    char* p = payload;
+    char* end = payload + req.payloadLen;
+    int found = 0;
+    for (; !failed && found < req.argc + req.envc; found++) {
+        char* nul = memchr(p, 0, end - p);
+        if (nul == NULL)
+            break;
+        if (found < req.argc)
+            argv[found] = p;
+        else
+            envp[found - req.argc] = p;
+        p = nul + 1;
+    }
+    if (failed || found < req.argc + req.envc) {
+        for (int i = 0; i < 21; i++) {
+            if (fds[i] != -1)
+                close(fds[i]);
         }
+        free(payload);
+        free(argv);
+        free(envp);
+        if (failed)
+            return -1;
+        struct forkReply refused = { FS_SPAWNED, -1, EINVAL };
+        sendAll(sock, &refused, sizeof(refused));
         return 0;
     }
-    else if (strcmp(com.args[0], "status") == 0) {
-        // prints out either exit status or terminating signal of last foreground
-        // process ran by this shell. If run before any foreground command is run,
-        // returns 0.
-        if (lfStatus == -1234) {
-            printf("exit value 0\n");
-            fflush(stdout);
+    argv[req.argc] = NULL;
+    envp[req.envc] = NULL;
+
+    struct forkReply reply = { FS_SPAWNED, 0, 0 };
+    int pidfd;
+    reply.pid = forkWithPidfd(&pidfd, req.useCgroup ? fds[4] : -1);
+    if (reply.pid == 0) {
+        sigprocmask(SIG_SETMASK, childMask, NULL);
+        childSignals(req.background);
+        if (applySpawnAttr(&req.attr) == 1)
+            exit(1);
+        if (dup2(fds[0], 0) == -1 || dup2(fds[1], 1) == -1 || dup2(fds[2], 2) == -1 || fchdir(fds[3]) == -1) {
+            perror("fork server");
+            exit(1);
         }
-        else {
-            if (WIFEXITED(lfStatus)) {
-                printf("exit value %d\n", WEXITSTATUS(lfStatus));
-                fflush(stdout);
+        // substitution pipes go to the numbers named in the arguments, moved clear of them first
+        int highest = 2;
+        for (int i = 0; i < req.auxCount; i++) {
+            highest = req.auxFDs[i] > highest ? req.auxFDs[i] : highest;
+        }
+        for (int i = 0; i < req.auxCount; i++) {
+            if ((auxFDs[i] = fcntl(auxFDs[i], F_DUPFD_CLOEXEC, highest + 1)) == -1) {
+                perror("fork server");
+                exit(1);
             }
-            else {
-                printf("terminated by signal %d\n", WTERMSIG(lfStatus));
-                fflush(stdout);
+        }
+        for (int i = 0; i < req.auxCount; i++) {
+            if (dup2(auxFDs[i], req.auxFDs[i]) == -1) {
+                perror("fork server");
+                exit(1);
             }
         }
-        return 0;
+        environ = envp; // the command's own PATH is searched
+        execvp(argv[0], argv); // accepting Vector and searching PATH
+        perror("execvp"); // exec only returns on error, print error
+        fflush(stdout);
+        exit(1);
+    }
+    if (reply.pid == -1) {
+        reply.status = errno;
+    }
+    for (int i = 0; i < 21; i++) {
+        if (fds[i] != -1)
+            close(fds[i]);
+    }
+    free(payload);
+    free(argv);
+    free(envp);
+    // hand the pidfd to the shell so it holds a race free handle on the child
+    if (reply.pid > 0 && pidfd != -1) {
+        sendWithFds(sock, &reply, sizeof(reply), &pidfd, 1);
+        close(pidfd);
     }
     else {
-        pid_t spawnPid = fork(); // Fork a new child process
-        switch (spawnPid) {
-        case -1:
-            perror("fork()\n");
+        sendAll(sock, &reply, sizeof(reply));
+    }
+    return 0;
+}
+
+// fork server main loop: serve spawn requests and report exit statuses of its children
+// until the shell closes the socket
+void forkServerLoop(int sock) {
+    struct sigaction sigIgnore = { 0 };
+    sigIgnore.sa_handler = SIG_IGN;
+    sigaction(SIGINT, &sigIgnore, NULL);
+    sigaction(SIGTSTP, &sigIgnore, NULL);
+
+    // SIGCHLD is consumed through a signalfd so exits are reported from the poll loop
+    sigset_t chld, childMask;
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld, &childMask);
+    int sigFD = signalfd(-1, &chld, SFD_CLOEXEC);
+    if (sigFD == -1) {
+        perror("signalfd");
+        exit(1);
+    }
+    struct pollfd pfd[2] = { { sock, POLLIN, 0 }, { sigFD, POLLIN, 0 } };
+    while (1) {
+        if (poll(pfd, 2, -1) == -1) {
+            if (errno == EINTR)
+                continue;
             exit(1);
-            break;
-        case 0:;// *** CHILD PROCESS ***
-            // child ignore SIGTSTP handler install
-            struct sigaction tstpIgnore = { 0 };
-            tstpIgnore.sa_handler = SIG_IGN;
-            sigaction(SIGTSTP, &tstpIgnore, NULL);
-            if (com.background == 0) {
-                // foreground child default SIGINT handler install
-                struct sigaction sigDefault = { 0 };
-                sigDefault.sa_handler = SIG_DFL;
-                sigaction(SIGINT, &sigDefault, NULL);
+        }
+        if (pfd[1].revents & POLLIN) {
+            struct signalfd_siginfo info;
+            read(sigFD, &info, sizeof(info));
+            struct forkReply reply = { FS_EXITED, 0, 0 };
+            while ((reply.pid = waitpid(-1, &reply.status, WNOHANG)) > 0) {
+                sendAll(sock, &reply, sizeof(reply));
             }
-            else {
-                // background child ignore SIGINT handler install
-                struct sigaction sigDefault = { 0 };
-                sigDefault.sa_handler = SIG_IGN;
-                sigaction(SIGINT, &sigDefault, NULL);
-            }
-            // I/0 REDIRECTION 
-            //inputRedirection and outputRedirection functions exit 1 if error encountered
-            if (strcmp(com.input, "") != 0) { 
-                if (inputRedirection(com.input) == 1) // stdin redirect specified
-                    exit(1);
-            }
-            if (strcmp(com.output, "") != 0) { 
-                if (outputRedirection(com.output) == 1) // stdout redirect specified
-                    exit(1);
-            }
-            if (com.background == 1 && strcmp(com.input, "") == 0) {
-                // background process stdin redirection to /dev/null if not specified 
-                if (inputRedirection("/dev/null") == 1)
-                    exit(1);
-            }
-            if (com.background == 1 && strcmp(com.output, "") == 0) {
-                // background process stdout redirection to /dev/null if not specified
-                if (outputRedirection("/dev/null") == 1)
-                    exit(1);
-            }
-            execvp(com.args[0], com.args); // accepting Vector and searching PATH
-            perror("execvp"); // exec only returns on error, print error
-            fflush(stdout);
-            exit(1);
-            break;
-        default: // *** PARENT PROCESS ***
-            if (com.background == 1) {
-                printf("PID %d started in background \n", spawnPid);
-                fflush(stdout);
-                // store background pid in bgRunning array 
-                for (int ind = 0; ind < (sizeof(bgRunning) / sizeof(int)); ind++) {
-                    if (bgRunning[ind] == 0) { // located empty index pos for background pid
-                        bgRunning[ind] = spawnPid;
-                        break;
-                    }
-                }
-                spawnPid = waitpid(spawnPid, &bgStatus, WNOHANG); // background process WNOHANG
+        }
+        if (pfd[0].revents & (POLLIN | POLLHUP)) {
+            if (forkServerServe(sock, &childMask) == -1) {
+                exit(0);
             }
-            else {
-                spawnPid = waitpid(spawnPid, &lfStatus, 0); // foreground process wait for termination
-                if (lfStatus == 2 && com.background == 0) {
-                    // foreground child terminated Signal Value: 2, Signal Name: SIGINT
-                    printf("terminated by signal 2\n");
-                    fflush(stdout);
-                }
+        }
+    }
+}
+
+// start the fork server helper process, return 0 on success
+int forkServerStart() {
+    if (forkServerSock != -1) {
+        return 0;
+    }
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1) {
+        perror("socketpair");
+        return 1;
+    }
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork()");
+        close(sv[0]);
+        close(sv[1]);
+        return 1;
+    }
+    if (pid == 0) {
+        close(sv[0]);
+        forkServerLoop(sv[1]);
+        exit(0);
+    }
+    close(sv[1]);
+    forkServerSock = sv[0];
+    forkServerPid = pid;
+    return 0;
+}
+
+// stop the fork server, refused while it still has children the shell must reap
+int forkServerStop() {
+    int running = 0;
+    for (int ind = 0; ind < (sizeof(serverChildren) / sizeof(struct serverChild)); ind++) {
+        if (serverChildren[ind].pid != 0) {
+            running++;
+        }
+    }
+    if (running > 0) {
+        printf("fork server has %d unreaped children, not stopping\n", running);
+        fflush(stdout);
+        return 1;
+    }
+    close(forkServerSock); // server exits once it reads end of file
+    forkServerSock = -1;
+    waitpid(forkServerPid, NULL, 0);
+    forkServerPid = 0;
+    return 0;
+}
+
+// the fork server's socket failed: close it and reap the server, so the shell forks itself
+void forkServerLost() {
+    close(forkServerSock);
+    forkServerSock = -1;
+    waitpid(forkServerPid, NULL, 0);
+    forkServerPid = 0;
+    // children it still owed us can no longer be reported; their pidfds still tell when
+    // they end, but not how
+    for (int ind = 0; ind < (sizeof(serverChildren) / sizeof(struct serverChild)); ind++) {
+        if (serverChildren[ind].pid != 0 && serverChildren[ind].done == 0)
+            serverChildren[ind].lost = 1;
+    }
+}
+
+// read one reply from the fork server, recording exit reports, return -1 if the server is gone.
+// *pidfd receives the pidfd attached to a FS_SPAWNED reply, or -1
+int forkServerRead(struct forkReply* reply, int* pidfd) {
+    if (recvWithFds(forkServerSock, reply, sizeof(*reply), pidfd, 1) == -1) {
+        forkServerLost();
+        return -1;
+    }
+    if (reply->type == FS_EXITED) {
+        for (int ind = 0; ind < (sizeof(serverChildren) / sizeof(struct serverChild)); ind++) {
+            if (serverChildren[ind].pid == reply->pid) {
+                serverChildren[ind].done = 1;
+                serverChildren[ind].status = reply->status;
+                break;
             }
         }
     }
-    free(line);
     return 0;
 }
 
-int main(void) {
+// spawn com through the fork server. Redirections are opened here and passed to the
+// server with the shell's working directory and cgroupFD. Returns the child pid and its
+// pidfd in *pidfd, -1 if the spawn failed (with forkServerSock -1 when the server is gone)
+// and -2 if a redirection could not be opened (error already printed)
+pid_t forkServerSpawn(struct command* com, int cgroupFD, int* pidfd) {
+    int fds[5] = { com->inFD != -1 ? com->inFD : 0, com->outFD != -1 ? com->outFD : 1, 2, -1, cgroupFD };
+    int opened[2] = { 0, 0 };   // stdin and stdout were opened here and are closed after sending
+    char* input = com->input;
+    char* output = com->output;
+    // background processes default to /dev/null for unspecified redirections
+    if (com->background == 1 && strcmp(input, "") == 0 && com->inFD == -1)
+        input = "/dev/null";
+    if (com->background == 1 && strcmp(output, "") == 0 && com->outFD == -1)
+        output = "/dev/null";
+    if (strcmp(input, "") != 0) {
+        if ((fds[0] = open(input, O_RDONLY | O_CLOEXEC)) == -1) {
+            perror(input); // print input file name: error statement
+            return -2;
+        }
+        opened[0] = 1;
+    }
+    if (strcmp(output, "") != 0) {
+        if ((fds[1] = open(output, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) == -1) {
+            perror(output); // print output file name: error statement
+            if (opened[0])
+                close(fds[0]);
+            return -2;
+        }
+        opened[1] = 1;
+    }
+    fds[3] = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+
+    // pack argv and environment into one payload
+    struct forkRequest req = { com->background, com->attr, cgroupFD != -1, com->auxCount };
+    memcpy(req.auxFDs, com->auxFDs, sizeof(int) * com->auxCount);
+    for (int i = 0; com->args[i] != NULL; i++) {
+        req.payloadLen += strlen(com->args[i]) + 1;
+        req.argc++;
+    }
+    char** envp = buildEnvp();
+    for (char** env = envp; *env != NULL; env++) {
+        req.payloadLen += strlen(*env) + 1;
+        req.envc++;
+    }
+    char* payload = malloc(req.payloadLen);
+    char* p = payload;
+    for (int i = 0; i < req.argc; i++) {
+        p = stpcpy(p, com->args[i]) + 1;
+    }
+    for (char** env = envp; *env != NULL; env++) {
+        p = stpcpy(p, *env) + 1;
+    }
+    int sendFDs[21];
+    int nfds = req.useCgroup ? 5 : 4;
+    memcpy(sendFDs, fds, sizeof(int) * nfds);
+    memcpy(sendFDs + nfds, com->auxFDs, sizeof(int) * com->auxCount);
+    int sent = sendWithFds(forkServerSock, &req, sizeof(req), sendFDs, nfds + com->auxCount);
+    if (sent == 0) {
+        sent = sendAll(forkServerSock, payload, req.payloadLen);
+    }
+    free(payload);
+    for (int i = 0; i < 2; i++) {
+        if (opened[i])
+            close(fds[i]);
+    }
+    close(fds[3]);
+    if (sent == -1) {
+        forkServerLost();
+        return -1;
+    }
+
+    // exit reports for earlier children may arrive ahead of the spawn result
+    struct forkReply reply;
+    do {
+        if (forkServerRead(&reply, pidfd) == -1)
+            return -1;
+    } while (reply.type != FS_SPAWNED);
+    if (reply.pid == -1) {
+        errno = reply.status;
+        return -1;
+    }
+    for (int ind = 0; ind < (sizeof(serverChildren) / sizeof(struct serverChild)); ind++) {
+        if (serverChildren[ind].pid == 0) {
+            serverChildren[ind].pid = reply.pid;
+            serverChildren[ind].done = 0;
+            serverChildren[ind].lost = 0;
+            break;
+        }
+    }
+    return reply.pid;
+}
+
+struct rusage childUsage;   // resource usage of the child waitChild reaped last
+int childUsageKnown = 0;    // 0 if it could not tell, for fork server children
+int childStatusKnown = 1;   // 0 for a fork server child never reported, given as a failure
+
+// waitpid() replacement: waits through the child's pidfd when there is one, so a recycled pid
+// can never be mistaken for it. Fork server children are not children of the shell and are
+// reaped from the server's exit reports instead
+pid_t waitChild(pid_t pid, int pidfd, int* status, int options) {
+    struct serverChild* child = NULL;
+    childUsageKnown = 0;
+    childStatusKnown = 1;
+    for (int ind = 0; ind < (sizeof(serverChildren) / sizeof(struct serverChild)); ind++) {
+        if (serverChildren[ind].pid == pid) {
+            child = &serverChildren[ind];
+            break;
+        }
+    }
+    if (child == NULL && pidfd == -1) {
+        pid_t reaped = wait4(pid, status, options, &childUsage);
+        childUsageKnown = reaped > 0;
+        return reaped;
+    }
+    if (child == NULL) {
+        siginfo_t info;
+        info.si_pid = 0;
+        // the raw call, unlike the libc one, also returns the child's resource usage
+        while (syscall(SYS_waitid, P_PIDFD, pidfd, &info, WEXITED | options, &childUsage) == -1) {
+            if (errno != EINTR)
+                return -1;
+        }
+        if (info.si_pid == 0) {
+            return 0; // WNOHANG and still running
+        }
+        *status = siginfoStatus(&info);
+        childUsageKnown = 1;
+        return pid;
+    }
+    struct forkReply reply;
+    int unused;
+    while (child->done == 0 && !child->lost && forkServerSock != -1) {
+        if (options & WNOHANG) {
+            struct pollfd pfd = { forkServerSock, POLLIN, 0 };
+            if (poll(&pfd, 1, 0) <= 0)
+                return 0;
+        }
+        forkServerRead(&reply, &unused);
+    }
+    if (child->done == 0) {
+        // lost with the server: wait for its pidfd to turn readable as it exits
+        struct pollfd pfd = { pidfd, POLLIN, 0 };
+        while (pidfd != -1 && poll(&pfd, 1, (options & WNOHANG) ? 0 : -1) == -1 && errno == EINTR)
+            ;
+        if (pidfd != -1 && pfd.revents == 0)
+            return 0;
+        child->status = 1 << 8;
+        childStatusKnown = 0;
+    }
+    *status = child->status;
+    child->pid = 0;
+    return pid;
+}
+
+// parse a size such as 512K, 2G or a plain byte count, return -1 if malformed
+long long parseSize(const char* text) {
+    char* end;
+    long long value = strtoll(text, &end, 10);
+    if (end == text || value < 0)
+        return -1;
+    switch (toupper(*end)) {
+    case 'T': value <<= 10; // fall through
+    case 'G': value <<= 10; // fall through
+    case 'M': value <<= 10; // fall through
+    case 'K': value <<= 10; end++; break;
+    case 0: break;
+    default: return -1;
+    }
+    return (*end == 0 || (toupper(*end) == 'B' && end[1] == 0)) ? value : -1;
+}
+
+// parse a plain count, return -1 if malformed
+long long parseCount(const char* text) {
+    char* end;
+    errno = 0;
+    long long value = strtoll(text, &end, 10);
+    if (end == text || *end != 0 || value < 0 || errno == ERANGE)
+        return -1;
+    return value;
+}
+
+// parse a duration in seconds such as 30, 30s, 5m or 1h, return -1 if malformed
+long long parseSeconds(const char* text) {
+    char* end;
+    long long value = strtoll(text, &end, 10);
+    if (end == text || value < 0)
+        return -1;
+    if (strcmp(end, "h") == 0)
+        return value * 3600;
+    if (strcmp(end, "m") == 0)
+        return value * 60;
+    return (strcmp(end, "s") == 0 || *end == 0) ? value : -1;
+}
+
+// drop the first n arguments of com
+void shiftArgs(struct command* com, int n) {
+    for (int i = 0; i + n <= com->numArgs; i++) {
+        com->args[i] = com->args[i + n];
+    }
+    com->numArgs -= n;
+}
+
+// cap a resource for the child, keeping within the shell's own hard limit
+void setJobRlimit(struct spawnAttr* attr, int resource, rlim_t soft, rlim_t hard) {
+    struct rlimit current;
+    getrlimit(resource, &current);
+    if (current.rlim_max != RLIM_INFINITY && hard > current.rlim_max)
+        hard = current.rlim_max;
+    if (soft > hard)
+        soft = hard;
+    attr->rlimits[resource].rlim_cur = soft;
+    attr->rlimits[resource].rlim_max = hard;
+    attr->rlimitMask |= 1 << resource;
+}
+
+// "limit [--mem SIZE] [--cpu TIME] [--fsize SIZE] [--nofile N] [--nproc N] [--cpu-max PCT] cmd"
+// prefix: record the caps in com->attr and strip the prefix, return 1 on a usage error
+int parseLimitPrefix(struct command* com) {
+    int i = 1;
+    while (com->args[i] != NULL && strncmp(com->args[i], "--", 2) == 0) {
+        char* opt = com->args[i];
+        char* value = com->args[i + 1];
+        long long n = -1;
+        if (value == NULL) {
+            break;
+        }
+        if (strcmp(opt, "--mem") == 0 && (n = parseSize(value)) > 0) {
+            // address space cap in the child, plus memory.max when the job gets a cgroup
+            setJobRlimit(&com->attr, RLIMIT_AS, n, n);
+            com->attr.memMax = n;
+        }
+        else if (strcmp(opt, "--cpu") == 0 && (n = parseSeconds(value)) > 0) {
+            // SIGXCPU at the soft limit, SIGKILL a few seconds later if it is ignored
+            setJobRlimit(&com->attr, RLIMIT_CPU, n, n + 5);
+        }
+        else if (strcmp(opt, "--fsize") == 0 && (n = parseSize(value)) >= 0) {
+            setJobRlimit(&com->attr, RLIMIT_FSIZE, n, n);
+        }
+        else if (strcmp(opt, "--nofile") == 0 && (n = parseCount(value)) > 0) {
+            setJobRlimit(&com->attr, RLIMIT_NOFILE, n, n);
+        }
+        else if (strcmp(opt, "--nproc") == 0 && (n = parseCount(value)) > 0) {
+            setJobRlimit(&com->attr, RLIMIT_NPROC, n, n);
+        }
+        else if (strcmp(opt, "--cpu-max") == 0 && (n = parseCount(value)) > 0 && n <= INT_MAX) {
+            com->attr.cpuMaxPercent = n;
+        }
+        else {
+            break;
+        }
+        i += 2;
+    }
+    if (com->args[i] == NULL || strncmp(com->args[i], "--", 2) == 0) {
+        printf("usage: limit [--mem SIZE] [--cpu TIME] [--fsize SIZE] [--nofile N] [--nproc N] [--cpu-max PCT] command\n");
+        fflush(stdout);
+        return 1;
+    }
+    if ((com->attr.memMax > 0 || com->attr.cpuMaxPercent > 0) && jobCgroupFD == -1) {
+        if (com->attr.cpuMaxPercent > 0) {
+            printf("limit: --cpu-max needs a job cgroup (see cgroup), ignored\n");
+            fflush(stdout);
+        }
+        com->attr.memMax = 0;
+        com->attr.cpuMaxPercent = 0;
+    }
+    shiftArgs(com, i);
+    return 0;
+}
+
+// parse a cpu list such as 0-3,6,8-11 into set, return 1 if malformed
+int parseCpuList(const char* text, cpu_set_t* set) {
+    CPU_ZERO(set);
+    const char* p = text;
+    while (*p != 0) {
+        char* end;
+        long first = strtol(p, &end, 10);
+        long last = first;
+        if (end == p || first < 0)
+            return 1;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first)
+                return 1;
+        }
+        if (last >= CPU_SETSIZE)
+            return 1;
+        for (long cpu = first; cpu <= last; cpu++) {
+            CPU_SET(cpu, set);
+        }
+        if (*end == ',')
+            end++;
+        else if (*end != 0)
+            return 1;
+        p = end;
+    }
+    return CPU_COUNT(set) == 0;
+}
+
+// parse an I/O scheduling class (number or name) and optional level into an ioprio_set() value,
+// return -1 if malformed
+int parseIoprio(const char* classText, const char* levelText) {
+    long long ioClass;
+    if (strcmp(classText, "realtime") == 0 || strcmp(classText, "rt") == 0)
+        ioClass = 1;
+    else if (strcmp(classText, "best-effort") == 0 || strcmp(classText, "be") == 0)
+        ioClass = 2;
+    else if (strcmp(classText, "idle") == 0)
+        ioClass = 3;
+    else
+        ioClass = parseCount(classText);
+    long long level = levelText != NULL ? parseCount(levelText) : (ioClass == 3 ? 0 : 4);
+    if (ioClass < 1 || ioClass > 3 || level < 0 || level > 7)
+        return -1;
+    return (ioClass << 13) | level;
+}
+
+// parse a scheduling policy name, return -1 if unknown
+int parseSchedPolicy(const char* text) {
+    if (strcmp(text, "batch") == 0)
+        return SCHED_BATCH;
+    if (strcmp(text, "idle") == 0)
+        return SCHED_IDLE;
+    if (strcmp(text, "other") == 0)
+        return SCHED_OTHER;
+    return -1;
+}
+
+// parse all of text as a nice increment, return 1 if it is not a number. Beyond +-40 it is
+// clamped, as nice values only span -20 to 19 anyway
+int parseNiceIncrement(const char* text, int* increment) {
+    char* end;
+    errno = 0;
+    long n = strtol(text, &end, 10);
+    if (end == text || *end != 0 || errno == ERANGE)
+        return 1;
+    *increment = n < -40 ? -40 : n > 40 ? 40 : n;
+    return 0;
+}
+
+// "affinity CPULIST cmd", "nice [-n N | -N] cmd" and "ionice [-c CLASS] [-n LEVEL] cmd" prefixes:
+// record the setting in com->attr and strip the prefix, return 1 on a usage error
+int parseSchedPrefix(struct command* com) {
+    int i = 1;
+    char* usage = NULL;
+    if (strcmp(com->args[0], "affinity") == 0) {
+        if (com->args[1] == NULL || parseCpuList(com->args[1], &com->attr.cpus) == 1)
+            usage = "affinity CPULIST";
+        com->attr.useAffinity = 1;
+        i = 2;
+    }
+    else if (strcmp(com->args[0], "nice") == 0) {
+        com->attr.useNice = 1;
+        com->attr.niceIncrement = 10;
+        char* value = NULL;
+        if (strcmp(com->args[1], "-n") == 0) {
+            value = com->args[2] != NULL ? com->args[2] : "";
+            i = 3;
+        }
+        else if (com->args[1][0] == '-' && com->args[1][1] != 0 && strcmp(com->args[1], "--") != 0) {
+            // -nN, or the old -N form with --N for a negative N
+            value = com->args[1] + (com->args[1][1] == 'n' ? 2 : 1);
+            i = 2;
+        }
+        if (value != NULL && parseNiceIncrement(value, &com->attr.niceIncrement) == 1)
+            usage = "nice [-n N | -N]";
+        else if (com->args[i] != NULL && strcmp(com->args[i], "--") == 0)
+            i++;
+    }
+    else {
+        char* classText = "2";
+        char* levelText = NULL;
+        while (com->args[i] != NULL && com->args[i + 1] != NULL) {
+            if (strcmp(com->args[i], "-c") == 0)
+                classText = com->args[i + 1];
+            else if (strcmp(com->args[i], "-n") == 0)
+                levelText = com->args[i + 1];
+            else
+                break;
+            i += 2;
+        }
+        com->attr.ioprio = parseIoprio(classText, levelText);
+        if (com->attr.ioprio == -1)
+            usage = "ionice [-c CLASS] [-n LEVEL]";
+    }
+    if (usage == NULL && com->args[i] == NULL) {
+        usage = strcmp(com->args[0], "nice") == 0 ? "nice [-n N | -N]" : strcmp(com->args[0], "ionice") == 0 ? "ionice [-c CLASS] [-n LEVEL]" : "affinity CPULIST";
+    }
+    if (usage != NULL) {
+        printf("usage: %s command\n", usage);
+        fflush(stdout);
+        return 1;
+    }
+    shiftArgs(com, i);
+    return 0;
+}
+
+// cpus of NUMA node, return 1 if there is no such node
+int nodeCpus(int node, cpu_set_t* set) {
+    char path[128], list[4096];
+    sprintf(path, "/sys/devices/system/node/node%d/cpulist", node);
+    int listFD = open(path, O_RDONLY | O_CLOEXEC);
+    if (listFD == -1)
+        return 1;
+    ssize_t n = read(listFD, list, sizeof(list) - 1);
+    close(listFD);
+    if (n <= 0)
+        return 1;
+    list[n] = 0;
+    list[strcspn(list, "\n")] = 0;
+    return parseCpuList(list, set);
+}
+
+// fill in the shell wide background defaults for whatever com's own prefixes left unset,
+// picking the next cpu or NUMA node when spreading jobs round robin
+void applyBgPolicy(struct command* com) {
+    struct spawnAttr* attr = &com->attr;
+    if (!attr->useNice && bgDefaults.useNice) {
+        attr->useNice = 1;
+        attr->niceIncrement = bgDefaults.niceIncrement;
+    }
+    if (attr->ioprio == 0)
+        attr->ioprio = bgDefaults.ioprio;
+    if (attr->schedPolicy == SCHED_OTHER)
+        attr->schedPolicy = bgDefaults.schedPolicy;
+    if (attr->useAffinity || (!bgDefaults.useCpus && bgDefaults.spread == 0))
+        return;
+    cpu_set_t allowed;
+    if (bgDefaults.useCpus)
+        allowed = bgDefaults.cpus;
+    else
+        sched_getaffinity(0, sizeof(allowed), &allowed);
+    attr->useAffinity = 1;
+    attr->cpus = allowed;
+    if (bgDefaults.spread == 1) {
+        // next allowed cpu after the one the previous job got
+        int count = CPU_COUNT(&allowed);
+        int pick = bgDefaults.nextSlot++ % count;
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &allowed) && pick-- == 0) {
+                CPU_ZERO(&attr->cpus);
+                CPU_SET(cpu, &attr->cpus);
+                break;
+            }
+        }
+    }
+    else if (bgDefaults.spread == 2) {
+        // next NUMA node that has any allowed cpu
+        int nodes = 0;
+        cpu_set_t set;
+        while (nodeCpus(nodes, &set) == 0)
+            nodes++;
+        for (int tries = 0; tries < nodes; tries++) {
+            nodeCpus(bgDefaults.nextSlot++ % nodes, &set);
+            CPU_AND(&set, &set, &allowed);
+            if (CPU_COUNT(&set) > 0) {
+                attr->cpus = set;
+                break;
+            }
+        }
+    }
+}
+
+// bgpolicy [off] [--cpus LIST] [--spread off|cpu|node] [--sched other|batch|idle] [--nice N]
+// [--ionice CLASS[:LEVEL]]: set the defaults every background job is launched with, show them
+// with no arguments
+int bgpolicyBuiltin(struct command* com) {
+    for (int i = 1; com->args[i] != NULL; i++) {
+        char* opt = com->args[i];
+        char* value = com->args[i + 1];
+        if (strcmp(opt, "off") == 0) {
+            memset(&bgDefaults, 0, sizeof(bgDefaults));
+            continue;
+        }
+        int bad = 0;
+        if (value == NULL) {
+            bad = 1;
+        }
+        else if (strcmp(opt, "--cpus") == 0) {
+            bad = parseCpuList(value, &bgDefaults.cpus);
+            bgDefaults.useCpus = !bad;
+        }
+        else if (strcmp(opt, "--spread") == 0) {
+            bgDefaults.spread = strcmp(value, "cpu") == 0 ? 1 : strcmp(value, "node") == 0 ? 2 : 0;
+            bad = bgDefaults.spread == 0 && strcmp(value, "off") != 0;
+        }
+        else if (strcmp(opt, "--sched") == 0) {
+            int policy = parseSchedPolicy(value);
+            bad = policy == -1;
+            if (!bad)
+                bgDefaults.schedPolicy = policy;
+        }
+        else if (strcmp(opt, "--nice") == 0) {
+            bad = parseNiceIncrement(value, &bgDefaults.niceIncrement);
+            bgDefaults.useNice |= !bad;
+        }
+        else if (strcmp(opt, "--ionice") == 0) {
+            char classText[32];
+            snprintf(classText, sizeof(classText), "%s", value);
+            char* level = strchr(classText, ':');
+            if (level != NULL)
+                *level++ = 0;
+            int ioprio = parseIoprio(classText, level);
+            bad = ioprio == -1;
+            if (!bad)
+                bgDefaults.ioprio = ioprio;
+        }
+        else {
+            bad = 1;
+        }
+        if (bad) {
+            printf("usage: bgpolicy [off] [--cpus LIST] [--spread off|cpu|node] [--sched other|batch|idle] [--nice N] [--ionice CLASS[:LEVEL]]\n");
+            fflush(stdout);
+            return 1;
+        }
+        i++;
+    }
+    if (com->args[1] != NULL)
+        return 0;
+    printf("cpus: ");
+    if (!bgDefaults.useCpus)
+        printf("all");
+    for (int cpu = 0, first = 1; bgDefaults.useCpus && cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &bgDefaults.cpus)) {
+            printf("%s%d", first ? "" : ",", cpu);
+            first = 0;
+        }
+    }
+    const char* spread[] = { "off", "cpu", "node" };
+    printf("\nspread: %s\nsched: %s\n", spread[bgDefaults.spread],
+        bgDefaults.schedPolicy == SCHED_BATCH ? "batch" : bgDefaults.schedPolicy == SCHED_IDLE ? "idle" : "other");
+    if (bgDefaults.useNice)
+        printf("nice: %d\n", bgDefaults.niceIncrement);
+    if (bgDefaults.ioprio != 0)
+        printf("ionice: class %d level %d\n", bgDefaults.ioprio >> 13, bgDefaults.ioprio & 7);
+    fflush(stdout);
+    return 0;
+}
+
+// create a cgroup leaf under the job cgroup carrying the memory.max and cpu.max caps in attr.
+// Returns its directory fd and stores its path in *path, or -1 if the job needs no leaf or
+// one cannot be made (the job then still gets its rlimits)
+int makeJobCgroup(struct spawnAttr* attr, char** path) {
+    static int seq = 0;
+    char name[64], value[64], base[4096];
+    if (jobCgroupFD == -1 || (attr->memMax == 0 && attr->cpuMaxPercent == 0)) {
+        return -1;
+    }
+    // the controllers must be delegated to children of the job cgroup, fails harmlessly if they are
+    int controlFD = openat(jobCgroupFD, "cgroup.subtree_control", O_WRONLY | O_CLOEXEC);
+    if (controlFD != -1) {
+        write(controlFD, "+memory +cpu", 12);
+        close(controlFD);
+    }
+    sprintf(name, "smallsh-%d-%d", getpid(), ++seq);
+    if (mkdirat(jobCgroupFD, name, 0755) == -1) {
+        perror("cgroup");
+        return -1;
+    }
+    int leafFD = openat(jobCgroupFD, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    struct { const char* file; int set; } caps[2] = { { "memory.max", attr->memMax > 0 }, { "cpu.max", attr->cpuMaxPercent > 0 } };
+    for (int i = 0; i < 2; i++) {
+        if (!caps[i].set)
+            continue;
+        if (i == 0)
+            sprintf(value, "%lld", attr->memMax);
+        else
+            sprintf(value, "%d 100000", attr->cpuMaxPercent * 1000);
+        int capFD = openat(leafFD, caps[i].file, O_WRONLY | O_CLOEXEC);
+        if (capFD == -1 || write(capFD, value, strlen(value)) == -1) {
+            perror(caps[i].file);
+        }
+        if (capFD != -1)
+            close(capFD);
+    }
+    sprintf(value, "/proc/self/fd/%d", jobCgroupFD);
+    ssize_t n = readlink(value, base, sizeof(base) - 1);
+    base[n < 0 ? 0 : n] = 0;
+    *path = malloc(strlen(base) + strlen(name) + 2);
+    sprintf(*path, "%s/%s", base, name);
+    return leafFD;
+}
+
+// remove a per job cgroup leaf once its process has been reaped
+void removeJobCgroup(int leafFD, char* path) {
+    if (leafFD == -1)
+        return;
+    close(leafFD);
+    rmdir(path);
+    free(path);
+}
+
+// name the resource limit that terminated a job with status, "" when no limit is to blame.
+// cpuLimit is the RLIMIT_CPU it ran under; the signal that limit sends is only put down to it
+// when childUsage shows the cpu time reached it. A signal that may have come from elsewhere,
+// a crash under RLIMIT_AS or a job whose usage is unknown (fork server children), is only
+// "possibly" the limit's doing
+const char* limitCause(int rlimitMask, const struct rlimit* cpuLimit, int leafFD, int status) {
+    if (!WIFSIGNALED(status))
+        return "";
+    int sig = WTERMSIG(status);
+    if (leafFD != -1 && sig == SIGKILL) {
+        // the cgroup OOM killer counts its kills in memory.events
+        char events[1024];
+        int eventsFD = openat(leafFD, "memory.events", O_RDONLY | O_CLOEXEC);
+        ssize_t n = eventsFD == -1 ? -1 : read(eventsFD, events, sizeof(events) - 1);
+        if (eventsFD != -1)
+            close(eventsFD);
+        if (n > 0) {
+            events[n] = 0;
+            char* kills = strstr(events, "oom_kill ");
+            if (kills != NULL && atoi(kills + 9) > 0)
+                return "memory limit";
+        }
+    }
+    if ((rlimitMask & (1 << RLIMIT_CPU)) && (sig == SIGXCPU || sig == SIGKILL)) {
+        // SIGXCPU comes at the soft limit and SIGKILL at the hard one; the usage is counted in
+        // ticks, so allow for one
+        rlim_t limit = sig == SIGXCPU ? cpuLimit->rlim_cur : cpuLimit->rlim_max;
+        double used = childUsage.ru_utime.tv_sec + childUsage.ru_stime.tv_sec +
+            (childUsage.ru_utime.tv_usec + childUsage.ru_stime.tv_usec) / 1e6;
+        if (!childUsageKnown)
+            return "possibly cpu time limit";
+        if (limit != RLIM_INFINITY && used + 0.1 >= limit)
+            return "cpu time limit";
+    }
+    if ((rlimitMask & (1 << RLIMIT_FSIZE)) && sig == SIGXFSZ)
+        return "file size limit";
+    if ((rlimitMask & (1 << RLIMIT_AS)) && (sig == SIGSEGV || sig == SIGABRT || sig == SIGBUS))
+        return "possibly memory limit";
+    return "";
+}
+
+// ulimit [-SH] [-a | -c|-d|-f|-l|-m|-n|-s|-t|-u|-v [value]]: show or set the shell's own
+// resource limits, which every later command inherits. Sets both soft and hard limits
+// unless -S or -H is given, and shows the soft limit unless -H is given
+int ulimitBuiltin(struct command* com) {
+    struct { char flag; int resource; int unit; const char* desc; } table[] = {
+        { 'c', RLIMIT_CORE, 1024, "core file size          (blocks, -c)" },
+        { 'd', RLIMIT_DATA, 1024, "data seg size           (kbytes, -d)" },
+        { 'f', RLIMIT_FSIZE, 1024, "file size               (blocks, -f)" },
+        { 'l', RLIMIT_MEMLOCK, 1024, "max locked memory       (kbytes, -l)" },
+        { 'm', RLIMIT_RSS, 1024, "max memory size         (kbytes, -m)" },
+        { 'n', RLIMIT_NOFILE, 1, "open files                      (-n)" },
+        { 's', RLIMIT_STACK, 1024, "stack size              (kbytes, -s)" },
+        { 't', RLIMIT_CPU, 1, "cpu time               (seconds, -t)" },
+        { 'u', RLIMIT_NPROC, 1, "max user processes              (-u)" },
+        { 'v', RLIMIT_AS, 1024, "virtual memory          (kbytes, -v)" },
+    };
+    int count = sizeof(table) / sizeof(table[0]);
+    int soft = 0, hard = 0, all = 0, which = 2; // -f is the default
+    char* value = NULL;
+    for (int i = 1; com->args[i] != NULL; i++) {
+        char* arg = com->args[i];
+        if (arg[0] != '-') {
+            value = arg;
+            continue;
+        }
+        for (int j = 1; arg[j] != 0; j++) {
+            int found = 0;
+            if (arg[j] == 'S')
+                soft = found = 1;
+            else if (arg[j] == 'H')
+                hard = found = 1;
+            else if (arg[j] == 'a')
+                all = found = 1;
+            for (int k = 0; k < count && !found; k++) {
+                if (table[k].flag == arg[j]) {
+                    which = k;
+                    found = 1;
+                }
+            }
+            if (!found) {
+                printf("ulimit: -%c: invalid option\n", arg[j]);
+                fflush(stdout);
+                return 1;
+            }
+        }
+    }
+    struct rlimit lim;
+    if (value != NULL && !all) {
+        rlim_t n = RLIM_INFINITY;
+        if (strcmp(value, "unlimited") != 0) {
+            char* end;
+            n = strtoull(value, &end, 10);
+            if (end == value || *end != 0) {
+                printf("ulimit: %s: invalid number\n", value);
+                fflush(stdout);
+                return 1;
+            }
+            n *= table[which].unit;
+        }
+        getrlimit(table[which].resource, &lim);
+        if (soft || !hard)
+            lim.rlim_cur = n;
+        if (hard || !soft)
+            lim.rlim_max = n;
+        if (setrlimit(table[which].resource, &lim) == -1) {
+            perror("ulimit");
+            return 1;
+        }
+        return 0;
+    }
+    for (int k = 0; k < count; k++) {
+        if (!all && k != which)
+            continue;
+        getrlimit(table[k].resource, &lim);
+        rlim_t n = hard ? lim.rlim_max : lim.rlim_cur;
+        if (all)
+            printf("%s ", table[k].desc);
+        if (n == RLIM_INFINITY)
+            printf("unlimited\n");
+        else
+            printf("%llu\n", (unsigned long long)n / table[k].unit);
+    }
+    fflush(stdout);
+    return 0;
+}
+
+// close the pipes of a finished coprocess and remove its NAME_0, NAME_1 and NAME_PID
+void endCoproc(struct job* job) {
+    const char* suffixes[] = { "_0", "_1", "_PID" };
+    char var[300];
+    for (int i = 0; i < 3; i++) {
+        snprintf(var, sizeof(var), "%s%s", job->coprocName, suffixes[i]);
+        varUnset(var);
+    }
+    close(job->coprocFDs[0]);
+    close(job->coprocFDs[1]);
+    free(job->coprocName);
+    job->coprocName = NULL;
+}
+
+// remove job ind, which has exited and been waited for, from the job table
+void removeJob(int ind) {
+    if (bgJobs[ind].pidfd != -1)
+        close(bgJobs[ind].pidfd);
+    removeJobCgroup(bgJobs[ind].cgroupFD, bgJobs[ind].cgroupPath);
+    if (bgJobs[ind].coprocName != NULL)
+        endCoproc(&bgJobs[ind]);
+    bgJobs[ind].pid = 0;
+}
+
+// check status of background processes not yet verified to have exited, report and remove
+// the finished ones. Returns the number removed
+int reapJobs() {
+    int reaped = 0;
+    int childStatus;
+    int testPID;
+    for (int ind = 0; ind < (sizeof(bgJobs) / sizeof(struct job)); ind++) {
+        if (bgJobs[ind].pid == 0) {
+            continue;
+        }
+        testPID = waitChild(bgJobs[ind].pid, bgJobs[ind].pidfd, &childStatus, WNOHANG); // returns 0 when PID still running
+        if (testPID == -1) {
+            childStatus = 0; // already reaped elsewhere, nothing left to report
+        }
+        if (testPID != 0) {
+            // process substitutions end with their command, quietly
+            if (bgJobs[ind].owner == 0 && !childStatusKnown) {
+                printf("background pid %d is done. exit status unknown\n", bgJobs[ind].pid);
+                fflush(stdout);
+            }
+            else if (bgJobs[ind].owner == 0 && WIFEXITED(childStatus)) { // returns true if the child was terminated normally
+                printf("background pid %d is done. exit value %d\n", bgJobs[ind].pid, WEXITSTATUS(childStatus));
+                fflush(stdout);
+            }
+            else if (bgJobs[ind].owner == 0 && WIFSIGNALED(childStatus)) { // returns true if the child was terminated abnormally
+                const char* cause = limitCause(bgJobs[ind].rlimitMask, &bgJobs[ind].cpuLimit, bgJobs[ind].cgroupFD, childStatus);
+                printf("background pid %d is done: terminated by signal %d%s%s%s\n", bgJobs[ind].pid, WTERMSIG(childStatus),
+                    cause[0] ? " (" : "", cause, cause[0] ? ")" : "");
+                fflush(stdout);
+            }
+            removeJob(ind);
+            reaped++;
+        }
+    }
+    return reaped;
+}
+
+// "some avg10" from a /proc/pressure file, 0 if unavailable
+double readPressure(const char* path) {
+    char text[256];
+    int pressureFD = open(path, O_RDONLY | O_CLOEXEC);
+    if (pressureFD == -1)
+        return 0;
+    ssize_t n = read(pressureFD, text, sizeof(text) - 1);
+    close(pressureFD);
+    if (n <= 0)
+        return 0;
+    text[n] = 0;
+    char* avg = strstr(text, "avg10=");
+    return avg != NULL ? atof(avg + 6) : 0;
+}
+
+// 1 minute load average, 0 if unavailable
+double readLoadAverage() {
+    char text[128];
+    int loadFD = open("/proc/loadavg", O_RDONLY | O_CLOEXEC);
+    if (loadFD == -1)
+        return 0;
+    ssize_t n = read(loadFD, text, sizeof(text) - 1);
+    close(loadFD);
+    if (n <= 0)
+        return 0;
+    text[n] = 0;
+    return atof(text);
+}
+
+// reason a new background job may not start now, NULL if it may
+const char* admissionBlocked() {
+    if (admitLimits.maxJobs > 0) {
+        int running = 0;
+        for (int ind = 0; ind < (sizeof(bgJobs) / sizeof(struct job)); ind++) {
+            if (bgJobs[ind].pid != 0 && bgJobs[ind].owner == 0)
+                running++;
+        }
+        if (running >= admitLimits.maxJobs)
+            return "job limit";
+    }
+    if (admitLimits.cpuPressure > 0 && readPressure("/proc/pressure/cpu") > admitLimits.cpuPressure)
+        return "cpu pressure";
+    if (admitLimits.memPressure > 0 && readPressure("/proc/pressure/memory") > admitLimits.memPressure)
+        return "memory pressure";
+    if (admitLimits.ioPressure > 0 && readPressure("/proc/pressure/io") > admitLimits.ioPressure)
+        return "io pressure";
+    if (admitLimits.loadAverage > 0 && readLoadAverage() > admitLimits.loadAverage)
+        return "load average";
+    return NULL;
+}
+
+// copy com for the admission queue, with its own argument strings and working directory
+struct command* queueCopy(struct command* com) {
+    struct command* copy = malloc(sizeof(struct command));
+    *copy = *com;
+    copy->args = malloc(sizeof(char*) * (com->numArgs + 1));
+    for (int i = 0; i <= com->numArgs; i++) {
+        copy->args[i] = com->args[i] != NULL ? strdup(com->args[i]) : NULL;
+    }
+    copy->cwdFD = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (com->inFD != -1)
+        copy->inFD = fcntl(com->inFD, F_DUPFD_CLOEXEC, 3);
+    if (com->outFD != -1)
+        copy->outFD = fcntl(com->outFD, F_DUPFD_CLOEXEC, 3);
+    return copy;
+}
+
+// free a command made by queueCopy
+void queueFree(struct command* com) {
+    for (int i = 0; com->args[i] != NULL; i++) {
+        free(com->args[i]);
+    }
+    free(com->args);
+    if (com->cwdFD != -1)
+        close(com->cwdFD);
+    if (com->inFD != -1)
+        close(com->inFD);
+    if (com->outFD != -1)
+        close(com->outFD);
+    for (int i = 0; i < com->auxCount; i++) {
+        close(com->auxFDs[i]);
+    }
+    free(com);
+}
+
+void launchCommand(struct command* com);
+
+// start queued background jobs, oldest first, for as long as admission allows.
+// Returns the number started
+int admitJobs() {
+    int started = 0;
+    while (admitQueued > 0 && admissionBlocked() == NULL) {
+        struct command* com = admitQueue[0];
+        admitQueued--;
+        memmove(admitQueue, admitQueue + 1, sizeof(struct command*) * admitQueued);
+        // launch from the directory the job was submitted in
+        int shellCwd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+        fchdir(com->cwdFD);
+        launchCommand(com);
+        fchdir(shellCwd);
+        close(shellCwd);
+        queueFree(com);
+        started++;
+    }
+    return started;
+}
+
+// admit [off] [--max N] [--cpu PCT] [--mem PCT] [--io PCT] [--load N]: set the thresholds above
+// which new background jobs are queued instead of started, show them and the current readings
+// with no arguments
+int admitBuiltin(struct command* com) {
+    struct admission limits = admitLimits;  // applied only once every argument is valid
+    for (int i = 1; com->args[i] != NULL; i++) {
+        char* opt = com->args[i];
+        char* value = com->args[i + 1];
+        if (strcmp(opt, "off") == 0) {
+            memset(&limits, 0, sizeof(limits));
+            continue;
+        }
+        // each value is a number of at least 0, a whole one for --max
+        char* end = NULL;
+        double number = value != NULL ? strtod(value, &end) : -1;
+        int valid = value != NULL && end != value && *end == 0 && number >= 0 && number <= 1e9;
+        if (valid && strcmp(opt, "--max") == 0 && strspn(value, "0123456789") == strlen(value))
+            limits.maxJobs = strtol(value, NULL, 10);
+        else if (valid && strcmp(opt, "--cpu") == 0)
+            limits.cpuPressure = number;
+        else if (valid && strcmp(opt, "--mem") == 0)
+            limits.memPressure = number;
+        else if (valid && strcmp(opt, "--io") == 0)
+            limits.ioPressure = number;
+        else if (valid && strcmp(opt, "--load") == 0)
+            limits.loadAverage = number;
+        else {
+            printf("usage: admit [off] [--max N] [--cpu PCT] [--mem PCT] [--io PCT] [--load N]\n");
+            fflush(stdout);
+            return 1;
+        }
+        i++;
+    }
+    admitLimits = limits;
+    if (com->args[1] != NULL) {
+        admitJobs(); // relaxed limits may let queued jobs go
+        return 0;
+    }
+    printf("max jobs: %d\n", admitLimits.maxJobs);
+    printf("cpu pressure: %.2f (now %.2f)\n", admitLimits.cpuPressure, readPressure("/proc/pressure/cpu"));
+    printf("memory pressure: %.2f (now %.2f)\n", admitLimits.memPressure, readPressure("/proc/pressure/memory"));
+    printf("io pressure: %.2f (now %.2f)\n", admitLimits.ioPressure, readPressure("/proc/pressure/io"));
+    printf("load average: %.2f (now %.2f)\n", admitLimits.loadAverage, readLoadAverage());
+    printf("queued: %d\n", admitQueued);
+    fflush(stdout);
+    return 0;
+}
+
+// file a tail -f follows, fed from inotify events rather than by polling it
+struct follower {
+    char* name;     // NULL marks an empty slot
+    int fd;         // the file, positioned after what has been printed
+    int out;        // the follower's own descriptor for its output
+    int wd;         // inotify watch on the file
+    int headers;    // followed along with other files: print ==> NAME <== when output switches to it
+    int background; // tail -f &, fed while the shell waits for input and ended by removing the file
+};
+struct follower followers[16];
+int followCount = 0;
+int followInotify = -1;                 // one instance for all followers, non-blocking
+struct follower* followShown = NULL;    // whose output was printed last
+
+int followEvents();
+
+// wait for the next command line while background jobs are queued, retrying admission every
+// half second so queued jobs start as soon as pressure drops, or while files are followed in
+// the background, printing what is appended to them. Returns -1 if interrupted by a signal
+int waitForInput() {
+    // only input with nothing left in its buffer can sit idle here; a terminal or a pipe may,
+    // a script file polls readable at once
+    while ((admitQueued > 0 || followCount > 0) && input.start >= input.end) {
+        struct pollfd pfd[2] = { { input.fd, POLLIN, 0 }, { followInotify, POLLIN, 0 } };
+        int ready = poll(pfd, followCount > 0 ? 2 : 1, admitQueued > 0 ? 500 : -1);
+        if (ready == -1 && errno == EINTR)
+            return -1;
+        if (pfd[0].revents != 0)
+            break;
+        if (((ready > 0 && followEvents() > 0) || (ready == 0 && reapJobs() + admitJobs() > 0)) && !scriptMode) {
+            printf(":"); // the notices above overwrote the prompt
+            fflush(stdout);
+        }
+    }
+    return 0;
+}
+
+// current CLOCK_MONOTONIC time in seconds
+double monotonicSeconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// refill bucket up to now and take a token if take is set and one is available.
+// Returns 0 if a token is available, otherwise the seconds until one will be
+double bucketWait(struct tokenBucket* bucket, double now, int take) {
+    if (bucket->rate <= 0)
+        return 0;
+    bucket->tokens += (now - bucket->last) * bucket->rate;
+    if (bucket->tokens > bucket->burst)
+        bucket->tokens = bucket->burst;
+    bucket->last = now;
+    if (bucket->tokens >= 1) {
+        if (take)
+            bucket->tokens -= 1;
+        return 0;
+    }
+    return (1 - bucket->tokens) / bucket->rate;
+}
+
+// map the per user bucket shared by all shells, creating it if create is set.
+// Returns 0 when globalBucket is usable
+int openGlobalBucket(int create) {
+    if (globalBucket != NULL)
+        return 0;
+    char path[64];
+    sprintf(path, "/dev/shm/smallsh-spawnrate-%d", (int)getuid());
+    globalBucketFD = open(path, O_RDWR | O_CLOEXEC | (create ? O_CREAT : 0), 0600);
+    if (globalBucketFD == -1)
+        return -1;
+    struct stat info;
+    if (fstat(globalBucketFD, &info) == -1 || (info.st_size < sizeof(struct tokenBucket) && ftruncate(globalBucketFD, sizeof(struct tokenBucket)) == -1)) {
+        close(globalBucketFD);
+        globalBucketFD = -1;
+        return -1;
+    }
+    globalBucket = mmap(NULL, sizeof(struct tokenBucket), PROT_READ | PROT_WRITE, MAP_SHARED, globalBucketFD, 0);
+    if (globalBucket == MAP_FAILED) {
+        globalBucket = NULL;
+        close(globalBucketFD);
+        globalBucketFD = -1;
+        return -1;
+    }
+    return 0;
+}
+
+volatile sig_atomic_t copyInterrupted = 0;    // SIGINT arrived while a builtin moved data
+
+void copyIntHandler(int signo) {
+    copyInterrupted = 1;
+}
+
+// while a builtin moves data (on set) SIGINT interrupts its system calls rather than being
+// ignored, and a closed pipe gives EPIPE rather than SIGPIPE for the shell; saved keeps the
+// dispositions to restore (on clear)
+void copySignals(int on, struct sigaction saved[2]) {
+    if (on) {
+        struct sigaction interrupt = { 0 };
+        struct sigaction ignore = { 0 };
+        interrupt.sa_handler = backgroundSubshell ? SIG_IGN : copyIntHandler;  // no SA_RESTART
+        ignore.sa_handler = SIG_IGN;
+        copyInterrupted = 0;
+        sigaction(SIGINT, &interrupt, &saved[0]);
+        sigaction(SIGPIPE, &ignore, &saved[1]);
+    }
+    else {
+        sigaction(SIGINT, &saved[0], NULL);
+        sigaction(SIGPIPE, &saved[1], NULL);
+    }
+}
+
+// take a spawn token from the session and global buckets, sleeping until both have one or,
+// in reject mode, failing. Returns 0 if the launch may go ahead, -1 if it is rejected and -2
+// if SIGINT ended the wait
+int spawnPermit() {
+    double waited = 0;
+    struct sigaction saved[2];
+    int interruptible = 0;
+    int outer = copyInterrupted;    // a builtin launching commands keeps its own interrupt
+    openGlobalBucket(0); // another shell may have set up the global limit since
+    while (1) {
+        double now = monotonicSeconds();
+        // peek at both buckets first so a token is only taken when both have one
+        double wait = bucketWait(&sessionBucket, now, 0);
+        if (globalBucket != NULL) {
+            flock(globalBucketFD, LOCK_EX);
+            double globalWait = bucketWait(globalBucket, now, 0);
+            if (globalWait > wait)
+                wait = globalWait;
+            if (wait == 0)
+                bucketWait(globalBucket, now, 1);
+            flock(globalBucketFD, LOCK_UN);
+        }
+        if (wait == 0) {
+            bucketWait(&sessionBucket, now, 1);
+            break;
+        }
+        if (rateReject) {
+            rateStats.rejected++;
+            return -1;
+        }
+        // a low rate may mean a long wait, which SIGINT gives up
+        if (!interruptible)
+            copySignals(1, saved);
+        interruptible = 1;
+        struct timespec nap = { (time_t)wait, (long)((wait - (time_t)wait) * 1e9) };
+        nanosleep(&nap, NULL);
+        waited += monotonicSeconds() - now;
+        if (copyInterrupted)
+            break;
+    }
+    if (interruptible)
+        copySignals(0, saved);
+    if (interruptible && copyInterrupted)
+        return -2;
+    copyInterrupted = outer;
+    rateStats.launched++;
+    if (waited > 0) {
+        rateStats.delayed++;
+        rateStats.delaySeconds += waited;
+    }
+    return 0;
+}
+
+// ratelimit [off] [--global] [--rate N] [--burst N] [--mode delay|reject]: limit how many
+// commands per second this session, or with --global every shell of this user, may spawn.
+// Shows the limits and throttling counters with no arguments
+int ratelimitBuiltin(struct command* com) {
+    int global = 0;
+    double rate = -1, burst = -1;
+    for (int i = 1; com->args[i] != NULL; i++) {
+        char* opt = com->args[i];
+        char* value = com->args[i + 1];
+        if (strcmp(opt, "--global") == 0) {
+            global = 1;
+            continue;
+        }
+        if (strcmp(opt, "off") == 0) {
+            rate = 0;
+            continue;
+        }
+        // a number strtod takes whole, which also turns away nan and inf
+        char* end = NULL;
+        double number = value != NULL ? strtod(value, &end) : 0;
+        int numeric = value != NULL && end != value && *end == 0 && number <= 1e9;
+        if (numeric && strcmp(opt, "--rate") == 0 && number > 0)
+            rate = number;
+        else if (numeric && strcmp(opt, "--burst") == 0 && number >= 1)
+            burst = number;
+        else if (value != NULL && strcmp(opt, "--mode") == 0 && (strcmp(value, "delay") == 0 || strcmp(value, "reject") == 0))
+            rateReject = strcmp(value, "reject") == 0;
+        else {
+            printf("usage: ratelimit [off] [--global] [--rate N] [--burst N] [--mode delay|reject]\n");
+            fflush(stdout);
+            return 1;
+        }
+        i++;
+    }
+    if (rate >= 0 || burst >= 0) {
+        if (global && openGlobalBucket(1) == -1) {
+            perror("ratelimit");
+            return 1;
+        }
+        struct tokenBucket* bucket = global ? globalBucket : &sessionBucket;
+        if (global)
+            flock(globalBucketFD, LOCK_EX);
+        if (rate >= 0)
+            bucket->rate = rate;
+        if (burst >= 0)
+            bucket->burst = burst;
+        else if (bucket->burst < 1)
+            bucket->burst = bucket->rate > 1 ? bucket->rate : 1;
+        bucket->tokens = bucket->burst;
+        bucket->last = monotonicSeconds();
+        if (global)
+            flock(globalBucketFD, LOCK_UN);
+    }
+    if (com->args[1] != NULL)
+        return 0;
+    openGlobalBucket(0);
+    struct tokenBucket* buckets[2] = { &sessionBucket, globalBucket };
+    const char* names[2] = { "session", "global" };
+    for (int i = 0; i < 2; i++) {
+        if (buckets[i] == NULL || buckets[i]->rate <= 0)
+            printf("%s: unlimited\n", names[i]);
+        else
+            printf("%s: %g/s burst %g\n", names[i], buckets[i]->rate, buckets[i]->burst);
+    }
+    printf("mode: %s\n", rateReject ? "reject" : "delay");
+    printf("launched %ld, delayed %ld (%.3fs), rejected %ld\n", rateStats.launched, rateStats.delayed,
+        rateStats.delaySeconds, rateStats.rejected);
+    fflush(stdout);
+    return 0;
+}
+
+// a process started by spawnCommand
+struct spawned {
+    pid_t pid;
+    int pidfd;
+    int cgroupFD;       // per job cgroup leaf, -1 if none
+    char* cgroupPath;
+};
+
+// start com without waiting for it, through the fork server when it is running.
+// Returns 0 with the process in *sp, or 1 if it was not started (error already reported)
+int spawnCommand(struct command* com, struct spawned* sp) {
+    pid_t spawnPid = -1;
+    int pidfd = -1;
+    int permit = spawnPermit();
+    if (permit != 0) {
+        printf(permit == -1 ? "spawn rate limit exceeded, %s not started\n" : "interrupted waiting for the spawn rate limit, %s not started\n", com->args[0]);
+        fflush(stdout);
+        return 1;
+    }
+    // exported variables, only rebuilt when they changed
+    char** envp = buildEnvp();
+    // jobs with cgroup caps get a leaf of their own, others go straight into the job cgroup
+    char* cgroupPath = NULL;
+    int cgroupFD = makeJobCgroup(&com->attr, &cgroupPath);
+    if (forkServerSock != -1) {
+        // spawn through the fork server, falling back to fork if it has gone away
+        spawnPid = forkServerSpawn(com, cgroupFD != -1 ? cgroupFD : jobCgroupFD, &pidfd);
+        if (spawnPid == -2) {
+            removeJobCgroup(cgroupFD, cgroupPath);
+            return 1;
+        }
+        // the server is still there but its fork failed: a failed launch, not worth a retry
+        if (spawnPid == -1 && forkServerSock != -1) {
+            perror("fork server");
+            removeJobCgroup(cgroupFD, cgroupPath);
+            return 1;
+        }
+    }
+    if (forkServerSock == -1) {
+        spawnPid = forkWithPidfd(&pidfd, cgroupFD != -1 ? cgroupFD : jobCgroupFD); // Fork a new child process
+    }
+    switch (spawnPid) {
+    case -1:
+        // out of processes or memory (RLIMIT_NPROC, pids.max): this command is not started,
+        // the shell goes on
+        perror("fork()");
+        removeJobCgroup(cgroupFD, cgroupPath);
+        return 1;
+    case 0:// *** CHILD PROCESS ***
+        // child ignores SIGTSTP, SIGINT default in foreground and ignored in background
+        childSignals(com->background);
+        if (applySpawnAttr(&com->attr) == 1)
+            exit(1);
+        // I/0 REDIRECTION 
+        //inputRedirection and outputRedirection functions exit 1 if error encountered
+        if (com->outFD != -1 && dup2(com->outFD, 1) == -1) { // stdout captured by the shell
+            perror("dup2");
+            exit(1);
+        }
+        if (com->inFD != -1 && dup2(com->inFD, 0) == -1) { // stdin from a here-document
+            perror("dup2");
+            exit(1);
+        }
+        for (int i = 0; i < com->auxCount; i++) {
+            fcntl(com->auxFDs[i], F_SETFD, 0); // process substitution pipes survive exec
+        }
+        if (strcmp(com->input, "") != 0) { 
+            if (inputRedirection(com->input) == 1) // stdin redirect specified
+                exit(1);
+        }
+        if (strcmp(com->output, "") != 0) { 
+            if (outputRedirection(com->output) == 1) // stdout redirect specified
+                exit(1);
+        }
+        if (com->background == 1 && strcmp(com->input, "") == 0 && com->inFD == -1) {
+            // background process stdin redirection to /dev/null if not specified 
+            if (inputRedirection("/dev/null") == 1)
+                exit(1);
+        }
+        if (com->background == 1 && strcmp(com->output, "") == 0 && com->outFD == -1) {
+            // background process stdout redirection to /dev/null if not specified
+            if (outputRedirection("/dev/null") == 1)
+                exit(1);
+        }
+        environ = envp;
+        execvp(com->args[0], com->args); // accepting Vector and searching PATH
+        perror("execvp"); // exec only returns on error, print error
+        fflush(stdout);
+        exit(1);
+        break;
+    }
+    // *** PARENT PROCESS ***
+    // its process substitutions now belong to it
+    for (int ind = 0; com->auxCount > 0 && ind < (sizeof(bgJobs) / sizeof(struct job)); ind++) {
+        for (int i = 0; i < com->auxCount; i++) {
+            if (bgJobs[ind].pid != 0 && bgJobs[ind].pid == com->auxPids[i] && bgJobs[ind].owner == -1)
+                bgJobs[ind].owner = spawnPid;
+        }
+    }
+    sp->pid = spawnPid;
+    sp->pidfd = pidfd;
+    sp->cgroupFD = cgroupFD;
+    sp->cgroupPath = cgroupPath;
+    return 0;
+}
+
+// wait for a foreground process started by spawnCommand and record its status
+void waitForeground(struct command* com, struct spawned* sp) {
+    waitChild(sp->pid, sp->pidfd, &lfStatus, 0); // foreground process wait for termination
+    if (!childStatusKnown) {
+        printf("pid %d is done. exit status unknown\n", sp->pid);
+        fflush(stdout);
+    }
+    if (sp->pidfd != -1)
+        close(sp->pidfd);
+    lfCause = limitCause(com->attr.rlimitMask, &com->attr.rlimits[RLIMIT_CPU], sp->cgroupFD, lfStatus);
+    removeJobCgroup(sp->cgroupFD, sp->cgroupPath);
+    if (lfStatus == 2) {
+        // foreground child terminated Signal Value: 2, Signal Name: SIGINT
+        printf("terminated by signal 2\n");
+        fflush(stdout);
+    }
+}
+
+// store the process sp started for com in the job table, reaped at the next prompt.
+// Returns its index, -1 if the table is full
+int addJob(struct command* com, struct spawned* sp, pid_t owner) {
+    for (int ind = 0; ind < (sizeof(bgJobs) / sizeof(struct job)); ind++) {
+        if (bgJobs[ind].pid == 0) { // located empty index pos for background pid
+            bgJobs[ind].pid = sp->pid;
+            bgJobs[ind].pidfd = sp->pidfd;
+            bgJobs[ind].rlimitMask = com->attr.rlimitMask;
+            bgJobs[ind].cpuLimit = com->attr.rlimits[RLIMIT_CPU];
+            bgJobs[ind].cgroupFD = sp->cgroupFD;
+            bgJobs[ind].cgroupPath = sp->cgroupPath;
+            bgJobs[ind].owner = owner;
+            bgJobs[ind].coprocName = NULL;
+            bgJobs[ind].command[0] = 0;
+            for (int j = 0; com->args[j] != NULL; j++) {
+                int used = strlen(bgJobs[ind].command);
+                snprintf(bgJobs[ind].command + used, sizeof(bgJobs[ind].command) - used, "%s%s", j > 0 ? " " : "", com->args[j]);
+            }
+            return ind;
+        }
+    }
+    return -1;
+}
+
+struct builtin* findBuiltin(struct command* com);
+int spawnBuiltinJob(struct command* com, struct builtin* b, struct spawned* sp);
+
+// spawn com, wait for it in the foreground or record it in the job table in the background,
+// where a data builtin is a job too
+void launchCommand(struct command* com) {
+    struct spawned sp;
+    struct builtin* b = com->background == 1 ? findBuiltin(com) : NULL;
+    if ((b != NULL ? spawnBuiltinJob(com, b, &sp) : spawnCommand(com, &sp)) == 1) {
+        if (com->background == 0)
+            lfStatus = 1 << 8; // same status the child reports for a failed redirection
+        return;
+    }
+    if (com->background == 0) {
+        waitForeground(com, &sp);
+        return;
+    }
+    printf("PID %d started in background \n", sp.pid);
+    fflush(stdout);
+    addJob(com, &sp, 0);
+}
+
+// exit code of the last foreground process as $? reports it
+int lastExitCode() {
+    if (lfStatus == -1234)
+        return 0;
+    if (WIFEXITED(lfStatus))
+        return WEXITSTATUS(lfStatus);
+    return 128 + WTERMSIG(lfStatus);
+}
+
+// true for the blanks that separate words and split unquoted expansion results
+int isBlank(char c) {
+    return c == ' ' || c == '\t' || c == '\n';
+}
+
+// length of the variable name at the start of s, 0 if s does not start with one
+size_t nameLength(const char* s) {
+    size_t n = 0;
+    if (!isalpha((unsigned char)s[0]) && s[0] != '_')
+        return 0;
+    while (isalnum((unsigned char)s[n]) || s[n] == '_')
+        n++;
+    return n;
+}
+
+// skip the quoted, bracketed or substituted section starting at p, return the character
+// after it or NULL if it is not closed before the end of the string
+char* skipQuoted(char* p) {
+    if (*p == '\'') {
+        char* close = strchr(p + 1, '\'');
+        return close != NULL ? close + 1 : NULL;
+    }
+    if (*p == '"') {
+        for (p++; *p != '"'; p++) {
+            if (*p == 0)
+                return NULL;
+            if (*p == '\\' && p[1] != 0)
+                p++;
+            else if ((*p == '$' && p[1] == '(') || *p == '`') {
+                // a substitution inside double quotes may contain quotes of its own
+                p = skipQuoted(*p == '$' ? p + 1 : p);
+                if (p == NULL)
+                    return NULL;
+                p--;
+            }
+        }
+        return p + 1;
+    }
+    if (*p == '(') {
+        // $(...) runs to the matching parenthesis outside of quotes
+        int depth = 1;
+        for (p++; *p != 0; p++) {
+            if (*p == '\\' && p[1] != 0)
+                p++;
+            else if (*p == '\'' || *p == '"' || *p == '`') {
+                p = skipQuoted(p);
+                if (p == NULL)
+                    return NULL;
+                p--;
+            }
+            else if (*p == '(')
+                depth++;
+            else if (*p == ')' && --depth == 0)
+                return p + 1;
+        }
+        return NULL;
+    }
+    if (*p == '`') {
+        for (p++; *p != '`'; p++) {
+            if (*p == 0)
+                return NULL;
+            if (*p == '\\' && p[1] != 0)
+                p++;
+        }
+        return p + 1;
+    }
+    if (*p == '{') {
+        char* close = strchr(p + 1, '}');
+        return close != NULL ? close + 1 : NULL;
+    }
+    return p + 1;
+}
+
+// split line in place into blank separated words, keeping quoted, ${...}, substituted and
+// <(...) >(...) sections whole.
+// Returns the number of words stored in words, or -1 if there are more than max
+int splitWords(char* line, char** words, int max) {
+    int count = 0;
+    char* p = line;
+    while (1) {
+        while (isBlank(*p))
+            p++;
+        if (*p == 0)
+            return count;
+        if (count == max)
+            return -1;
+        words[count++] = p;
+        while (*p != 0 && !isBlank(*p)) {
+            char* next = p + 1;
+            if (*p == '\\' && p[1] != 0)
+                next = p + 2;
+            else if (*p == '\'' || *p == '"' || *p == '`' || (*p == '$' && (p[1] == '{' || p[1] == '(')))
+                next = skipQuoted(*p == '$' ? p + 1 : p);
+            else if ((*p == '<' || *p == '>') && p[1] == '(')
+                next = skipQuoted(p + 1);
+            // an unclosed quote runs to the end of the line
+            p = next != NULL ? next : p + strlen(p);
+        }
+        if (*p != 0)
+            *p++ = 0;
+    }
+}
+
+// expansion of words into fields, built in place at the end of the command arena
+struct expansion {
+    struct arena* arena;
+    char** out;         // completed fields
+    int count;          // fields produced, may exceed max when out is full
+    int max;            // room in out, doubled as it fills when there is a byte limit
+    size_t limit;       // argv bytes allowed, 0 for a fixed out without a limit
+    size_t bytes;       // argv bytes used by the fields so far
+    int failed;         // an error, reported when it happened, stopped expansion
+    int inField;        // a field has been started, possibly still empty
+    int noSplit;        // keep expansion results in one field (assignments), no globbing
+    int fieldGlob;      // the current field has unquoted * ? or [ and is matched as a pattern
+    int fieldEscaped;   // the current field has backslash escapes to remove if it is not
+    struct command* com;    // command process substitutions are started for, NULL where none
+};
+
+// store a completed field, keeping room for the NULL terminator when out grows
+void expAdd(struct expansion* e, char* field) {
+    if (e->limit != 0) {
+        // exec also refuses any single argument of 32 pages or more
+        size_t n = strlen(field) + 1;
+        e->bytes += n + sizeof(char*);
+        if (e->bytes > e->limit || n > 32 * 4096) {
+            if (!e->failed) {
+                printf("smallsh: argument list too long\n");
+                fflush(stdout);
+            }
+            e->failed = 1;
+            return;
+        }
+        if (e->count + 1 >= e->max) {
+            char** out = arenaAlloc(e->arena, sizeof(char*) * e->max * 2);
+            memcpy(out, e->out, sizeof(char*) * e->count);
+            e->out = out;
+            e->max *= 2;
+        }
+    }
+    if (e->count < e->max)
+        e->out[e->count] = field;
+    e->count++;
+}
+
+// directory listing as the raw getdents64 records, kept by glob for a short time
+struct dirListing {
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;      // a directory changed since it was read has a new mtime
+    double loaded;              // monotonicSeconds when it was read
+    int refs;                   // globs walking it
+    int cached;                 // in dirCache; freed once evicted and no longer walked
+    struct buffer records;
+};
+struct dirListing* dirCache[16];
+int dirCacheOn = 1;
+double dirCacheTTL = 2.0;       // seconds a listing is reused for
+unsigned long dirCacheHits = 0;
+unsigned long dirCacheMisses = 0;
+
+// drop a reference to listing, freeing it when it is neither cached nor walked
+void dirRelease(struct dirListing* listing) {
+    if (--listing->refs > 0 || listing->cached)
+        return;
+    free(listing->records.data);
+    free(listing);
+}
+
+// remove cache slot i
+void dirEvict(int i) {
+    struct dirListing* listing = dirCache[i];
+    dirCache[i] = NULL;
+    listing->cached = 0;
+    listing->refs++;
+    dirRelease(listing);
+}
+
+// list the directory at path, "" for the working directory. A cached listing is reused
+// when it is younger than dirCacheTTL and the directory has the same (dev, ino, mtime).
+// Returns NULL if the directory cannot be read; release the listing with dirRelease
+struct dirListing* dirList(const char* path) {
+    int fd = open(path[0] != 0 ? path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1)
+        return NULL;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return NULL;
+    }
+    // look the directory up, evicting expired or stale entries and picking a slot for it
+    double now = monotonicSeconds();
+    int slot = 0;   // an empty slot, else the oldest listing
+    for (int i = 0; i < sizeof(dirCache) / sizeof(struct dirListing*); i++) {
+        struct dirListing* l = dirCache[i];
+        if (l != NULL) {
+            int expired = !dirCacheOn || now - l->loaded > dirCacheTTL;
+            int same = l->dev == st.st_dev && l->ino == st.st_ino;
+            if (same && !expired && l->mtime.tv_sec == st.st_mtim.tv_sec && l->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+                close(fd);
+                dirCacheHits++;
+                l->refs++;
+                return l;
+            }
+            if (same || expired) {
+                dirEvict(i);
+                l = NULL;
+            }
+        }
+        if (dirCache[slot] != NULL && (l == NULL || l->loaded < dirCache[slot]->loaded))
+            slot = i;
+    }
+
+    struct dirListing* listing = calloc(1, sizeof(struct dirListing));
+    listing->dev = st.st_dev;
+    listing->ino = st.st_ino;
+    listing->mtime = st.st_mtim;
+    listing->loaded = now;
+    listing->refs = 1;
+    while (1) {
+        bufferReserve(&listing->records, 65536);
+        long n = syscall(SYS_getdents64, fd, listing->records.data + listing->records.len, listing->records.cap - listing->records.len);
+        if (n <= 0)
+            break;
+        listing->records.len += n;
+    }
+    close(fd);
+    dirCacheMisses++;
+    if (dirCacheOn) {
+        if (dirCache[slot] != NULL)
+            dirEvict(slot);
+        dirCache[slot] = listing;
+        listing->cached = 1;
+    }
+    return listing;
+}
+
+// end of the [...] class starting at p, NULL if it is not closed
+const char* globClassEnd(const char* p) {
+    p++;
+    if (*p == '!' || *p == '^')
+        p++;
+    if (*p == ']')
+        p++;
+    for (; *p != ']'; p++) {
+        if (*p == 0)
+            return NULL;
+        if (*p == '\\' && p[1] != 0)
+            p++;
+    }
+    return p;
+}
+
+// true if the [...] class starting at p and ending at end contains c
+int globClassMatch(const char* p, const char* end, char c) {
+    int negate = 0;
+    int found = 0;
+    p++;
+    if (*p == '!' || *p == '^') {
+        negate = 1;
+        p++;
+    }
+    const char* first = p;
+    while (p < end) {
+        if (*p == ']' && p != first)
+            break;
+        if (*p == '\\' && p + 1 < end)
+            p++;
+        unsigned char low = *p++;
+        unsigned char high = low;
+        if (*p == '-' && p + 1 < end) {
+            p++;
+            if (*p == '\\' && p + 1 < end)
+                p++;
+            high = *p++;
+        }
+        if ((unsigned char)c >= low && (unsigned char)c <= high)
+            found = 1;
+    }
+    return found != negate;
+}
+
+// match name against the glob pattern p: * ? [...] and backslash escapes. A failed match
+// resumes from the latest * only, so matching is linear in the name for each *
+int globMatch(const char* p, const char* name) {
+    const char* starP = NULL;
+    const char* starName = NULL;
+    while (*name != 0) {
+        if (*p == '*') {
+            while (*p == '*')
+                p++;
+            if (*p == 0)
+                return 1;
+            starP = p;
+            starName = name;
+            continue;
+        }
+        const char* end;
+        if (*p == '?') {
+            p++;
+            name++;
+            continue;
+        }
+        if (*p == '[' && (end = globClassEnd(p)) != NULL) {
+            if (globClassMatch(p, end, *name)) {
+                p = end + 1;
+                name++;
+                continue;
+            }
+        }
+        else {
+            if (*p == '\\' && p[1] != 0)
+                p++;
+            if (*p == *name) {
+                p++;
+                name++;
+                continue;
+            }
+        }
+        if (starP == NULL)
+            return 0;
+        p = starP;
+        name = ++starName;
+    }
+    while (*p == '*')
+        p++;
+    return *p == 0;
+}
+
+// true if the pattern component has unescaped * ? or a closed [...]
+int globHasMeta(const char* p) {
+    for (; *p != 0; p++) {
+        if (*p == '\\' && p[1] != 0)
+            p++;
+        else if (*p == '*' || *p == '?' || (*p == '[' && globClassEnd(p) != NULL))
+            return 1;
+    }
+    return 0;
+}
+
+// remove backslash escapes from s in place
+void globUnescape(char* s) {
+    char* out = s;
+    for (; *s != 0; s++) {
+        if (*s == '\\' && s[1] != 0)
+            s++;
+        *out++ = *s;
+    }
+    *out = 0;
+}
+
+// a pattern being matched against the file system, one path component at a time
+struct globWalk {
+    struct expansion* e;
+    char* comps[256];
+    int ncomps;
+    int dirOnly;        // the pattern ends in /, only directories match
+    char path[4096];    // path matched so far
+};
+
+// append name to the matched path of length len, returning the new length or -1 if too long
+int globAppend(struct globWalk* g, int len, const char* name, size_t n) {
+    int slash = len > 0 && g->path[len - 1] != '/';
+    if (len + slash + n + 2 > sizeof(g->path))
+        return -1;
+    if (slash)
+        g->path[len++] = '/';
+    memcpy(g->path + len, name, n);
+    len += n;
+    g->path[len] = 0;
+    return len;
+}
+
+// match components i onwards below the path of length len, adding every complete match
+void globDir(struct globWalk* g, int len, int i) {
+    struct stat st;
+    if (i == g->ncomps) {
+        if (g->dirOnly)
+            len = globAppend(g, len, "", 0);
+        if (len > 0)
+            expAdd(g->e, arenaStrndup(g->e->arena, g->path, len));
+        return;
+    }
+    char* comp = g->comps[i];
+    if (!globHasMeta(comp)) {
+        // a literal component only has to exist, which the last one is checked for
+        char literal[256];
+        snprintf(literal, sizeof(literal), "%s", comp);
+        globUnescape(literal);
+        int next = globAppend(g, len, literal, strlen(literal));
+        if (next == -1)
+            return;
+        if (i + 1 < g->ncomps || (g->dirOnly ? stat(g->path, &st) == 0 && S_ISDIR(st.st_mode) : lstat(g->path, &st) == 0))
+            globDir(g, next, i + 1);
+        return;
+    }
+    int recursive = strcmp(comp, "**") == 0;
+    int lastComp = i + 1 == g->ncomps;
+    if (recursive && !lastComp) {
+        // ** matches zero or more directories
+        globDir(g, len, i + 1);
+        g->path[len] = 0;
+    }
+    struct dirListing* listing = dirList(g->path);
+    if (listing == NULL)
+        return;
+    // names must end in the literal text after the last *, checked before the full match
+    char* star = strrchr(comp, '*');
+    char* suffix = (star != NULL && !globHasMeta(star + 1) && strchr(star, '\\') == NULL) ? star + 1 : "";
+    size_t suffixLen = strlen(suffix);
+    for (size_t off = 0; off < listing->records.len && !g->e->failed; ) {
+        struct dirent64* d = (struct dirent64*)(listing->records.data + off);
+        off += d->d_reclen;
+        char* name = d->d_name;
+        // hidden names only match a pattern that starts with a dot
+        if (name[0] == '.' && (recursive || comp[0] != '.' || strcmp(name, ".") == 0 || strcmp(name, "..") == 0))
+            continue;
+        size_t n = strlen(name);
+        if (n < suffixLen || memcmp(name + n - suffixLen, suffix, suffixLen) != 0)
+            continue;
+        if (!recursive && !globMatch(comp, name))
+            continue;
+        // only directories, and links or names of unknown type that may be ones, lead on
+        if ((!lastComp || g->dirOnly) && d->d_type != DT_DIR && d->d_type != DT_LNK && d->d_type != DT_UNKNOWN)
+            continue;
+        int next = globAppend(g, len, name, n);
+        if (next == -1)
+            continue;
+        if (!lastComp && !recursive)
+            globDir(g, next, i + 1);
+        else if (lastComp && (!g->dirOnly || d->d_type == DT_DIR || (stat(g->path, &st) == 0 && S_ISDIR(st.st_mode))))
+            globDir(g, next, i + 1);
+        if (recursive && (d->d_type == DT_DIR || (d->d_type == DT_UNKNOWN && lstat(g->path, &st) == 0 && S_ISDIR(st.st_mode)))) {
+            // descend into real directories only, symbolic links are not followed
+            globDir(g, next, i);
+        }
+        g->path[len] = 0;
+    }
+    dirRelease(listing);
+}
+
+// compare strings for qsort
+int compareStrings(const void* a, const void* b) {
+    return strcmp(*(char**)a, *(char**)b);
+}
+
+// expand the pattern field into the sorted paths matching it. Returns the number of
+// matches, 0 leaves the field to be used literally
+int globField(struct expansion* e, char* field) {
+    struct globWalk g;
+    g.e = e;
+    g.ncomps = 0;
+    g.dirOnly = 0;
+    g.path[0] = 0;
+    char* pattern = strdup(field);
+    char* p = pattern;
+    int len = 0;
+    if (*p == '/') {
+        len = globAppend(&g, 0, "/", 1);
+        while (*p == '/')
+            p++;
+    }
+    while (*p != 0) {
+        if (g.ncomps == sizeof(g.comps) / sizeof(char*)) {
+            free(pattern);
+            return 0;
+        }
+        g.comps[g.ncomps++] = p;
+        p += strcspn(p, "/");
+        if (*p == 0)
+            break;
+        *p++ = 0;
+        while (*p == '/')
+            p++;
+        if (*p == 0)
+            g.dirOnly = 1;
+    }
+    int start = e->count;
+    if (g.ncomps > 0)
+        globDir(&g, len, 0);
+    free(pattern);
+    if (start < e->max)
+        qsort(e->out + start, (e->count < e->max ? e->count : e->max) - start, sizeof(char*), compareStrings);
+    return e->count - start;
+}
+
+// make sure a field is in progress, even if it stays empty as with ""
+void expStart(struct expansion* e) {
+    if (!e->inField) {
+        arenaBegin(e->arena);
+        e->inField = 1;
+        e->fieldGlob = 0;
+        e->fieldEscaped = 0;
+    }
+}
+
+// append n bytes to the current field. Backslashes, and the glob characters of quoted text,
+// are escaped so the field can still be matched as a pattern; unquoted glob characters make
+// it one
+void expAppend(struct expansion* e, const char* s, size_t n, int quoted) {
+    expStart(e);
+    if (e->noSplit) {
+        arenaAppend(e->arena, s, n);
+        return;
+    }
+    size_t start = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (s[i] == '*' || s[i] == '?' || s[i] == '[') {
+            if (!quoted) {
+                e->fieldGlob = 1;
+                continue;
+            }
+        }
+        else if (s[i] != '\\') {
+            continue;
+        }
+        arenaAppend(e->arena, s + start, i - start);
+        arenaAppend(e->arena, "\\", 1);
+        start = i;
+        e->fieldEscaped = 1;
+    }
+    arenaAppend(e->arena, s + start, n - start);
+}
+
+// append n bytes of quoted literal text to the current field
+void expText(struct expansion* e, const char* s, size_t n) {
+    expAppend(e, s, n, 1);
+}
+
+// complete the current field, replacing a pattern by the paths it matches
+void expEnd(struct expansion* e) {
+    if (!e->inField)
+        return;
+    char* field = arenaFinish(e->arena);
+    e->inField = 0;
+    if (e->fieldGlob && globField(e, field) > 0)
+        return;
+    if (e->fieldEscaped)
+        globUnescape(field);
+    expAdd(e, field);
+}
+
+// append the result of an expansion; unquoted results are split into fields at blanks
+void expResult(struct expansion* e, const char* s, size_t n, int quoted) {
+    if (quoted || e->noSplit) {
+        expText(e, s, n);
+        return;
+    }
+    size_t i = 0;
+    while (i < n) {
+        if (isBlank(s[i])) {
+            expEnd(e);
+            i++;
+            continue;
+        }
+        size_t j = i;
+        while (j < n && !isBlank(s[j]))
+            j++;
+        expAppend(e, s + i, j - i, 0);
+        i = j;
+    }
+}
+
+// evaluation of an arithmetic expression for $((...)) and let: 64-bit integers with the C
+// operators and precedence, variables read from and assigned to the variable store
+struct arith {
+    const char* p;          // next character of the expression
+    const char* error;      // first error, NULL if none
+    int depth;              // variable values being evaluated as expressions
+    int skip;               // inside the unused side of && || or ?:, no side effects
+};
+
+// binary operator, with a one character code for arithApply
+struct arithOp {
+    const char* text;
+    int prec;
+    char code;
+};
+
+// longer operators come before their prefixes
+const struct arithOp arithOps[] = {
+    { "||", 1, 'o' }, { "&&", 2, 'a' }, { "|", 3, '|' }, { "^", 4, '^' }, { "&", 5, '&' },
+    { "==", 6, 'e' }, { "!=", 6, 'n' }, { "<=", 7, 'l' }, { ">=", 7, 'g' }, { "<<", 8, '<' },
+    { ">>", 8, '>' }, { "<", 7, 'L' }, { ">", 7, 'G' }, { "+", 9, '+' }, { "-", 9, '-' },
+    { "*", 10, '*' }, { "/", 10, '/' }, { "%", 10, '%' },
+};
+
+long long arithComma(struct arith* a);
+long long arithAssign(struct arith* a);
+
+// record the first error
+void arithFail(struct arith* a, const char* message) {
+    if (a->error == NULL)
+        a->error = message;
+}
+
+void arithBlank(struct arith* a) {
+    while (isBlank(*a->p))
+        a->p++;
+}
+
+// apply the binary operator code to x and y, wrapping on overflow like the shell does
+long long arithApply(struct arith* a, char code, long long x, long long y) {
+    unsigned long long ux = x, uy = y;
+    switch (code) {
+    case '+': return (long long)(ux + uy);
+    case '-': return (long long)(ux - uy);
+    case '*': return (long long)(ux * uy);
+    case '/':
+    case '%':
+        if (y == 0) {
+            if (!a->skip)
+                arithFail(a, "division by 0");
+            return 0;
+        }
+        if (x == LLONG_MIN && y == -1)
+            return code == '/' ? LLONG_MIN : 0;
+        return code == '/' ? x / y : x % y;
+    case '<': return (long long)(ux << (y & 63));
+    case '>': return x >> (y & 63);
+    case '&': return x & y;
+    case '^': return x ^ y;
+    case '|': return x | y;
+    case 'e': return x == y;
+    case 'n': return x != y;
+    case 'l': return x <= y;
+    case 'g': return x >= y;
+    case 'L': return x < y;
+    case 'G': return x > y;
+    }
+    return 0;
+}
+
+// value of the variable name of length n: empty or unset is 0, anything other than a plain
+// number is evaluated as an expression itself
+long long arithVar(struct arith* a, const char* name, size_t n) {
+    struct var* v = varLookup(name, n);
+    if (v == NULL || v->value[0] == 0)
+        return 0;
+    char* end;
+    errno = 0;
+    long long value = strtoll(v->value, &end, 10);
+    if (*end == 0 && errno == 0)
+        return value;
+    if (a->depth == 32) {
+        arithFail(a, "expression recursion level exceeded");
+        return 0;
+    }
+    struct arith inner = { v->value, NULL, a->depth + 1, a->skip };
+    value = arithComma(&inner);
+    arithBlank(&inner);
+    if (inner.error == NULL && *inner.p != 0)
+        arithFail(&inner, "syntax error in expression");
+    if (inner.error != NULL)
+        arithFail(a, inner.error);
+    return value;
+}
+
+// assign value to the variable name of length n, unless skipping
+void arithSetVar(struct arith* a, const char* name, size_t n, long long value) {
+    char nameCopy[256];
+    char number[32];
+    if (a->skip)
+        return;
+    if (n >= sizeof(nameCopy)) {
+        arithFail(a, "variable name too long");
+        return;
+    }
+    memcpy(nameCopy, name, n);
+    nameCopy[n] = 0;
+    sprintf(number, "%lld", value);
+    varSet(nameCopy, number, -1);
+}
+
+// integer constant: decimal, 0 octal, 0x hex or BASE#digits with bases 2 to 36
+long long arithNumber(struct arith* a) {
+    const char* start = a->p;
+    while (isalnum((unsigned char)*a->p) || *a->p == '#' || *a->p == '_')
+        a->p++;
+    const char* digits = start;
+    int base = 10;
+    const char* hash = memchr(start, '#', a->p - start);
+    if (hash != NULL) {
+        base = 0;
+        for (const char* q = start; q < hash; q++) {
+            base = isdigit((unsigned char)*q) && base < 100 ? base * 10 + *q - '0' : 100;
+        }
+        digits = hash + 1;
+    }
+    else if (start[0] == '0' && (start[1] == 'x' || start[1] == 'X')) {
+        base = 16;
+        digits = start + 2;
+    }
+    else if (start[0] == '0') {
+        base = 8;
+    }
+    if (base < 2 || base > 36) {
+        arithFail(a, "invalid arithmetic base");
+        return 0;
+    }
+    if (digits == a->p) {
+        arithFail(a, "invalid number");
+        return 0;
+    }
+    unsigned long long value = 0;
+    for (const char* q = digits; q < a->p; q++) {
+        int d = isdigit((unsigned char)*q) ? *q - '0' : isalpha((unsigned char)*q) ? tolower((unsigned char)*q) - 'a' + 10 : 99;
+        if (d >= base) {
+            arithFail(a, "value too great for base");
+            return 0;
+        }
+        value = value * base + d;
+    }
+    return (long long)value;
+}
+
+// number, variable with an optional ++ or --, or parenthesized expression
+long long arithPrimary(struct arith* a) {
+    arithBlank(a);
+    if (*a->p == '(') {
+        a->p++;
+        long long value = arithComma(a);
+        arithBlank(a);
+        if (*a->p != ')') {
+            arithFail(a, "missing `)'");
+            return 0;
+        }
+        a->p++;
+        return value;
+    }
+    if (isdigit((unsigned char)*a->p))
+        return arithNumber(a);
+    size_t n = nameLength(a->p);
+    if (n == 0) {
+        arithFail(a, *a->p == 0 ? "operand expected" : "syntax error in expression");
+        return 0;
+    }
+    const char* name = a->p;
+    a->p += n;
+    long long value = arithVar(a, name, n);
+    arithBlank(a);
+    if ((a->p[0] == '+' || a->p[0] == '-') && a->p[1] == a->p[0]) {
+        arithSetVar(a, name, n, arithApply(a, a->p[0], value, 1));
+        a->p += 2;
+    }
+    return value;
+}
+
+// prefix operators: + - ! ~ and ++ or -- of a variable
+long long arithUnary(struct arith* a) {
+    arithBlank(a);
+    char c = *a->p;
+    if ((c == '+' || c == '-') && a->p[1] == c) {
+        a->p += 2;
+        arithBlank(a);
+        size_t n = nameLength(a->p);
+        if (n == 0) {
+            arithFail(a, "variable expected after ++ or --");
+            return 0;
+        }
+        long long value = arithApply(a, c, arithVar(a, a->p, n), 1);
+        arithSetVar(a, a->p, n, value);
+        a->p += n;
+        return value;
+    }
+    if (c == '+' || c == '-' || c == '!' || c == '~') {
+        a->p++;
+        long long value = arithUnary(a);
+        if (c == '-')
+            return (long long)(0ULL - (unsigned long long)value);
+        if (c == '!')
+            return !value;
+        if (c == '~')
+            return ~value;
+        return value;
+    }
+    return arithPrimary(a);
+}
+
+// ** binds tighter than the binary operators but looser than prefix ones, to the right
+long long arithPower(struct arith* a) {
+    long long base = arithUnary(a);
+    arithBlank(a);
+    if (a->p[0] != '*' || a->p[1] != '*' || a->p[2] == '=')
+        return base;
+    a->p += 2;
+    long long exponent = arithPower(a);
+    if (exponent < 0) {
+        if (!a->skip)
+            arithFail(a, "exponent less than 0");
+        return 0;
+    }
+    unsigned long long result = 1, factor = base;
+    for (; exponent > 0; exponent >>= 1) {
+        if (exponent & 1)
+            result *= factor;
+        factor *= factor;
+    }
+    return (long long)result;
+}
+
+// binary operator at p that is not part of a compound assignment, NULL if none
+const struct arithOp* arithFindOp(const char* p) {
+    for (int i = 0; i < sizeof(arithOps) / sizeof(struct arithOp); i++) {
+        size_t n = strlen(arithOps[i].text);
+        if (strncmp(p, arithOps[i].text, n) != 0)
+            continue;
+        if (arithOps[i].code == '*' && p[1] == '*')
+            return NULL;
+        if (p[n] == '=' && arithOps[i].prec != 6 && arithOps[i].prec != 7)
+            return NULL;
+        return &arithOps[i];
+    }
+    return NULL;
+}
+
+// binary operators of precedence minPrec and higher, by precedence climbing. && and ||
+// evaluate their right side without side effects when the left decides the result
+long long arithBinary(struct arith* a, int minPrec) {
+    long long left = arithPower(a);
+    while (1) {
+        arithBlank(a);
+        const struct arithOp* op = arithFindOp(a->p);
+        if (op == NULL || op->prec < minPrec)
+            return left;
+        a->p += strlen(op->text);
+        if (op->code == 'o' || op->code == 'a') {
+            int decided = op->code == 'o' ? left != 0 : left == 0;
+            a->skip += decided;
+            long long right = arithBinary(a, op->prec + 1);
+            a->skip -= decided;
+            left = op->code == 'o' ? (left || right) : (left && right);
+            continue;
+        }
+        long long right = arithBinary(a, op->prec + 1);
+        left = arithApply(a, op->code, left, right);
+    }
+}
+
+// condition ? value : value, only the chosen side having side effects
+long long arithTernary(struct arith* a) {
+    long long condition = arithBinary(a, 1);
+    arithBlank(a);
+    if (*a->p != '?')
+        return condition;
+    a->p++;
+    a->skip += !condition;
+    long long yes = arithAssign(a);
+    a->skip -= !condition;
+    arithBlank(a);
+    if (*a->p != ':') {
+        arithFail(a, "`:' expected for conditional expression");
+        return 0;
+    }
+    a->p++;
+    a->skip += !!condition;
+    long long no = arithTernary(a);
+    a->skip -= !!condition;
+    return condition ? yes : no;
+}
+
+// NAME = value and the compound assignments, right to left
+long long arithAssign(struct arith* a) {
+    static const char* assignOps[] = { "=", "*=", "/=", "%=", "+=", "-=", "<<=", ">>=", "&=", "^=", "|=" };
+    arithBlank(a);
+    size_t n = nameLength(a->p);
+    if (n > 0) {
+        const char* q = a->p + n;
+        while (isBlank(*q))
+            q++;
+        for (int i = 0; i < sizeof(assignOps) / sizeof(char*); i++) {
+            size_t opLen = strlen(assignOps[i]);
+            if (strncmp(q, assignOps[i], opLen) != 0 || (i == 0 && q[1] == '='))
+                continue;
+            const char* name = a->p;
+            a->p = q + opLen;
+            long long value = arithAssign(a);
+            if (i > 0)
+                value = arithApply(a, assignOps[i][0], arithVar(a, name, n), value);
+            arithSetVar(a, name, n, value);
+            return value;
+        }
+    }
+    return arithTernary(a);
+}
+
+// expressions separated by commas, the value of the last
+long long arithComma(struct arith* a) {
+    long long value = arithAssign(a);
+    arithBlank(a);
+    while (*a->p == ',') {
+        a->p++;
+        value = arithAssign(a);
+        arithBlank(a);
+    }
+    return value;
+}
+
+// evaluate the arithmetic expression text, an empty one being 0. Returns 0 with the result
+// in *value, or 1 after reporting an error and setting a failed exit status
+int arithEvaluate(const char* text, long long* value) {
+    struct arith a = { text, NULL, 0, 0 };
+    *value = 0;
+    arithBlank(&a);
+    if (*a.p == 0)
+        return 0;
+    *value = arithComma(&a);
+    if (a.error == NULL && *a.p != 0)
+        arithFail(&a, "syntax error in expression");
+    if (a.error != NULL) {
+        printf("smallsh: %s: %s\n", text, a.error);
+        fflush(stdout);
+        lfStatus = 1 << 8;
+        return 1;
+    }
+    return 0;
+}
+
+char* captureCommand(char* text, size_t* len);
+
+// replace the command text with its output, as a quoted or unquoted expansion result
+void expandCommand(struct expansion* e, char* text, int quoted) {
+    size_t n;
+    char* output = captureCommand(text, &n);
+    expResult(e, output, n, quoted);
+    free(output);
+}
+
+// expand the backquoted command at p, where \` \\ and \$ stand for the character itself.
+// Returns the character after it; an unclosed backquote is kept literally
+char* expandBackquote(struct expansion* e, char* p, int quoted) {
+    char* close = skipQuoted(p);
+    if (close == NULL) {
+        expText(e, p, 1);
+        return p + 1;
+    }
+    char* text = malloc(close - p);
+    char* out = text;
+    for (char* q = p + 1; q < close - 1; q++) {
+        if (*q == '\\' && strchr("`\\$", q[1]) != NULL)
+            q++;
+        *out++ = *q;
+    }
+    *out = 0;
+    expandCommand(e, text, quoted);
+    free(text);
+    return close;
+}
+
+char* expandSingle(struct arena* arena, char* word, int noSplit, int* failed, struct command* com);
+
+// expand the arithmetic expression text, after expanding any parameters, substitutions and
+// quotes in it
+void expandArithmetic(struct expansion* e, char* text, int quoted) {
+    struct arena arena = { NULL, -1 };  // own arena, the caller's is mid field
+    char number[32];
+    long long value;
+    int failed = 0;
+    if (strpbrk(text, "$`'\"\\") != NULL)
+        text = expandSingle(&arena, text, 1, &failed, NULL);
+    if (failed || arithEvaluate(text, &value) == 1) {
+        e->failed = 1;
+    }
+    else {
+        int n = sprintf(number, "%lld", value);
+        expResult(e, number, n, quoted);
+    }
+    arenaFree(&arena);
+}
+
+// expand the $ construct at p: $$, $?, $NAME, ${NAME}, $((expression)) or $(command).
+// Returns the character after it; a $ not starting any of these is kept literally
+char* expandDollar(struct expansion* e, char* p, int quoted) {
+    char number[32];
+    if (p[1] == '(' && p[2] == '(') {
+        char* close = skipQuoted(p + 1);
+        if (close != NULL && close[-2] == ')') {
+            char* text = strndup(p + 3, close - p - 5);
+            expandArithmetic(e, text, quoted);
+            free(text);
+            return close;
+        }
+    }
+    if (p[1] == '(') {
+        char* close = skipQuoted(p + 1);
+        if (close == NULL) {
+            expText(e, p, 1);
+            return p + 1;
+        }
+        char* text = strndup(p + 2, close - p - 3);
+        expandCommand(e, text, quoted);
+        free(text);
+        return close;
+    }
+    if (p[1] == '$' || p[1] == '?' || p[1] == '#') {
+        int n = sprintf(number, "%d", p[1] == '$' ? (int)getpid() : p[1] == '?' ? lastExitCode() : shellArgCount - 1);
+        expResult(e, number, n, quoted);
+        return p + 2;
+    }
+    if (isdigit((unsigned char)p[1])) {
+        // positional parameter, a single digit as in sh
+        int index = p[1] - '0';
+        if (index < shellArgCount)
+            expResult(e, shellArgs[index], strlen(shellArgs[index]), quoted);
+        return p + 2;
+    }
+    size_t n;
+    char* name = p + 1;
+    char* next;
+    if (p[1] == '{') {
+        name = p + 2;
+        n = nameLength(name);
+        if (n == 0 || name[n] != '}') {
+            expText(e, p, 1);
+            return p + 1;
+        }
+        next = name + n + 1;
+    }
+    else if ((n = nameLength(name)) > 0) {
+        next = name + n;
+    }
+    else {
+        expText(e, p, 1);
+        return p + 1;
+    }
+    struct var* v = varLookup(name, n);
+    if (v != NULL)
+        expResult(e, v->value, strlen(v->value), quoted);
+    return next;
+}
+
+int startProcSubst(char* text, int output, pid_t* pid);
+
+// replace the <(...) or >(...) at p with /dev/fd/N, the shell's end of a pipe to the command
+// started for it, which the command being parsed gets at the same number.
+// Returns the character after it; an unclosed one is kept literally
+char* expandProcSubst(struct expansion* e, char* p) {
+    char* close = skipQuoted(p + 1);
+    if (close == NULL) {
+        expText(e, p, 1);
+        return p + 1;
+    }
+    if (e->com == NULL || e->com->auxCount == sizeof(e->com->auxFDs) / sizeof(int)) {
+        printf("smallsh: %s process substitution\n", e->com == NULL ? "no command for" : "too many");
+        fflush(stdout);
+        e->failed = 1;
+        return p + strlen(p);
+    }
+    char* text = strndup(p + 2, close - p - 3);
+    pid_t pid;
+    int fd = startProcSubst(text, *p == '>', &pid);
+    free(text);
+    if (fd == -1) {
+        e->failed = 1;
+        return p + strlen(p);
+    }
+    e->com->auxFDs[e->com->auxCount] = fd;
+    e->com->auxPids[e->com->auxCount++] = pid;
+    char path[32];
+    snprintf(path, sizeof(path), "/dev/fd/%d", fd);
+    expText(e, path, strlen(path));
+    return close;
+}
+
+// expand one word into fields: quote removal, parameter expansion, command substitution and
+// globbing, with unquoted expansion results split at blanks
+void expandWord(struct expansion* e, char* word) {
+    char* p = word;
+    int doubleQuoted = 0;
+    while (*p != 0) {
+        if (*p == '\'' && !doubleQuoted) {
+            char* close = strchr(p + 1, '\'');
+            if (close == NULL)
+                close = p + strlen(p);
+            expText(e, p + 1, close - p - 1);
+            p = (*close != 0) ? close + 1 : close;
+        }
+        else if (*p == '"') {
+            doubleQuoted = !doubleQuoted;
+            expStart(e);
+            p++;
+        }
+        else if (*p == '\\' && p[1] != 0) {
+            // inside double quotes a backslash only escapes $ ` " and itself
+            if (doubleQuoted && strchr("$`\"\\", p[1]) == NULL)
+                expText(e, p, 2);
+            else
+                expText(e, p + 1, 1);
+            p += 2;
+        }
+        else if (*p == '$') {
+            p = expandDollar(e, p, doubleQuoted);
+        }
+        else if (*p == '`') {
+            p = expandBackquote(e, p, doubleQuoted);
+        }
+        else if ((*p == '<' || *p == '>') && p[1] == '(' && !doubleQuoted) {
+            p = expandProcSubst(e, p);
+        }
+        else {
+            size_t n = strcspn(p, "'\"\\$`<>");
+            if (n == 0)
+                n = 1;
+            expAppend(e, p, n, doubleQuoted);
+            p += n;
+        }
+    }
+    expEnd(e);
+}
+
+// expand a leading ~ or ~user of word to the home directory, then the rest of the word
+void expandTilde(struct expansion* e, char* word) {
+    if (word[0] == '~') {
+        char* name = word + 1;
+        size_t n = strcspn(name, "/");
+        char* home = NULL;
+        struct passwd* pw = NULL;
+        // a quoted or expanded login name leaves the tilde alone
+        if (strcspn(name, "'\"\\$`{") < n) {
+            n = 0;
+        }
+        else if (n == 0) {
+            home = varGet("HOME");
+            if (home == NULL && (pw = getpwuid(getuid())) != NULL)
+                home = pw->pw_dir;
+        }
+        else if (n < 256) {
+            char user[256];
+            memcpy(user, name, n);
+            user[n] = 0;
+            if ((pw = getpwnam(user)) != NULL)
+                home = pw->pw_dir;
+        }
+        if (home != NULL) {
+            expText(e, home, strlen(home));
+            word = name + n;
+        }
+    }
+    expandWord(e, word);
+}
+
+// step over the character, or the quoted, escaped or substituted section, at p
+char* braceStep(char* p) {
+    char* next;
+    if (*p == '\\' && p[1] != 0)
+        return p + 2;
+    if (*p == '\'' || *p == '"' || *p == '`')
+        next = skipQuoted(p);
+    else if ((*p == '$' && p[1] == '{') || ((*p == '$' || *p == '<' || *p == '>') && p[1] == '('))
+        next = skipQuoted(p + 1);
+    else
+        return p + 1;
+    return next != NULL ? next : p + strlen(p);
+}
+
+// a {first..last[..step]} brace sequence of integers or single characters
+struct braceSeq {
+    long long first;
+    long long last;
+    long long step;
+    int width;      // zero padded width of the numbers, 0 if not padded
+};
+
+// parse the text between open and close as a sequence. Returns 1 if it is one
+int braceSequence(const char* open, const char* close, struct braceSeq* seq) {
+    char text[96];
+    char* bound[3];
+    size_t n = close - open;
+    if (n >= sizeof(text))
+        return 0;
+    memcpy(text, open, n);
+    text[n] = 0;
+    bound[0] = text;
+    int parts = 1;
+    for (char* dots = strstr(text, ".."); dots != NULL && parts < 4; dots = strstr(dots, "..")) {
+        *dots = 0;
+        dots += 2;
+        if (parts < 3)
+            bound[parts] = dots;
+        parts++;
+    }
+    if (parts != 2 && parts != 3)
+        return 0;
+    seq->step = 1;
+    seq->width = 0;
+    if (parts == 3) {
+        char* end;
+        seq->step = strtoll(bound[2], &end, 10);
+        if (*bound[2] == 0 || *end != 0)
+            return 0;
+        if (seq->step < 0)
+            seq->step = -seq->step;
+        if (seq->step == 0)
+            seq->step = 1;
+    }
+    // single characters, not digits, at both ends
+    if (bound[0][0] != 0 && bound[0][1] == 0 && bound[1][0] != 0 && bound[1][1] == 0 &&
+        !isdigit((unsigned char)bound[0][0]) && !isdigit((unsigned char)bound[1][0])) {
+        seq->first = (unsigned char)bound[0][0];
+        seq->last = (unsigned char)bound[1][0];
+        seq->width = -1;
+        return 1;
+    }
+    for (int i = 0; i < 2; i++) {
+        char* end;
+        long long value = strtoll(bound[i], &end, 10);
+        if (*bound[i] == 0 || *end != 0)
+            return 0;
+        // a leading zero pads every number to the width of the wider bound
+        char* digits = bound[i] + (*bound[i] == '-' || *bound[i] == '+');
+        if (digits[0] == '0' && digits[1] != 0 && strlen(bound[i]) > seq->width)
+            seq->width = strlen(bound[i]);
+        if (i == 0)
+            seq->first = value;
+        else
+            seq->last = value;
+    }
+    return 1;
+}
+
+// the first brace group of word that expands, a {a,b} list with a comma at its own level or
+// a sequence, outside quotes and substitutions. Returns its { with its } in *close
+char* braceFind(char* word, char** close) {
+    for (char* p = word; *p != 0; ) {
+        if (*p != '{') {
+            p = braceStep(p);
+            continue;
+        }
+        int depth = 0;
+        int comma = 0;
+        char* q = p;
+        while (*q != 0) {
+            if (*q == '{')
+                depth++;
+            else if (*q == '}' && --depth == 0)
+                break;
+            else if (*q == ',' && depth == 1)
+                comma = 1;
+            q = braceStep(q);
+        }
+        struct braceSeq seq;
+        if (*q == '}' && (comma || braceSequence(p + 1, q, &seq))) {
+            *close = q;
+            return p;
+        }
+        p++;
+    }
+    return NULL;
+}
+
+void expandBraces(struct expansion* e, char* word);
+
+// expand the word made of word's first prefix bytes, item and suffix, built in b
+void braceWord(struct expansion* e, struct buffer* b, char* word, size_t prefix, const char* item, size_t n, const char* suffix) {
+    size_t suffixLen = strlen(suffix);
+    b->len = 0;
+    bufferReserve(b, prefix + n + suffixLen + 1);
+    memcpy(b->data, word, prefix);
+    memcpy(b->data + prefix, item, n);
+    memcpy(b->data + prefix + n, suffix, suffixLen + 1);
+    expandBraces(e, b->data);
+}
+
+// the expansion stages of one word in order: brace expansion, which each word it generates
+// goes through the later stages of before the next is made, then tilde expansion and
+// expandWord. Assignments skip brace expansion
+void expandBraces(struct expansion* e, char* word) {
+    char* close;
+    char* open = e->noSplit ? NULL : braceFind(word, &close);
+    if (open == NULL) {
+        expandTilde(e, word);
+        return;
+    }
+    struct buffer b = { NULL, 0, 0 };
+    struct braceSeq seq;
+    size_t prefix = open - word;
+    if (braceSequence(open + 1, close, &seq)) {
+        long long step = seq.first <= seq.last ? seq.step : -seq.step;
+        for (long long v = seq.first; !e->failed && (step > 0 ? v <= seq.last : v >= seq.last); v += step) {
+            char item[32];
+            int n = 1;
+            if (seq.width == -1)
+                item[0] = (char)v;
+            else
+                n = snprintf(item, sizeof(item), "%0*lld", seq.width, v);
+            braceWord(e, &b, word, prefix, item, n, close + 1);
+            // stop rather than overflow at the end of the range
+            if ((step > 0 && v > LLONG_MAX - step) || (step < 0 && v < LLONG_MIN - step))
+                break;
+        }
+    }
+    else {
+        // alternatives are split at commas at the group's own level
+        char* alt = open + 1;
+        int depth = 0;
+        char* q = alt;
+        while (!e->failed) {
+            if (q == close || (*q == ',' && depth == 0)) {
+                braceWord(e, &b, word, prefix, alt, q - alt, close + 1);
+                if (q == close)
+                    break;
+                alt = ++q;
+                continue;
+            }
+            if (*q == '{')
+                depth++;
+            else if (*q == '}')
+                depth--;
+            q = braceStep(q);
+        }
+    }
+    free(b.data);
+}
+
+// expand word into exactly one field, NULL if it expands to none or several or, with
+// *failed set, expansion failed. With noSplit there is always one field, possibly empty
+char* expandSingle(struct arena* arena, char* word, int noSplit, int* failed, struct command* com) {
+    char* field = NULL;
+    struct expansion e = { arena, &field, 0, 1 };
+    e.noSplit = noSplit;
+    e.com = com;
+    expandBraces(&e, word);
+    *failed = e.failed;
+    if (e.failed)
+        return NULL;
+    if (noSplit && e.count == 0)
+        return "";
+    return e.count == 1 ? field : NULL;
+}
+
+// point stdin (input set) or stdout of com at the shell's descriptor named by target, the
+// expansion of word. Returns 1 if it is not an open descriptor
+int dupRedirect(struct command* com, int input, char* word, char* target) {
+    char* end = NULL;
+    long fd = target != NULL ? strtol(target, &end, 10) : -1;
+    if (target == NULL || end == target || *end != 0 || fd < 0 || fd > INT_MAX || fcntl(fd, F_GETFD) == -1) {
+        printf("%s: bad file descriptor\n", target != NULL && *target != 0 ? target : word);
+        fflush(stdout);
+        return 1;
+    }
+    // a copy of its own, closed with the command like a here-document, so it stays valid
+    // while the command waits for admission
+    int* slot = input ? &com->inFD : &com->outFD;
+    if (*slot != -1)
+        close(*slot);
+    *slot = fcntl(fd, F_DUPFD_CLOEXEC, 3);
+    return 0;
+}
+
+// true if word is a NAME=value assignment
+int isAssignment(const char* word) {
+    size_t n = nameLength(word);
+    return n > 0 && word[n] == '=';
+}
+
+// write all n bytes of buf to fd
+int writeAll(int fd, const void* buf, size_t n) {
+    const char* p = buf;
+    while (n > 0) {
+        ssize_t written = write(fd, p, n);
+        if (written == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += written;
+        n -= written;
+    }
+    return 0;
+}
+
+// here-document or here-string body on its way to a command's stdin. Up to 64KB is staged
+// in buf; a body that fits in a pipe goes into one, a larger one is streamed through buf
+// into a memfd so it is never held in full by the shell
+struct hereDoc {
+    struct buffer buf;
+    int memFD;
+};
+
+// append n bytes at s to the body's memfd, leaving it as it was if they do not all go in.
+// Returns -1 then
+int hereSpill(struct hereDoc* h, const char* s, size_t n) {
+    off_t at = lseek(h->memFD, 0, SEEK_CUR);
+    if (writeAll(h->memFD, s, n) == 0)
+        return 0;
+    if (at != -1 && ftruncate(h->memFD, at) == 0)
+        lseek(h->memFD, at, SEEK_SET);
+    return -1;
+}
+
+// add n bytes to the body. Past 64KB it goes to a memfd, a large piece straight there, so
+// a big body or here-string is not held in memory as well; only what the memfd refused stays
+// in buf, for hereFinish to try again
+void hereWrite(struct hereDoc* h, const char* s, size_t n) {
+    if (h->buf.len + n > 65536 && h->memFD == -1)
+        h->memFD = memfd_create("heredoc", MFD_CLOEXEC);
+    if (h->buf.len + n > 65536 && h->memFD != -1 && h->buf.len > 0 && hereSpill(h, h->buf.data, h->buf.len) == 0)
+        h->buf.len = 0;
+    if (n > 65536 && h->memFD != -1 && h->buf.len == 0 && hereSpill(h, s, n) == 0)
+        return;
+    bufferReserve(&h->buf, n);
+    memcpy(h->buf.data + h->buf.len, s, n);
+    h->buf.len += n;
+}
+
+// complete the body and return a descriptor reading it from the start, -1 on error
+int hereFinish(struct hereDoc* h) {
+    int fd = -1;
+    if (h->memFD == -1) {
+        int pipeFD[2];
+        if (pipe2(pipeFD, O_CLOEXEC) == 0) {
+            // a pipe holding the whole body never blocks the writer
+            if (fcntl(pipeFD[1], F_GETPIPE_SZ) >= (long)h->buf.len && writeAll(pipeFD[1], h->buf.data, h->buf.len) == 0) {
+                fd = pipeFD[0];
+            }
+            else {
+                close(pipeFD[0]);
+            }
+            close(pipeFD[1]);
+        }
+        if (fd == -1)
+            h->memFD = memfd_create("heredoc", MFD_CLOEXEC);
+    }
+    if (h->memFD != -1) {
+        if (writeAll(h->memFD, h->buf.data, h->buf.len) == 0 && lseek(h->memFD, 0, SEEK_SET) == 0) {
+            fd = h->memFD;
+        }
+        else {
+            close(h->memFD);
+        }
+    }
+    if (fd == -1)
+        perror("here-document");
+    free(h->buf.data);
+    return fd;
+}
+
+// expand the parameters, substitutions and backslash escapes of \$ \` and \\ in a line of
+// a here-document; quotes have no special meaning. Returns NULL if expansion failed
+char* expandHereLine(struct arena* arena, char* p) {
+    char* field = NULL;
+    struct expansion e = { arena, &field, 0, 1 };
+    e.noSplit = 1;
+    expStart(&e);
+    while (*p != 0 && !e.failed) {
+        if (*p == '\\' && (p[1] == '$' || p[1] == '`' || p[1] == '\\')) {
+            expText(&e, p + 1, 1);
+            p += 2;
+        }
+        else if (*p == '$') {
+            p = expandDollar(&e, p, 1);
+        }
+        else if (*p == '`') {
+            p = expandBackquote(&e, p, 1);
+        }
+        else {
+            size_t n = strcspn(p, "\\$`");
+            if (n == 0)
+                n = 1;
+            expText(&e, p, n);
+            p += n;
+        }
+    }
+    expEnd(&e);
+    return e.failed ? NULL : field;
+}
+
+// read a here-document body from the shell's input up to the line holding only the
+// delimiter word, with leading tabs removed if stripTabs. Unless the delimiter has quotes
+// the lines are expanded. Returns a descriptor to read the body from, -1 on error
+int readHereDoc(char* word, int stripTabs) {
+    // the delimiter is the word with its quotes removed
+    char* delimiter = malloc(strlen(word) + 1);
+    char* d = delimiter;
+    int quoted = 0;
+    for (char* p = word; *p != 0; p++) {
+        if (*p == '\'' || *p == '"') {
+            quoted = 1;
+            continue;
+        }
+        if (*p == '\\' && p[1] != 0) {
+            quoted = 1;
+            p++;
+        }
+        *d++ = *p;
+    }
+    *d = 0;
+
+    struct hereDoc h = { { NULL, 0, 0 }, -1 };
+    struct arena arena = { NULL, -1 };
+    struct buffer lineBuf = { NULL, 0, 0 };
+    int failed = 0;
+    while (1) {
+        if (isatty(input.fd)) {
+            printf("> ");
+            fflush(stdout);
+        }
+        lineBuf.len = 0;
+        ssize_t n = readerLine(&input, &lineBuf);
+        if (n == -1)
+            continue;
+        if (n == 0) {
+            printf("smallsh: here-document delimited by end-of-file (wanted `%s')\n", delimiter);
+            fflush(stdout);
+            break;
+        }
+        lineBuf.data[n] = 0;
+        char* line = lineBuf.data;
+        char* text = line;
+        if (stripTabs) {
+            while (*text == '\t')
+                text++;
+        }
+        size_t length = n - (text - line);
+        size_t content = (length > 0 && text[length - 1] == '\n') ? length - 1 : length;
+        if (content == strlen(delimiter) && strncmp(text, delimiter, content) == 0)
+            break;
+        if (quoted || failed) {
+            hereWrite(&h, text, length);
+            continue;
+        }
+        // the rest of the body is still read after a failed expansion, but not used
+        arenaReset(&arena);
+        char* expanded = expandHereLine(&arena, text);
+        if (expanded == NULL)
+            failed = 1;
+        else
+            hereWrite(&h, expanded, strlen(expanded));
+    }
+    free(lineBuf.data);
+    free(delimiter);
+    arenaFree(&arena);
+    int fd = hereFinish(&h);
+    if (failed && fd != -1) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+// build com from line: split it into words, expand them into arena and pick out redirections,
+// here-documents and a trailing &. A line of only NAME=value words assigns shell variables.
+// Returns 0 if com has a command to run and 1 if there is nothing (more) to do
+int parseCommand(char* line, struct command* com, struct arena* arena) {
+    // every word takes at least one character and a separator
+    int maxWords = strlen(line) / 2 + 1;
+    char** words = arenaAlloc(arena, sizeof(char*) * maxWords);
+    int count = splitWords(line, words, maxWords);
+    if (count == 0) {
+        return 1;
+    }
+
+    // assignment only line: set shell variables, keeping their export flag
+    int assignments = 0;
+    while (assignments < count && isAssignment(words[assignments]))
+        assignments++;
+    if (assignments == count) {
+        for (int i = 0; i < count; i++) {
+            char* equals = strchr(words[i], '=');
+            *equals = 0;
+            int failed;
+            char* value = expandSingle(arena, equals + 1, 1, &failed, NULL);
+            if (value == NULL)
+                return 1;
+            varSet(words[i], value, -1);
+        }
+        return 1;
+    }
+
+    // identify if process should run in the background
+    if (strcmp(words[count - 1], "&") == 0) {
+        com->background = 1;
+        count--;
+    }
+
+    // here-documents and here-strings first, so their bodies are read from the input even if
+    // the command fails; their words are taken out of the list
+    int hereFailed = 0;
+    for (int i = 0; i < count; i++) {
+        if (words[i] == NULL || strncmp(words[i], "<<", 2) != 0)
+            continue;
+        char* operand = words[i] + 2 + (words[i][2] == '<' || words[i][2] == '-');
+        if (*operand == 0 && i + 1 < count) {
+            operand = words[i + 1];
+            words[i + 1] = NULL;
+        }
+        if (*operand == 0) {
+            printf("smallsh: syntax error: %s needs a word\n", words[i]);
+            fflush(stdout);
+            return 1;
+        }
+        int fd;
+        if (words[i][2] == '<') {
+            int failed;
+            char* text = expandSingle(arena, operand, 1, &failed, NULL);
+            if (failed) {
+                hereFailed = 1;
+                continue;
+            }
+            struct hereDoc h = { { NULL, 0, 0 }, -1 };
+            hereWrite(&h, text, strlen(text));
+            hereWrite(&h, "\n", 1);
+            fd = hereFinish(&h);
+        }
+        else {
+            fd = readHereDoc(operand, words[i][2] == '-');
+        }
+        if (com->inFD != -1)
+            close(com->inFD);
+        com->inFD = fd;
+        hereFailed |= fd == -1;
+        words[i] = NULL;
+    }
+    if (hereFailed)
+        return 1;
+
+    // argv grows in the arena, up to what exec accepts next to the environment
+    buildEnvp();
+    long argMax = sysconf(_SC_ARG_MAX);
+    struct expansion e = { arena, arenaAlloc(arena, sizeof(char*) * 64), 0, 64 };
+    e.limit = argMax > (long)envCacheBytes + 4096 ? argMax - envCacheBytes : 4096;
+    e.com = com;
+    for (int i = 0; i < count; i++) {
+        if (words[i] == NULL)
+            continue;
+        // stores word following redirection requests < > in input and output of our com structure
+        if ((strcmp(words[i], "<") == 0 || strcmp(words[i], ">") == 0) && i + 1 < count) {
+            int failed;
+            if (words[i + 1] == NULL)
+                break;
+            char* target = expandSingle(arena, words[i + 1], 0, &failed, com);
+            if (failed) {
+                return 1;
+            }
+            if (target == NULL) {
+                printf("%s: ambiguous redirect\n", words[i + 1]);
+                fflush(stdout);
+                return 1;
+            }
+            snprintf(words[i][0] == '<' ? com->input : com->output, sizeof(com->input), "%s", target);
+            i++;
+            continue;
+        }
+        // <&N and >&N take stdin or stdout from the shell's descriptor N, such as a coprocess pipe
+        if ((strncmp(words[i], "<&", 2) == 0 || strncmp(words[i], ">&", 2) == 0)) {
+            int input = words[i][0] == '<';
+            char* operand = words[i] + 2;
+            if (*operand == 0 && i + 1 < count && words[i + 1] != NULL)
+                operand = words[++i];
+            int failed;
+            char* target = expandSingle(arena, operand, 0, &failed, NULL);
+            if (failed || dupRedirect(com, input, operand, target) == 1)
+                return 1;
+            continue;
+        }
+        expandBraces(&e, words[i]);
+        if (e.failed)
+            return 1;
+    }
+    com->args = e.out;
+    com->args[e.count] = NULL;
+    com->numArgs = e.count;
+    return com->numArgs == 0;
+}
+
+// compare variables by name for qsort
+int compareVars(const void* a, const void* b) {
+    return strcmp((*(struct var**)a)->name, (*(struct var**)b)->name);
+}
+
+// print variables sorted by name as prefix NAME=value, only exported ones if exportedOnly
+void printVars(const char* prefix, int exportedOnly) {
+    struct var** sorted = malloc(sizeof(struct var*) * (varCount + 1));
+    size_t n = 0;
+    for (size_t i = 0; i < varBuckets; i++) {
+        for (struct var* v = varTable[i]; v != NULL; v = v->next) {
+            if (v->exported || !exportedOnly)
+                sorted[n++] = v;
+        }
+    }
+    qsort(sorted, n, sizeof(struct var*), compareVars);
+    for (size_t i = 0; i < n; i++) {
+        printf("%s%s=%s\n", prefix, sorted[i]->name, sorted[i]->value);
+    }
+    fflush(stdout);
+    free(sorted);
+}
+
+// export [NAME[=VALUE]...]: mark variables for the environment of later commands, list the
+// exported variables with no arguments
+int exportBuiltin(struct command* com) {
+    if (com->args[1] == NULL) {
+        printVars("export ", 1);
+        return 0;
+    }
+    int result = 0;
+    for (int i = 1; com->args[i] != NULL; i++) {
+        char* name = com->args[i];
+        char* equals = strchr(name, '=');
+        size_t n = nameLength(name);
+        if (n == 0 || (name[n] != 0 && name[n] != '=')) {
+            printf("export: %s: not a valid identifier\n", name);
+            fflush(stdout);
+            result = 1;
+            continue;
+        }
+        if (equals != NULL)
+            *equals = 0;
+        varSet(name, equals != NULL ? equals + 1 : NULL, 1);
+    }
+    return result;
+}
+
+// unset NAME...: remove shell variables
+int unsetBuiltin(struct command* com) {
+    for (int i = 1; com->args[i] != NULL; i++) {
+        varUnset(com->args[i]);
+    }
+    return 0;
+}
+
+// exit: kill all background processes and exit. The end of a script (com NULL in script mode)
+// exits with the status of its last foreground command, 128 plus the signal if one ended it
+int exitBuiltin(struct command* com) {
+    int killReturn;
+    // SIGKILL any processes that have yet to terminate; a substitution subshell shares the
+    // job table but the jobs are not its own
+    for (int ind = 0; !subshell && ind < (sizeof(bgJobs) / sizeof(struct job)); ind++) {
+        if (bgJobs[ind].pid == 0) {
+            continue;
+        }
+        printf("Attempting to kill %d\n", bgJobs[ind].pid);
+        fflush(stdout);
+        killReturn = signalChild(bgJobs[ind].pid, bgJobs[ind].pidfd, SIGKILL);
+        if (killReturn == -1) {
+            printf("Process %d was not killed\n", bgJobs[ind].pid);
+            fflush(stdout);
+        }
+        else {
+            printf("Process %d was killed\n", bgJobs[ind].pid);
+            fflush(stdout);
+        }
+    }
+    // jobs still waiting for admission are dropped without being started
+    for (int ind = 0; !subshell && ind < admitQueued; ind++) {
+        printf("Queued job not started:");
+        for (int j = 0; admitQueue[ind]->args[j] != NULL; j++) {
+            printf(" %s", admitQueue[ind]->args[j]);
+        }
+        printf("\n");
+        fflush(stdout);
+        queueFree(admitQueue[ind]);
+    }
+    admitQueued = 0;
+    // leave stdin where the commands and read stopped for whoever reads it next
+    if (!subshell) {
+        if (input.fd == 0)
+            readerGiveBack(&input);
+        readerGiveBack(&stdinReader);
+    }
+    int code = 0;
+    if (com == NULL && scriptMode && lfStatus != -1234)
+        code = WIFEXITED(lfStatus) ? WEXITSTATUS(lfStatus) : 128 + WTERMSIG(lfStatus);
+    exit(code); //exit the shell
+}
+
+// cd [DIR]: with no arguments, "cd" changes to the directory specified in the HOME
+// environment variable. Can take 1 arg and works w/both absolute and relative paths
+int cdBuiltin(struct command* com) {
+    if (com->numArgs == 1) {
+        return chdir(varGet("HOME") != NULL ? varGet("HOME") : "/") == -1;
+    }
+    else if (com->numArgs == 2) {
+        return chdir(com->args[1]) == -1;
+    }
+    return 1;
+}
+
+// status: prints out either exit status or terminating signal of last foreground
+// process ran by this shell. If run before any foreground command is run, returns 0.
+int statusBuiltin(struct command* com) {
+    if (lfStatus == -1234) {
+        printf("exit value 0\n");
+        fflush(stdout);
+    }
+    else {
+        if (WIFEXITED(lfStatus)) {
+            printf("exit value %d\n", WEXITSTATUS(lfStatus));
+            fflush(stdout);
+        }
+        else {
+            printf("terminated by signal %d%s%s%s\n", WTERMSIG(lfStatus),
+                lfCause[0] ? " (" : "", lfCause, lfCause[0] ? ")" : "");
+            fflush(stdout);
+        }
+    }
+    return 0;
+}
+
+// set: list all shell variables, local and exported
+int setBuiltin(struct command* com) {
+    printVars("", 0);
+    return 0;
+}
+
+// env: list the environment later commands get
+int envBuiltin(struct command* com) {
+    printVars("", 1);
+    return 0;
+}
+
+// jobs: list running background jobs, then those waiting for admission
+int jobsBuiltin(struct command* com) {
+    for (int ind = 0; ind < (sizeof(bgJobs) / sizeof(struct job)); ind++) {
+        if (bgJobs[ind].pid != 0 && bgJobs[ind].owner > 0) {
+            printf("[%d] %d running %s for %d\n", ind + 1, bgJobs[ind].pid, bgJobs[ind].command, bgJobs[ind].owner);
+            fflush(stdout);
+        }
+        else if (bgJobs[ind].pid != 0) {
+            printf("[%d] %d running %s\n", ind + 1, bgJobs[ind].pid, bgJobs[ind].command);
+            fflush(stdout);
+        }
+    }
+    for (int ind = 0; ind < admitQueued; ind++) {
+        printf("[q%d] queued", ind + 1);
+        for (int j = 0; admitQueue[ind]->args[j] != NULL; j++) {
+            printf(" %s", admitQueue[ind]->args[j]);
+        }
+        printf("\n");
+        fflush(stdout);
+    }
+    return 0;
+}
+
+// "cgroup DIR" creates new jobs directly inside the cgroup v2 directory DIR,
+// "cgroup off" stops doing so and no argument shows the current setting
+int cgroupBuiltin(struct command* com) {
+    if (com->numArgs == 2 && strcmp(com->args[1], "off") == 0) {
+        if (jobCgroupFD != -1)
+            close(jobCgroupFD);
+        jobCgroupFD = -1;
+    }
+    else if (com->numArgs == 2) {
+        int newFD = open(com->args[1], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (newFD == -1) {
+            perror(com->args[1]);
+            return 1;
+        }
+        if (jobCgroupFD != -1)
+            close(jobCgroupFD);
+        jobCgroupFD = newFD;
+    }
+    else {
+        char path[64], target[4096];
+        ssize_t n = -1;
+        if (jobCgroupFD != -1) {
+            sprintf(path, "/proc/self/fd/%d", jobCgroupFD);
+            n = readlink(path, target, sizeof(target) - 1);
+        }
+        printf("%s\n", n == -1 ? "no job cgroup" : (target[n] = 0, target));
+        fflush(stdout);
+    }
+    return 0;
+}
+
+// "forkserver on" starts the spawn helper, "forkserver off" stops it and
+// no argument reports whether it is running
+int forkserverBuiltin(struct command* com) {
+    if (com->numArgs == 2 && strcmp(com->args[1], "on") == 0) {
+        return forkServerStart();
+    }
+    else if (com->numArgs == 2 && strcmp(com->args[1], "off") == 0) {
+        if (forkServerSock != -1)
+            forkServerStop();
+    }
+    else if (forkServerSock != -1) {
+        printf("fork server running (pid %d)\n", forkServerPid);
+        fflush(stdout);
+    }
+    else {
+        printf("fork server not running\n");
+        fflush(stdout);
+    }
+    return 0;
+}
+
+// globcache [on|off] [ttl SECONDS]: reuse glob directory listings while the directory is
+// unchanged, no arguments reports the setting and hit counts
+int globcacheBuiltin(struct command* com) {
+    for (int i = 1; com->args[i] != NULL; i++) {
+        if (strcmp(com->args[i], "on") == 0) {
+            dirCacheOn = 1;
+        }
+        else if (strcmp(com->args[i], "off") == 0) {
+            dirCacheOn = 0;
+            for (int j = 0; j < sizeof(dirCache) / sizeof(struct dirListing*); j++) {
+                if (dirCache[j] != NULL)
+                    dirEvict(j);
+            }
+        }
+        else if (strcmp(com->args[i], "ttl") == 0 && com->args[i + 1] != NULL && parseSeconds(com->args[i + 1]) >= 0) {
+            dirCacheTTL = parseSeconds(com->args[++i]);
+        }
+        else {
+            printf("usage: globcache [on|off] [ttl SECONDS]\n");
+            fflush(stdout);
+            return 1;
+        }
+    }
+    if (com->args[1] == NULL) {
+        int cached = 0;
+        for (int j = 0; j < sizeof(dirCache) / sizeof(struct dirListing*); j++) {
+            cached += dirCache[j] != NULL;
+        }
+        printf("glob cache %s, ttl %gs, %d directories, %lu hits, %lu misses\n", dirCacheOn ? "on" : "off",
+            dirCacheTTL, cached, dirCacheHits, dirCacheMisses);
+        fflush(stdout);
+    }
+    return 0;
+}
+
+// let EXPRESSION...: evaluate each arithmetic expression. Its exit status, 0 if the last
+// value is non-zero and 1 otherwise, is what status and $? report next
+int letBuiltin(struct command* com) {
+    long long value = 0;
+    if (com->args[1] == NULL) {
+        printf("usage: let EXPRESSION...\n");
+        fflush(stdout);
+        return 1;
+    }
+    for (int i = 1; com->args[i] != NULL; i++) {
+        if (arithEvaluate(com->args[i], &value) == 1)
+            return 1;
+    }
+    lfStatus = (value == 0) << 8;
+    return value == 0;
+}
+
+// redirections of a builtin that moves data in the shell itself, and what copySignals saved
+// while it runs
+struct dataIO {
+    int in;         // < or <& redirection, else stdin
+    int out;        // > or >& redirection, else stdout
+    int openedIn;   // opened from com->input and com->output, closed by dataFinish; -1 for none
+    int openedOut;
+    int reported;   // SIGINT already reported, by a command the builtin ran
+    struct sigaction saved[2];
+};
+
+// open com's < redirection and, with openOutput, its > redirection into io, then switch to
+// copySignals. Returns failure as the status, nothing left open, if one cannot be opened
+int dataStart(struct command* com, struct dataIO* io, int openOutput, int failure) {
+    io->in = com->inFD != -1 ? com->inFD : 0;
+    io->out = com->outFD != -1 ? com->outFD : 1;
+    io->openedIn = -1;
+    io->openedOut = -1;
+    io->reported = 0;
+    if (strcmp(com->input, "") != 0 && (io->in = io->openedIn = open(com->input, O_RDONLY | O_CLOEXEC)) == -1) {
+        perror(com->input);
+        lfStatus = failure << 8;
+        return failure;
+    }
+    if (openOutput && strcmp(com->output, "") != 0 && (io->out = io->openedOut = open(com->output, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) == -1) {
+        perror(com->output);
+        if (io->openedIn != -1)
+            close(io->openedIn);
+        lfStatus = failure << 8;
+        return failure;
+    }
+    fflush(stdout);
+    copySignals(1, io->saved);
+    return 0;
+}
+
+// restore the signals, close what dataStart opened and set the status to result, or as for a
+// foreground child killed by SIGINT if interrupted. Returns result
+int dataFinish(struct dataIO* io, int result) {
+    copySignals(0, io->saved);
+    if (io->openedIn != -1)
+        close(io->openedIn);
+    if (io->openedOut != -1)
+        close(io->openedOut);
+    lfStatus = copyInterrupted ? 2 : result << 8;
+    if (copyInterrupted && !io->reported) {
+        printf("terminated by signal 2\n");
+        fflush(stdout);
+    }
+    return result;
+}
+
+// copy in to out up to end of file with the cheapest call the pair allows: copy_file_range
+// between regular files, which can share extents or copy in the kernel, splice when either
+// is a pipe, sendfile from a regular file to anything else, and read/write through a 128KB
+// buffer for the rest or where the kernel refuses. Returns -1 with errno set on an error,
+// EINTR if interrupted by SIGINT
+int copyFD(int in, int out) {
+    struct stat inStat;
+    struct stat outStat;
+    if (fstat(in, &inStat) == -1 || fstat(out, &outStat) == -1)
+        return -1;
+    int method = 3;     // 0 copy_file_range, 1 splice, 2 sendfile, 3 read/write
+    if (S_ISREG(inStat.st_mode) && S_ISREG(outStat.st_mode))
+        method = 0;
+    else if (S_ISFIFO(inStat.st_mode) || S_ISFIFO(outStat.st_mode))
+        method = 1;
+    else if (S_ISREG(inStat.st_mode))
+        method = 2;
+    int copied = 0;     // the fast paths may only be abandoned before any data moved
+    while (method < 3) {
+        ssize_t n;
+        if (method == 0)
+            n = copy_file_range(in, NULL, out, NULL, 1 << 30, 0);
+        else if (method == 1)
+            n = splice(in, NULL, out, NULL, 1 << 20, SPLICE_F_MOVE | SPLICE_F_MORE);
+        else
+            n = sendfile(out, in, NULL, 1 << 30);
+        if (n == 0)
+            return 0;
+        if (n > 0) {
+            copied = 1;
+            continue;
+        }
+        if (errno == EINTR && !copyInterrupted)
+            continue;
+        if (copied || (errno != EINVAL && errno != EXDEV && errno != ENOSYS && errno != EOPNOTSUPP && errno != EBADF))
+            return -1;
+        // not for this pair after all (another filesystem, a terminal, an append-only file):
+        // a plain copy always works, sendfile may still for a file source
+        method = (method != 2 && S_ISREG(inStat.st_mode)) ? 2 : 3;
+    }
+    static char* buf = NULL;
+    if (buf == NULL)
+        buf = malloc(1 << 17);
+    while (1) {
+        ssize_t n = read(in, buf, 1 << 17);
+        if (n == 0)
+            return 0;
+        if (n == -1) {
+            if (errno == EINTR && !copyInterrupted)
+                continue;
+            return -1;
+        }
+        if (writeAll(out, buf, n) == -1)
+            return -1;
+    }
+}
+
+// cat [FILE...]: copy the files, or stdin for none or -, to stdout in the shell itself,
+// honouring < > <& and >& redirections. Options other than -u run the utility instead
+int catBuiltin(struct command* com) {
+    struct dataIO io;
+    int result = 0;
+    if (dataStart(com, &io, 1, 1))
+        return 1;
+    struct stat outStat;
+    fstat(io.out, &outStat);
+    int named = 0;
+    for (int i = 1; i < com->numArgs; i++) {
+        named += strcmp(com->args[i], "-u") != 0;   // output is never buffered anyway
+    }
+    for (int i = 1; i <= com->numArgs && !copyInterrupted; i++) {
+        if ((i < com->numArgs && strcmp(com->args[i], "-u") == 0) || (i == com->numArgs && named > 0))
+            continue;
+        // past the last argument with no file named: stdin
+        char* name = i < com->numArgs ? com->args[i] : "-";
+        int fd = strcmp(name, "-") == 0 ? io.in : open(name, O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            fprintf(stderr, "cat: ");
+            perror(name);
+            result = 1;
+            continue;
+        }
+        struct stat inStat;
+        if (fstat(fd, &inStat) == 0 && S_ISREG(inStat.st_mode) && S_ISREG(outStat.st_mode) &&
+            inStat.st_dev == outStat.st_dev && inStat.st_ino == outStat.st_ino && inStat.st_size > 0) {
+            fprintf(stderr, "cat: %s: input file is output file\n", name);
+            result = 1;
+        }
+        else if (copyFD(fd, io.out) == -1 && errno != EPIPE && !copyInterrupted) {
+            fprintf(stderr, "cat: ");
+            perror(name);
+            result = 1;
+        }
+        if (fd != io.in)
+            close(fd);
+    }
+    // interrupted like a foreground child killed by SIGINT
+    return dataFinish(&io, result);
+}
+
+// copy in to out and every one of files[0..count). With pipes on both sides the data is never
+// read into the shell: tee(2) duplicates it into out and into a pipe of the same size for
+// each file but the last, splice(2) drains those and moves the original into the last file.
+// Otherwise it goes through a 128KB buffer. Returns -1 with errno set on an error
+int teeFD(int in, int out, int* files, int count) {
+    struct stat inStat;
+    struct stat outStat;
+    if (fstat(in, &inStat) == -1 || fstat(out, &outStat) == -1)
+        return -1;
+    if (count == 0)
+        return copyFD(in, out);
+    if (S_ISFIFO(inStat.st_mode) && S_ISFIFO(outStat.st_mode)) {
+        int pipeSize = fcntl(in, F_GETPIPE_SZ);
+        int extra[count][2];
+        int made = 0;
+        int result = 0;
+        for (; made < count - 1; made++) {
+            if (pipe2(extra[made], O_CLOEXEC) == -1 || fcntl(extra[made][1], F_SETPIPE_SZ, pipeSize) < pipeSize) {
+                result = -1;
+                break;
+            }
+        }
+        while (result == 0) {
+            ssize_t n = tee(in, out, pipeSize, 0);
+            if (n == 0)
+                break;
+            if (n == -1) {
+                if (errno == EINTR && !copyInterrupted)
+                    continue;
+                result = -1;
+                break;
+            }
+            // the same n bytes into each file, the last taking them out of in
+            for (int i = 0; i < count && result == 0; i++) {
+                int from = in;
+                if (i < count - 1) {
+                    from = extra[i][0];
+                    ssize_t copied = tee(in, extra[i][1], n, 0);
+                    if (copied != n) {
+                        errno = copied == -1 ? errno : EIO;   // same size pipe, not expected
+                        result = -1;
+                        break;
+                    }
+                }
+                for (ssize_t left = n; left > 0;) {
+                    ssize_t moved = splice(from, NULL, files[i], NULL, left, SPLICE_F_MOVE);
+                    if (moved == -1 && errno == EINTR && !copyInterrupted)
+                        continue;
+                    if (moved <= 0) {
+                        result = -1;
+                        break;
+                    }
+                    left -= moved;
+                }
+            }
+        }
+        int saved = errno;
+        for (int i = 0; i < made; i++) {
+            close(extra[i][0]);
+            close(extra[i][1]);
+        }
+        errno = saved;
+        return result;
+    }
+    static char* buf = NULL;
+    if (buf == NULL)
+        buf = malloc(1 << 17);
+    while (1) {
+        ssize_t n = read(in, buf, 1 << 17);
+        if (n == 0)
+            return 0;
+        if (n == -1) {
+            if (errno == EINTR && !copyInterrupted)
+                continue;
+            return -1;
+        }
+        if (writeAll(out, buf, n) == -1)
+            return -1;
+        for (int i = 0; i < count; i++) {
+            if (writeAll(files[i], buf, n) == -1)
+                return -1;
+        }
+    }
+}
+
+// tee [-a] [FILE...]: copy stdin to stdout and each FILE, appending to them with -a, in the
+// shell itself. Options other than -a run the utility instead
+int teeBuiltin(struct command* com) {
+    struct dataIO io;
+    int result = 0;
+    if (dataStart(com, &io, 1, 1))
+        return 1;
+    int append = 0;
+    for (int i = 1; i < com->numArgs; i++) {
+        append |= strcmp(com->args[i], "-a") == 0;
+    }
+    int* files = malloc(sizeof(int) * com->numArgs);
+    int count = 0;
+    for (int i = 1; i < com->numArgs && !copyInterrupted; i++) {
+        if (strcmp(com->args[i], "-a") == 0)
+            continue;
+        int fd = open(com->args[i], O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC), 0644);
+        if (fd == -1) {
+            fprintf(stderr, "tee: ");
+            perror(com->args[i]);
+            result = 1;
+            continue;
+        }
+        files[count++] = fd;
+    }
+    if (!copyInterrupted && teeFD(io.in, io.out, files, count) == -1 && errno != EPIPE && !copyInterrupted) {
+        perror("tee");
+        result = 1;
+    }
+    for (int i = 0; i < count; i++) {
+        close(files[i]);
+    }
+    free(files);
+    return dataFinish(&io, result);
+}
+
+// newlines, words and bytes counted by wc
+struct wcCounts {
+    uint64_t lines;
+    uint64_t words;
+    uint64_t bytes;
+};
+
+// C locale wc words: runs of printable characters separated by spaces, where other bytes
+// (control characters, bytes above 126) neither start nor end a word
+int wcSpace(unsigned char b) {
+    return b == ' ' || (unsigned char)(b - 9) <= 4;
+}
+
+int wcPrintable(unsigned char b) {
+    return b > ' ' && b < 127;
+}
+
+// count the newlines and word starts in p[0..n). prevSpace is whether the last byte before p
+// that was a space or printable was a space, 1 at the start of a file.
+// Returns that state at the end of p
+int wcScalar(const unsigned char* p, size_t n, int prevSpace, struct wcCounts* c) {
+    for (size_t i = 0; i < n; i++) {
+        c->lines += p[i] == '\n';
+        if (wcSpace(p[i])) {
+            prevSpace = 1;
+        }
+        else if (wcPrintable(p[i])) {
+            c->words += prevSpace;
+            prevSpace = 0;
+        }
+    }
+    c->bytes += n;
+    return prevSpace;
+}
+
+#if defined(__x86_64__)
+// wcScalar 16 bytes at a time: compare into bit masks, a word starts at a printable byte
+// after a space. Blocks with bytes that are neither go through wcScalar
+int wcSSE2(const unsigned char* p, size_t n, int prevSpace, int words, struct wcCounts* c) {
+    size_t i = 0;
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i blank = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8(9);
+    const __m128i four = _mm_set1_epi8(4);
+    const __m128i bang = _mm_set1_epi8('!');
+    const __m128i graphs = _mm_set1_epi8('~' - '!');
+    if (!words) {
+        // newlines only: per byte counters of up to 255 blocks, then summed
+        __m128i total = _mm_setzero_si128();
+        while (i + 16 <= n) {
+            __m128i counts = _mm_setzero_si128();
+            for (int k = 0; k < 255 && i + 16 <= n; k++, i += 16) {
+                counts = _mm_sub_epi8(counts, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + i)), newline));
+            }
+            total = _mm_add_epi64(total, _mm_sad_epu8(counts, _mm_setzero_si128()));
+        }
+        c->lines += (uint64_t)_mm_cvtsi128_si64(total) + (uint64_t)_mm_cvtsi128_si64(_mm_unpackhi_epi64(total, total));
+        c->bytes += i;
+    }
+    for (; words && i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+        __m128i control = _mm_sub_epi8(v, tab);  // \t \n \v \f \r as 0 to 4
+        __m128i graph = _mm_sub_epi8(v, bang);   // ! to ~ as 0 to 93
+        unsigned space = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, blank),
+            _mm_cmpeq_epi8(_mm_min_epu8(control, four), control)));
+        unsigned printable = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(graph, graphs), graph));
+        if ((space | printable) != 0xffff) {
+            prevSpace = wcScalar(p + i, 16, prevSpace, c);
+            continue;
+        }
+        c->lines += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(v, newline)));
+        c->words += __builtin_popcount(printable & ((space << 1) | prevSpace));
+        c->bytes += 16;
+        prevSpace = space >> 15;
+    }
+    return wcScalar(p + i, n - i, prevSpace, c);
+}
+
+// wcSSE2 32 bytes at a time
+__attribute__((target("avx2,popcnt")))
+int wcAVX2(const unsigned char* p, size_t n, int prevSpace, int words, struct wcCounts* c) {
+    size_t i = 0;
+    const __m256i newline = _mm256_set1_epi8('\n');
+    const __m256i blank = _mm256_set1_epi8(' ');
+    const __m256i tab = _mm256_set1_epi8(9);
+    const __m256i four = _mm256_set1_epi8(4);
+    const __m256i bang = _mm256_set1_epi8('!');
+    const __m256i graphs = _mm256_set1_epi8('~' - '!');
+    if (!words) {
+        __m256i total = _mm256_setzero_si256();
+        while (i + 32 <= n) {
+            __m256i counts = _mm256_setzero_si256();
+            for (int k = 0; k < 255 && i + 32 <= n; k++, i += 32) {
+                counts = _mm256_sub_epi8(counts, _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p + i)), newline));
+            }
+            total = _mm256_add_epi64(total, _mm256_sad_epu8(counts, _mm256_setzero_si256()));
+        }
+        c->lines += (uint64_t)_mm256_extract_epi64(total, 0) + (uint64_t)_mm256_extract_epi64(total, 1) +
+            (uint64_t)_mm256_extract_epi64(total, 2) + (uint64_t)_mm256_extract_epi64(total, 3);
+        c->bytes += i;
+    }
+    for (; words && i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(p + i));
+        __m256i control = _mm256_sub_epi8(v, tab);
+        __m256i graph = _mm256_sub_epi8(v, bang);
+        uint64_t space = (uint32_t)_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, blank),
+            _mm256_cmpeq_epi8(_mm256_min_epu8(control, four), control)));
+        uint64_t printable = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_min_epu8(graph, graphs), graph));
+        if ((space | printable) != 0xffffffff) {
+            prevSpace = wcScalar(p + i, 32, prevSpace, c);
+            continue;
+        }
+        c->lines += __builtin_popcount(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, newline)));
+        c->words += __builtin_popcountll(printable & ((space << 1) | prevSpace));
+        c->bytes += 32;
+        prevSpace = space >> 31;
+    }
+    return wcScalar(p + i, n - i, prevSpace, c);
+}
+#endif
+
+// the widest counting kernel this CPU runs; without words set only lines and bytes are needed
+int wcCount(const unsigned char* p, size_t n, int prevSpace, int words, struct wcCounts* c) {
+#if defined(__x86_64__)
+    static int (*kernel)(const unsigned char*, size_t, int, int, struct wcCounts*) = NULL;
+    if (kernel == NULL)
+        kernel = __builtin_cpu_supports("avx2") ? wcAVX2 : wcSSE2;
+    return kernel(p, n, prevSpace, words, c);
+#else
+    return wcScalar(p, n, prevSpace, c);
+#endif
+}
+
+// one thread's share of a mapped file
+struct wcChunk {
+    pthread_t thread;
+    const unsigned char* start;
+    size_t n;
+    int prevSpace;
+    int words;
+    struct wcCounts counts;
+};
+
+void* wcChunkThread(void* arg) {
+    struct wcChunk* chunk = arg;
+    wcCount(chunk->start, chunk->n, chunk->prevSpace, chunk->words, &chunk->counts);
+    return NULL;
+}
+
+// count fd into c, words only if words is set: a regular file is mapped and, from 64MB, split over up to one thread per
+// CPU in chunks of at least 32MB; anything else is read in 1MB blocks. Returns -1 with errno
+// set on an error
+int wcFD(int fd, int words, struct wcCounts* c) {
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+        return -1;
+    off_t offset = lseek(fd, 0, SEEK_CUR);
+    if (S_ISREG(st.st_mode) && offset != -1 && st.st_size > offset) {
+        size_t n = st.st_size - offset;
+        unsigned char* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            madvise(data, st.st_size, MADV_SEQUENTIAL);
+            long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+            size_t threads = n >= (64 << 20) ? n / (32 << 20) : 1;
+            threads = threads < (size_t)cpus ? threads : (cpus > 0 ? cpus : 1);
+            threads = threads < 64 ? threads : 64;
+            struct wcChunk chunks[64];
+            for (size_t t = 0; t < threads; t++) {
+                size_t from = offset + n / threads * t;
+                size_t to = t + 1 == threads ? (size_t)st.st_size : offset + n / threads * (t + 1);
+                struct wcChunk chunk = { 0, data + from, to - from, 1, words };
+                chunks[t] = chunk;
+                // the state the chunk starts in, from the last byte before it that is not neutral
+                for (size_t b = from; b > (size_t)offset && !wcSpace(data[b - 1]); b--) {
+                    if (wcPrintable(data[b - 1])) {
+                        chunks[t].prevSpace = 0;
+                        break;
+                    }
+                }
+                // the calling thread takes the first chunk itself, or all of them if a
+                // thread cannot be started
+                if (t > 0 && pthread_create(&chunks[t].thread, NULL, wcChunkThread, &chunks[t]) != 0) {
+                    chunks[t].thread = 0;
+                    wcChunkThread(&chunks[t]);
+                }
+            }
+            wcChunkThread(&chunks[0]);
+            for (size_t t = 0; t < threads; t++) {
+                if (t > 0 && chunks[t].thread != 0)
+                    pthread_join(chunks[t].thread, NULL);
+                c->lines += chunks[t].counts.lines;
+                c->words += chunks[t].counts.words;
+                c->bytes += chunks[t].counts.bytes;
+            }
+            munmap(data, st.st_size);
+            lseek(fd, st.st_size, SEEK_SET);
+            return 0;
+        }
+    }
+    static unsigned char* buf = NULL;
+    if (buf == NULL)
+        buf = malloc(1 << 20);
+    int prevSpace = 1;
+    while (1) {
+        ssize_t n = read(fd, buf, 1 << 20);
+        if (n == 0)
+            return 0;
+        if (n == -1) {
+            if (errno == EINTR && !copyInterrupted)
+                continue;
+            return -1;
+        }
+        prevSpace = wcCount(buf, n, prevSpace, words, c);
+    }
+}
+
+// print the selected counts of c, right aligned in width, and name when not NULL
+void wcPrint(int fd, struct wcCounts* c, int show[3], int width, const char* name) {
+    uint64_t values[3] = { c->lines, c->words, c->bytes };
+    char line[128];
+    int len = 0;
+    for (int i = 0; i < 3; i++) {
+        if (!show[i])
+            continue;
+        len += snprintf(line + len, sizeof(line) - len, "%s%*llu", len > 0 ? " " : "", width, (unsigned long long)values[i]);
+    }
+    // one write a line, which matters when xargs hands wc thousands of small files
+    if (name != NULL)
+        dprintf(fd, "%s %s\n", line, name);
+    else
+        dprintf(fd, "%s\n", line);
+}
+
+// wc [-lwc] [FILE...]: count the lines, words and bytes of the files, or stdin for none or -,
+// in the shell itself. Options other than -l -w and -c run the utility instead
+int wcBuiltin(struct command* com) {
+    struct dataIO io;
+    int result = 0;
+    if (dataStart(com, &io, 1, 1))
+        return 1;
+    int show[3] = { 0, 0, 0 };
+    char** names = malloc(sizeof(char*) * (com->numArgs + 1));
+    int count = 0;
+    for (int i = 1; i < com->numArgs; i++) {
+        if (com->args[i][0] == '-' && com->args[i][1] != 0) {
+            show[0] |= strchr(com->args[i], 'l') != NULL;
+            show[1] |= strchr(com->args[i], 'w') != NULL;
+            show[2] |= strchr(com->args[i], 'c') != NULL;
+        }
+        else {
+            names[count++] = com->args[i];
+        }
+    }
+    if (!show[0] && !show[1] && !show[2])
+        show[0] = show[1] = show[2] = 1;
+    if (count == 0)
+        names[count++] = NULL;  // stdin, printed without a name
+    // columns as wide as the total size of the files needs, at least 7 with a pipe or
+    // terminal among them, and unpadded for a single number
+    int width = 1;
+    uint64_t sizes = 0;
+    for (int i = 0; i < count; i++) {
+        struct stat st;
+        int isStdin = names[i] == NULL || strcmp(names[i], "-") == 0;
+        if (isStdin ? fstat(io.in, &st) == 0 : stat(names[i], &st) == 0) {
+            if (S_ISREG(st.st_mode))
+                sizes += st.st_size;
+            else
+                width = 7;
+        }
+    }
+    int digits = 1;
+    for (; sizes >= 10; sizes /= 10) {
+        digits++;
+    }
+    width = digits > width ? digits : width;
+    if (count == 1 && show[0] + show[1] + show[2] == 1)
+        width = 1;
+    struct wcCounts total = { 0, 0, 0 };
+    for (int i = 0; i < count && !copyInterrupted; i++) {
+        int isStdin = names[i] == NULL || strcmp(names[i], "-") == 0;
+        int fd = isStdin ? io.in : open(names[i], O_RDONLY | O_CLOEXEC);
+        struct wcCounts c = { 0, 0, 0 };
+        if (fd == -1 || wcFD(fd, show[1], &c) == -1) {
+            if (copyInterrupted)
+                break;
+            fprintf(stderr, "wc: ");
+            perror(names[i] != NULL ? names[i] : "-");
+            result = 1;
+        }
+        else {
+            wcPrint(io.out, &c, show, width, names[i]);
+        }
+        if (fd != -1 && fd != io.in)
+            close(fd);
+        total.lines += c.lines;
+        total.words += c.words;
+        total.bytes += c.bytes;
+    }
+    if (count > 1 && !copyInterrupted)
+        wcPrint(io.out, &total, show, width, "total");
+    free(names);
+    return dataFinish(&io, result);
+}
+
+// how search selects lines
+struct searchPattern {
+    const char* text;
+    size_t len;
+    int literal;    // a fixed string, found with searchLiteral rather than the regex
+    int icase;
+    int invert;
+    regex_t regex;
+};
+
+// compare m bytes of p with needle, ignoring ASCII case if icase
+int searchEqual(const char* p, const char* needle, size_t m, int icase) {
+    if (!icase)
+        return memcmp(p, needle, m) == 0;
+    for (size_t i = 0; i < m; i++) {
+        if (tolower((unsigned char)p[i]) != tolower((unsigned char)needle[i]))
+            return 0;
+    }
+    return 1;
+}
+
+// first occurrence of needle[0..m) in p[from..n) one byte at a time, NULL if none
+const char* searchScalar(const char* p, size_t from, size_t n, const char* needle, size_t m, int icase) {
+    for (size_t i = from; i + m <= n; i++) {
+        if (searchEqual(p + i, needle, m, icase))
+            return p + i;
+    }
+    return NULL;
+}
+
+#if defined(__x86_64__)
+// first occurrence of needle[0..m), m >= 2, in p[0..n): 16 positions at a time are only
+// compared in full where both the first and the last byte of the needle match there
+const char* searchSSE2(const char* p, size_t n, const char* needle, size_t m, int icase) {
+    unsigned char first = needle[0];
+    unsigned char last = needle[m - 1];
+    const __m128i first1 = _mm_set1_epi8(icase ? tolower(first) : first);
+    const __m128i first2 = _mm_set1_epi8(icase ? toupper(first) : first);
+    const __m128i last1 = _mm_set1_epi8(icase ? tolower(last) : last);
+    const __m128i last2 = _mm_set1_epi8(icase ? toupper(last) : last);
+    size_t i = 0;
+    for (; i + m - 1 + 16 <= n; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(p + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(p + i + m - 1));
+        __m128i matchA = _mm_or_si128(_mm_cmpeq_epi8(a, first1), _mm_cmpeq_epi8(a, first2));
+        __m128i matchB = _mm_or_si128(_mm_cmpeq_epi8(b, last1), _mm_cmpeq_epi8(b, last2));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(matchA, matchB));
+        for (; mask != 0; mask &= mask - 1) {
+            size_t at = i + __builtin_ctz(mask);
+            if (searchEqual(p + at + 1, needle + 1, m - 2, icase))
+                return p + at;
+        }
+    }
+    return searchScalar(p, i, n, needle, m, icase);
+}
+
+// searchSSE2 32 positions at a time
+__attribute__((target("avx2")))
+const char* searchAVX2(const char* p, size_t n, const char* needle, size_t m, int icase) {
+    unsigned char first = needle[0];
+    unsigned char last = needle[m - 1];
+    const __m256i first1 = _mm256_set1_epi8(icase ? tolower(first) : first);
+    const __m256i first2 = _mm256_set1_epi8(icase ? toupper(first) : first);
+    const __m256i last1 = _mm256_set1_epi8(icase ? tolower(last) : last);
+    const __m256i last2 = _mm256_set1_epi8(icase ? toupper(last) : last);
+    size_t i = 0;
+    for (; i + m - 1 + 32 <= n; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(p + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(p + i + m - 1));
+        __m256i matchA = _mm256_or_si256(_mm256_cmpeq_epi8(a, first1), _mm256_cmpeq_epi8(a, first2));
+        __m256i matchB = _mm256_or_si256(_mm256_cmpeq_epi8(b, last1), _mm256_cmpeq_epi8(b, last2));
+        unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(matchA, matchB));
+        for (; mask != 0; mask &= mask - 1) {
+            size_t at = i + __builtin_ctz(mask);
+            if (searchEqual(p + at + 1, needle + 1, m - 2, icase))
+                return p + at;
+        }
+    }
+    return searchScalar(p, i, n, needle, m, icase);
+}
+#endif
+
+// first occurrence of the literal pattern in p[0..n), NULL if none
+const char* searchLiteral(const struct searchPattern* sp, const char* p, size_t n) {
+    if (sp->len == 0)
+        return p;
+    if (sp->len == 1 && !sp->icase)
+        return memchr(p, sp->text[0], n);
+#if defined(__x86_64__)
+    static const char* (*kernel)(const char*, size_t, const char*, size_t, int) = NULL;
+    if (kernel == NULL)
+        kernel = __builtin_cpu_supports("avx2") ? searchAVX2 : searchSSE2;
+    if (sp->len >= 2)
+        return kernel(p, n, sp->text, sp->len, sp->icase);
+#else
+    if (!sp->icase)
+        return memmem(p, n, sp->text, sp->len);
+#endif
+    return searchScalar(p, 0, n, sp->text, sp->len, sp->icase);
+}
+
+// the first line of p[0..n) with a match, its end (the newline or p + n) in *lineEnd; NULL
+// if there is none. p starts a line
+const char* searchNextLine(const struct searchPattern* sp, const char* p, size_t n, const char** lineEnd) {
+    const char* hit;
+    if (sp->literal) {
+        hit = searchLiteral(sp, p, n);
+    }
+    else {
+        // the whole rest at once: REG_NEWLINE keeps matches within a line
+        regmatch_t match = { 0, n };
+        hit = regexec(&sp->regex, p, 1, &match, REG_STARTEND) == 0 ? p + match.rm_so : NULL;
+    }
+    if (hit == NULL)
+        return NULL;
+    const char* start = memrchr(p, '\n', hit - p);
+    start = start != NULL ? start + 1 : p;
+    *lineEnd = memchr(hit, '\n', p + n - hit);
+    if (*lineEnd == NULL)
+        *lineEnd = p + n;
+    return start;
+}
+
+// one piece of input searched, on its own thread for a large file, with the selected lines
+// formatted into out
+struct searchJob {
+    pthread_t thread;
+    const struct searchPattern* sp;
+    const char* start;
+    size_t n;
+    uint64_t firstLine;     // number of the first line, with numbers set
+    const char* prefix;     // "name:" before each line, NULL for none
+    int numbers;
+    int format;             // format the lines, not just count them
+    int stopAtFirst;        // -q and -l need no more than one
+    uint64_t matches;
+    struct buffer out;
+};
+
+// add a selected line, [line, end), to job
+void searchEmit(struct searchJob* job, const char* line, const char* end, uint64_t lineNumber) {
+    job->matches++;
+    if (!job->format)
+        return;
+    char number[32];
+    size_t prefixLen = job->prefix != NULL ? strlen(job->prefix) : 0;
+    int numberLen = job->numbers ? sprintf(number, "%llu:", (unsigned long long)lineNumber) : 0;
+    bufferReserve(&job->out, prefixLen + numberLen + (end - line) + 1);
+    memcpy(job->out.data + job->out.len, job->prefix, prefixLen);
+    memcpy(job->out.data + job->out.len + prefixLen, number, numberLen);
+    job->out.len += prefixLen + numberLen;
+    memcpy(job->out.data + job->out.len, line, end - line);
+    job->out.len += end - line;
+    job->out.data[job->out.len++] = '\n';
+}
+
+// newlines in p[0..n)
+uint64_t countLines(const char* p, size_t n) {
+    struct wcCounts c = { 0, 0, 0 };
+    wcCount((const unsigned char*)p, n, 1, 0, &c);
+    return c.lines;
+}
+
+// select the lines of job's piece: those with a match, or with invert those between them
+void* searchChunk(void* arg) {
+    struct searchJob* job = arg;
+    const struct searchPattern* sp = job->sp;
+    const char* p = job->start;
+    const char* end = job->start + job->n;
+    uint64_t lineNumber = job->firstLine;
+    while (p < end && !(job->stopAtFirst && job->matches > 0)) {
+        const char* lineEnd = NULL;
+        const char* line = searchNextLine(sp, p, end - p, &lineEnd);
+        if (sp->invert) {
+            // every line before the next match
+            const char* stop = line != NULL ? line : end;
+            while (p < stop && !(job->stopAtFirst && job->matches > 0)) {
+                const char* next = memchr(p, '\n', stop - p);
+                next = next != NULL ? next : stop;
+                searchEmit(job, p, next, lineNumber++);
+                p = next + 1;
+            }
+            if (line == NULL)
+                break;
+            lineNumber++;
+        }
+        else {
+            if (line == NULL)
+                break;
+            if (job->numbers)
+                lineNumber += countLines(p, line - p);
+            searchEmit(job, line, lineEnd, lineNumber++);
+        }
+        p = lineEnd + 1;
+    }
+    return NULL;
+}
+
+int searchOutputClosed = 0;     // the reader of search's output went away, stop quietly
+
+// search fd, writing the lines selected as shape says to outFD. Regular files are mapped and
+// searched in 32MB pieces cut at newlines, as many at once as there are CPUs, with their
+// output written in order; anything else is read in 1MB blocks of whole lines.
+// Returns the selected line count, -1 with errno set on an error
+int64_t searchFD(int fd, struct searchJob* shape, int outFD) {
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+        return -1;
+    uint64_t matches = 0;
+    uint64_t lineNumber = 1;
+    off_t offset = S_ISREG(st.st_mode) ? lseek(fd, 0, SEEK_CUR) : -1;
+    char* data = MAP_FAILED;
+    if (offset != -1 && st.st_size > offset)
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data != MAP_FAILED) {
+        madvise(data, st.st_size, MADV_SEQUENTIAL);
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        int threads = cpus < 1 ? 1 : cpus < 16 ? cpus : 16;
+        struct searchJob jobs[16];
+        const char* p = data + offset;
+        const char* end = data + st.st_size;
+        while (p < end && !copyInterrupted && !searchOutputClosed && !(shape->stopAtFirst && matches > 0)) {
+            int count = 0;
+            for (; count < threads && p < end; count++) {
+                const char* stop = end - p > (32 << 20) ? memchr(p + (32 << 20), '\n', end - p - (32 << 20)) : NULL;
+                stop = stop != NULL ? stop + 1 : end;
+                jobs[count] = *shape;
+                jobs[count].start = p;
+                jobs[count].n = stop - p;
+                jobs[count].firstLine = lineNumber;
+                if (shape->numbers)
+                    lineNumber += countLines(p, stop - p);
+                p = stop;
+            }
+            // the calling thread takes the first piece, or any a thread could not start for
+            for (int i = 1; i < count; i++) {
+                if (pthread_create(&jobs[i].thread, NULL, searchChunk, &jobs[i]) != 0) {
+                    jobs[i].thread = 0;
+                    searchChunk(&jobs[i]);
+                }
+            }
+            searchChunk(&jobs[0]);
+            for (int i = 0; i < count; i++) {
+                if (i > 0 && jobs[i].thread != 0)
+                    pthread_join(jobs[i].thread, NULL);
+                if (!(shape->stopAtFirst && matches > 0)) {
+                    matches += jobs[i].matches;
+                    if (jobs[i].out.len > 0 && !searchOutputClosed && writeAll(outFD, jobs[i].out.data, jobs[i].out.len) == -1)
+                        searchOutputClosed = 1;
+                }
+                free(jobs[i].out.data);
+            }
+        }
+        munmap(data, st.st_size);
+        lseek(fd, st.st_size, SEEK_SET);
+        return matches;
+    }
+    struct buffer in = { NULL, 0, 0 };
+    int atEnd = 0;
+    while (!atEnd && !copyInterrupted && !searchOutputClosed && !(shape->stopAtFirst && matches > 0)) {
+        bufferReserve(&in, 1 << 20);
+        ssize_t n = read(fd, in.data + in.len, in.cap - in.len);
+        if (n == -1 && errno == EINTR && !copyInterrupted)
+            continue;
+        if (n == -1) {
+            free(in.data);
+            return -1;
+        }
+        in.len += n;
+        atEnd = n == 0;
+        // whole lines only, the partial last one waits for the rest unless input has ended
+        char* last = memrchr(in.data, '\n', in.len);
+        size_t whole = atEnd ? in.len : last != NULL ? last + 1 - in.data : 0;
+        if (whole == 0)
+            continue;
+        struct searchJob job = *shape;
+        job.start = in.data;
+        job.n = whole;
+        job.firstLine = lineNumber;
+        searchChunk(&job);
+        if (shape->numbers)
+            lineNumber += countLines(in.data, whole);
+        matches += job.matches;
+        if (job.out.len > 0 && writeAll(outFD, job.out.data, job.out.len) == -1)
+            searchOutputClosed = 1;
+        free(job.out.data);
+        memmove(in.data, in.data + whole, in.len - whole);
+        in.len -= whole;
+    }
+    free(in.data);
+    return matches;
+}
+
+// search [-FEivcnlq] PATTERN [FILE...]: print the lines of the files, or stdin for none or -,
+// that match PATTERN, a basic regular expression (extended with -E, a fixed string with -F),
+// with the file name first when there are several. -i ignores case, -v selects the lines
+// that do not match, -c counts them, -n numbers them, -l lists the files with any and -q
+// only sets the status. The status is 0 if a line was selected, 1 if none and 2 on an error
+int searchBuiltin(struct command* com) {
+    struct dataIO io;
+    int fixed = 0, extended = 0, countOnly = 0, listFiles = 0, quiet = 0;
+    struct searchPattern sp = { NULL, 0, 0, 0, 0 };
+    struct searchJob shape = { 0 };
+    int i = 1;
+    for (; i < com->numArgs && com->args[i][0] == '-' && com->args[i][1] != 0; i++) {
+        if (strcmp(com->args[i], "--") == 0) {
+            i++;
+            break;
+        }
+        for (char* o = com->args[i] + 1; *o != 0; o++) {
+            if (strchr("FEivcnlq", *o) == NULL) {
+                printf("usage: search [-FEivcnlq] PATTERN [FILE...]\n");
+                fflush(stdout);
+                lfStatus = 2 << 8;
+                return 2;
+            }
+            fixed |= *o == 'F';
+            extended |= *o == 'E';
+            sp.icase |= *o == 'i';
+            sp.invert |= *o == 'v';
+            countOnly |= *o == 'c';
+            shape.numbers |= *o == 'n';
+            listFiles |= *o == 'l';
+            quiet |= *o == 'q';
+        }
+    }
+    if (i >= com->numArgs) {
+        printf("usage: search [-FEivcnlq] PATTERN [FILE...]\n");
+        fflush(stdout);
+        lfStatus = 2 << 8;
+        return 2;
+    }
+    sp.text = com->args[i++];
+    sp.len = strlen(sp.text);
+    // a pattern without special characters is a fixed string however it is given
+    sp.literal = fixed || strpbrk(sp.text, extended ? ".[]*^$\\+?(){}|" : ".[]*^$\\") == NULL;
+    if (!sp.literal) {
+        int error = regcomp(&sp.regex, sp.text, REG_NEWLINE | (extended ? REG_EXTENDED : 0) | (sp.icase ? REG_ICASE : 0));
+        if (error != 0) {
+            char message[256];
+            regerror(error, &sp.regex, message, sizeof(message));
+            printf("search: %s\n", message);
+            fflush(stdout);
+            lfStatus = 2 << 8;
+            return 2;
+        }
+    }
+    if (dataStart(com, &io, 1, 2)) {
+        if (!sp.literal)
+            regfree(&sp.regex);
+        return 2;
+    }
+    char* stdinOnly[] = { "-" };
+    char** names = i < com->numArgs ? com->args + i : stdinOnly;
+    int count = i < com->numArgs ? com->numArgs - i : 1;
+    shape.sp = &sp;
+    shape.format = !countOnly && !listFiles && !quiet;
+    shape.stopAtFirst = listFiles || quiet;
+    searchOutputClosed = 0;
+    int selected = 0;
+    int failed = 0;
+    for (int f = 0; f < count && !copyInterrupted && !searchOutputClosed && !(quiet && selected); f++) {
+        int isStdin = strcmp(names[f], "-") == 0;
+        char* label = isStdin ? "(standard input)" : names[f];
+        int fd = isStdin ? io.in : open(names[f], O_RDONLY | O_CLOEXEC);
+        char* prefix = NULL;
+        if (count > 1) {
+            prefix = malloc(strlen(label) + 2);
+            sprintf(prefix, "%s:", label);
+        }
+        shape.prefix = prefix;
+        int64_t matches = fd != -1 ? searchFD(fd, &shape, io.out) : -1;
+        if (matches == -1 && !copyInterrupted) {
+            fprintf(stderr, "search: ");
+            perror(label);
+            failed = 1;
+        }
+        else if (matches >= 0) {
+            selected |= matches > 0;
+            if (countOnly && !quiet)
+                dprintf(io.out, "%s%lld\n", prefix != NULL ? prefix : "", (long long)matches);
+            else if (listFiles && matches > 0 && !quiet)
+                dprintf(io.out, "%s\n", label);
+        }
+        free(prefix);
+        if (fd != -1 && fd != io.in)
+            close(fd);
+    }
+    if (!sp.literal)
+        regfree(&sp.regex);
+    // like grep: an error outweighs a match unless only the status was wanted
+    return dataFinish(&io, (failed && !(quiet && selected)) ? 2 : selected ? 0 : 1);
+}
+
+// how sort orders lines
+struct sortOptions {
+    int reverse;
+    int numeric;
+    int unique;
+    size_t memory;      // bytes of lines and records held before a run is spilled
+    char* output;       // -o FILE, NULL for stdout
+    int files;          // index of the first file argument
+};
+
+// parse the options of sort into opts. Returns 1 if there is one it does not take
+int sortParse(struct command* com, struct sortOptions* opts) {
+    struct sortOptions parsed = { 0, 0, 0, 256 << 20, NULL, 1 };
+    int i = 1;
+    for (; i < com->numArgs && com->args[i][0] == '-' && com->args[i][1] != 0; i++) {
+        if (strcmp(com->args[i], "--") == 0) {
+            i++;
+            break;
+        }
+        for (char* o = com->args[i] + 1; *o != 0; o++) {
+            if (*o == 'r' || *o == 'n' || *o == 'u') {
+                parsed.reverse |= *o == 'r';
+                parsed.numeric |= *o == 'n';
+                parsed.unique |= *o == 'u';
+                continue;
+            }
+            if (*o != 'S' && *o != 'o')
+                return 1;
+            // the value is the rest of the word or the next one
+            char* value = o[1] != 0 ? o + 1 : com->args[i + 1];
+            if (value == NULL)
+                return 1;
+            if (o[1] == 0)
+                i++;
+            if (*o == 'o') {
+                parsed.output = value;
+            }
+            else {
+                char* end;
+                double size = strtod(value, &end);
+                const char* units = "BKMGT";
+                const char* unit = *end != 0 ? strchr(units, toupper((unsigned char)*end)) : NULL;
+                if (size <= 0 || (*end != 0 && (unit == NULL || *unit == 0 || end[1] != 0)))
+                    return 1;
+                // a bare number is KiB as in sort
+                int shift = unit != NULL ? (unit - units) * 10 : 10;
+                if (size * ((size_t)1 << shift) >= SIZE_MAX / 2)
+                    return 1;
+                parsed.memory = size * ((size_t)1 << shift);
+                parsed.memory = parsed.memory < 65536 ? 65536 : parsed.memory;
+            }
+            break;
+        }
+    }
+    // options after the files, as sort takes them, are left to it
+    for (int j = i; j < com->numArgs && (i == 1 || strcmp(com->args[i - 1], "--") != 0); j++) {
+        if (com->args[j][0] == '-' && com->args[j][1] != 0)
+            return 1;
+    }
+    parsed.files = i;
+    if (opts != NULL)
+        *opts = parsed;
+    return 0;
+}
+
+// a line being sorted. Its key settles most comparisons without touching the line: the first
+// 8 bytes as a big endian number, or with -n the leading number with its bits made to order
+// as unsigned
+struct sortRecord {
+    uint64_t prefix;
+    const char* p;
+    size_t len;
+};
+
+// the leading number of a line for -n: blanks, an optional minus, digits and a fraction
+double sortNumber(const char* p, size_t len) {
+    char text[64];
+    size_t i = 0;
+    while (i < len && (p[i] == ' ' || p[i] == '\t'))
+        i++;
+    size_t n = 0;
+    if (i < len && p[i] == '-')
+        text[n++] = p[i++];
+    while (i < len && n < sizeof(text) - 1 && (isdigit((unsigned char)p[i]) || p[i] == '.'))
+        text[n++] = p[i++];
+    text[n] = 0;
+    return atof(text);
+}
+
+// record for the line p[0..len)
+struct sortRecord sortRecordFor(const struct sortOptions* opts, const char* p, size_t len) {
+    struct sortRecord r = { 0, p, len };
+    if (opts->numeric) {
+        double number = sortNumber(p, len) + 0.0;   // -0 is 0
+        memcpy(&r.prefix, &number, sizeof(r.prefix));
+        r.prefix = (r.prefix >> 63) ? ~r.prefix : r.prefix | (1ull << 63);
+        return r;
+    }
+    for (size_t i = 0; i < 8; i++) {
+        r.prefix = (r.prefix << 8) | (i < len ? (unsigned char)p[i] : 0);
+    }
+    return r;
+}
+
+// order of two lines: by their keys, then with -n by their bytes unless -u asks for the
+// first line of each number, all reversed with -r
+int sortCompare(const struct sortOptions* opts, const struct sortRecord* a, const struct sortRecord* b) {
+    int result;
+    if (a->prefix != b->prefix) {
+        result = a->prefix < b->prefix ? -1 : 1;
+    }
+    else if (opts->numeric && opts->unique) {
+        return 0;
+    }
+    else {
+        int c = memcmp(a->p, b->p, a->len < b->len ? a->len : b->len);
+        result = c != 0 ? c : (a->len > b->len) - (a->len < b->len);
+    }
+    return opts->reverse ? -result : result;
+}
+
+// stable merge sort of recs[0..n), using tmp[0..n) as scratch
+void sortRecords(const struct sortOptions* opts, struct sortRecord* recs, struct sortRecord* tmp, size_t n) {
+    if (n <= 16) {
+        for (size_t i = 1; i < n; i++) {
+            struct sortRecord r = recs[i];
+            size_t j = i;
+            for (; j > 0 && sortCompare(opts, &recs[j - 1], &r) > 0; j--) {
+                recs[j] = recs[j - 1];
+            }
+            recs[j] = r;
+        }
+        return;
+    }
+    size_t half = n / 2;
+    sortRecords(opts, recs, tmp, half);
+    sortRecords(opts, recs + half, tmp + half, n - half);
+    if (sortCompare(opts, &recs[half - 1], &recs[half]) <= 0)
+        return;     // already in order, as in presorted input
+    size_t i = 0, j = half, k = 0;
+    while (i < half && j < n) {
+        tmp[k++] = sortCompare(opts, &recs[j], &recs[i]) < 0 ? recs[j++] : recs[i++];
+    }
+    memcpy(tmp + k, recs + i, sizeof(struct sortRecord) * (half - i));
+    k += half - i;
+    memcpy(recs, tmp, sizeof(struct sortRecord) * k);
+}
+
+// one thread's share of a run
+struct sortPart {
+    pthread_t thread;
+    const struct sortOptions* opts;
+    struct sortRecord* recs;
+    struct sortRecord* tmp;
+    size_t n;
+};
+
+void* sortPartThread(void* arg) {
+    struct sortPart* part = arg;
+    sortRecords(part->opts, part->recs, part->tmp, part->n);
+    return NULL;
+}
+
+// sort recs[0..n): from 64k lines in up to one part per CPU sorted on threads, then merged
+// two at a time
+void sortRun(const struct sortOptions* opts, struct sortRecord* recs, struct sortRecord* tmp, size_t n) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t parts = n >= 65536 && cpus > 1 ? (cpus < 16 ? cpus : 16) : 1;
+    struct sortPart part[16];
+    size_t bounds[17];
+    for (size_t t = 0; t <= parts; t++) {
+        bounds[t] = n / parts * t;
+    }
+    bounds[parts] = n;
+    for (size_t t = 0; t < parts; t++) {
+        struct sortPart p = { 0, opts, recs + bounds[t], tmp + bounds[t], bounds[t + 1] - bounds[t] };
+        part[t] = p;
+        if (t > 0 && pthread_create(&part[t].thread, NULL, sortPartThread, &part[t]) != 0) {
+            part[t].thread = 0;
+            sortPartThread(&part[t]);
+        }
+    }
+    sortPartThread(&part[0]);
+    for (size_t t = 1; t < parts; t++) {
+        if (part[t].thread != 0)
+            pthread_join(part[t].thread, NULL);
+    }
+    // merge neighbouring sorted parts until one is left
+    for (size_t width = 1; width < parts; width *= 2) {
+        for (size_t t = 0; t + width < parts; t += 2 * width) {
+            size_t from = bounds[t];
+            size_t mid = bounds[t + width];
+            size_t to = bounds[t + 2 * width < parts ? t + 2 * width : parts];
+            size_t i = from, j = mid, k = from;
+            while (i < mid && j < to) {
+                tmp[k++] = sortCompare(opts, &recs[j], &recs[i]) < 0 ? recs[j++] : recs[i++];
+            }
+            memcpy(tmp + k, recs + i, sizeof(struct sortRecord) * (mid - i));
+            k += mid - i;
+            memcpy(recs + from, tmp + from, sizeof(struct sortRecord) * (k - from));
+        }
+    }
+}
+
+// sorted output on its way to a descriptor, written 1MB at a time; with unique set a line
+// equal to the one before it is dropped
+struct sortWriter {
+    int fd;
+    struct buffer out;
+    const struct sortOptions* opts;
+    struct sortRecord last;     // previous line, a copy in lastLine for -u
+    struct buffer lastLine;
+    int haveLast;
+    int failed;
+};
+
+void sortWrite(struct sortWriter* w, const struct sortRecord* r) {
+    if (w->opts->unique) {
+        if (w->haveLast && sortCompare(w->opts, &w->last, r) == 0)
+            return;
+        w->lastLine.len = 0;
+        bufferReserve(&w->lastLine, r->len);
+        memcpy(w->lastLine.data, r->p, r->len);
+        w->last = *r;
+        w->last.p = w->lastLine.data;
+        w->haveLast = 1;
+    }
+    bufferReserve(&w->out, r->len + 1);
+    memcpy(w->out.data + w->out.len, r->p, r->len);
+    w->out.len += r->len;
+    w->out.data[w->out.len++] = '\n';
+    if (w->out.len >= (1 << 20)) {
+        w->failed |= writeAll(w->fd, w->out.data, w->out.len) == -1;
+        w->out.len = 0;
+    }
+}
+
+void sortFlush(struct sortWriter* w) {
+    if (w->out.len > 0)
+        w->failed |= writeAll(w->fd, w->out.data, w->out.len) == -1;
+    w->out.len = 0;
+}
+
+// a temporary file for a spilled run, already unlinked; in $TMPDIR or /tmp
+int sortTempFile() {
+    const char* dir = varGet("TMPDIR") != NULL ? varGet("TMPDIR") : "/tmp";
+    int fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd != -1)
+        return fd;
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/smallsh-sort-XXXXXX", dir);
+    fd = mkostemp(path, O_CLOEXEC);
+    if (fd != -1)
+        unlink(path);
+    return fd;
+}
+
+// a run being merged: its fd read through a reader, and the line it is at
+struct sortSource {
+    struct reader in;
+    struct buffer line;
+    struct sortRecord current;
+};
+
+// read the next line of a run into s. Returns 0 at its end
+int sortAdvance(const struct sortOptions* opts, struct sortSource* s) {
+    s->line.len = 0;
+    ssize_t n;
+    while ((n = readerLine(&s->in, &s->line)) == -1 && !copyInterrupted) {
+        ;
+    }
+    if (n <= 0)
+        return 0;
+    if (s->line.len > 0 && s->line.data[s->line.len - 1] == '\n')
+        s->line.len--;
+    s->current = sortRecordFor(opts, s->line.data, s->line.len);
+    return 1;
+}
+
+// restore the heap order of heap[0..n) below slot i, the smallest line on top
+void sortSiftDown(const struct sortOptions* opts, struct sortSource** heap, size_t n, size_t i) {
+    while (1) {
+        size_t least = i;
+        for (size_t child = 2 * i + 1; child <= 2 * i + 2 && child < n; child++) {
+            // ties go to the earlier run, so equal lines keep their input order
+            int c = sortCompare(opts, &heap[child]->current, &heap[least]->current);
+            if (c < 0 || (c == 0 && heap[child] < heap[least]))
+                least = child;
+        }
+        if (least == i)
+            return;
+        struct sortSource* swap = heap[i];
+        heap[i] = heap[least];
+        heap[least] = swap;
+        i = least;
+    }
+}
+
+// sort [-rnu] [-S SIZE] [-o FILE] [FILE...]: sort the lines of the files, or stdin for none
+// or -, by their bytes, by their leading numbers with -n, reversed with -r and without repeats
+// with -u. Up to SIZE (default 256M) of lines are sorted in memory at a time; beyond that the
+// sorted runs go to temporary files and are merged at the end
+int sortBuiltin(struct command* com) {
+    struct sortOptions opts;
+    sortParse(com, &opts);
+    struct dataIO io;
+    int result = 0;
+    if (dataStart(com, &io, 0, 2))
+        return 2;
+    char* stdinOnly[] = { "-" };
+    char** names = opts.files < com->numArgs ? com->args + opts.files : stdinOnly;
+    int count = opts.files < com->numArgs ? com->numArgs - opts.files : 1;
+    // half the budget holds lines and half their records and the scratch space to sort them;
+    // a run is sorted and spilled when either fills up
+    struct buffer data = { malloc(opts.memory / 2), 0, opts.memory / 2 };
+    size_t maxRecords = opts.memory / 4 / sizeof(struct sortRecord);
+    size_t memoryLines = 0;
+    struct sortRecord* recs = malloc(sizeof(struct sortRecord) * maxRecords);
+    struct sortRecord* tmp = malloc(sizeof(struct sortRecord) * maxRecords);
+    if (data.data == NULL || recs == NULL || tmp == NULL) {
+        fprintf(stderr, "sort: cannot allocate %zu bytes for sorting, use a smaller -S\n", opts.memory);
+        result = 2;
+    }
+    int* runs = NULL;
+    int runCount = 0;
+    struct sortWriter w = { -1, { NULL, 0, 0 }, &opts, { 0, NULL, 0 }, { NULL, 0, 0 }, 0, 0 };
+    for (int f = 0; f <= count && !copyInterrupted && result == 0; f++) {
+        int fd = -1;
+        if (f < count) {
+            fd = strcmp(names[f], "-") == 0 ? io.in : open(names[f], O_RDONLY | O_CLOEXEC);
+            if (fd == -1) {
+                fprintf(stderr, "sort: ");
+                perror(names[f]);
+                result = 2;
+                break;
+            }
+        }
+        // fill data from fd; with f == count the lines left over are the last run
+        int atEnd = f == count;
+        while (!copyInterrupted) {
+            if (!atEnd && data.len < data.cap) {
+                ssize_t n = read(fd, data.data + data.len, data.cap - data.len);
+                if (n == -1 && errno == EINTR)
+                    continue;
+                if (n == -1) {
+                    fprintf(stderr, "sort: ");
+                    perror(names[f]);
+                    result = 2;
+                    break;
+                }
+                data.len += n;
+                if (n > 0)
+                    continue;
+                if (data.len > 0 && data.data[data.len - 1] != '\n' && f < count) {
+                    // a last line without a newline ends with its file
+                    bufferReserve(&data, 1);
+                    data.data[data.len++] = '\n';
+                }
+                break;
+            }
+            // buffer full, or all input read: sort the whole lines and spill them as a run
+            size_t lines = 0;
+            size_t used = 0;
+            for (char* p = data.data; p < data.data + data.len;) {
+                char* newline = memchr(p, '\n', data.data + data.len - p);
+                if ((newline == NULL && !atEnd) || lines == maxRecords)
+                    break;
+                size_t len = newline != NULL ? (size_t)(newline - p) : (size_t)(data.data + data.len - p);
+                recs[lines++] = sortRecordFor(&opts, p, len);
+                p += len + 1;
+                used = p - data.data < (ptrdiff_t)data.len ? (size_t)(p - data.data) : data.len;
+            }
+            if (lines == 0 && !atEnd) {
+                bufferReserve(&data, data.cap);     // one line longer than the budget
+                continue;
+            }
+            if (lines == 0 && runCount > 0)
+                break;
+            sortRun(&opts, recs, tmp, lines);
+            if (atEnd && runCount == 0 && used == data.len) {
+                memoryLines = lines;    // everything fit: written straight from memory below
+                break;
+            }
+            int runFD = sortTempFile();
+            if (runFD == -1) {
+                perror("sort: temporary file");
+                result = 2;
+                break;
+            }
+            runs = realloc(runs, sizeof(int) * (runCount + 1));
+            runs[runCount++] = runFD;
+            struct sortWriter spill = { runFD, { NULL, 0, 0 }, &opts, { 0, NULL, 0 }, { NULL, 0, 0 }, 0, 0 };
+            for (size_t i = 0; i < lines; i++) {
+                sortWrite(&spill, &recs[i]);
+            }
+            sortFlush(&spill);
+            free(spill.out.data);
+            free(spill.lastLine.data);
+            if (spill.failed) {
+                perror("sort: temporary file");
+                result = 2;
+                break;
+            }
+            memmove(data.data, data.data + used, data.len - used);
+            data.len -= used;
+            if (atEnd && data.len == 0)
+                break;
+        }
+        if (fd != -1 && fd != io.in)
+            close(fd);
+    }
+    // open the output only now, so -o may name one of the inputs
+    if (result == 0 && !copyInterrupted && opts.output != NULL) {
+        io.out = io.openedOut = open(opts.output, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (io.out == -1) {
+            fprintf(stderr, "sort: ");
+            perror(opts.output);
+            result = 2;
+        }
+    }
+    else if (result == 0 && !copyInterrupted && strcmp(com->output, "") != 0) {
+        io.out = io.openedOut = open(com->output, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (io.out == -1) {
+            perror(com->output);
+            result = 2;
+        }
+    }
+    if (result == 0 && !copyInterrupted) {
+        w.fd = io.out;
+        if (runCount == 0) {
+            for (size_t i = 0; i < memoryLines && !copyInterrupted && !w.failed; i++) {
+                sortWrite(&w, &recs[i]);
+            }
+        }
+        else {
+            // k-way merge of the runs through a heap of their current lines
+            free(data.data);
+            data.data = NULL;
+            struct sortSource* sources = calloc(runCount, sizeof(struct sortSource));
+            struct sortSource** heap = malloc(sizeof(struct sortSource*) * runCount);
+            size_t live = 0;
+            for (int i = 0; i < runCount; i++) {
+                lseek(runs[i], 0, SEEK_SET);
+                sources[i].in.fd = runs[i];
+                if (sortAdvance(&opts, &sources[i]))
+                    heap[live++] = &sources[i];
+            }
+            for (size_t i = live; i-- > 0;) {
+                sortSiftDown(&opts, heap, live, i);
+            }
+            while (live > 0 && !copyInterrupted && !w.failed) {
+                sortWrite(&w, &heap[0]->current);
+                if (!sortAdvance(&opts, heap[0]))
+                    heap[0] = heap[--live];
+                sortSiftDown(&opts, heap, live, 0);
+            }
+            for (int i = 0; i < runCount; i++) {
+                free(sources[i].in.data);
+                free(sources[i].line.data);
+            }
+            free(sources);
+            free(heap);
+        }
+        sortFlush(&w);
+        if (w.failed && errno != EPIPE) {
+            perror("sort: write");
+            result = 2;
+        }
+    }
+    for (int i = 0; i < runCount; i++) {
+        close(runs[i]);
+    }
+    free(runs);
+    free(data.data);
+    free(recs);
+    free(tmp);
+    free(w.out.data);
+    free(w.lastLine.data);
+    return dataFinish(&io, result);
+}
+
+// what head or tail prints: count lines, or bytes with -c, from the start for head and the
+// end for tail; inverse turns that around, for head -n -N (all but the last N) and tail -n +N
+// (from the Nth on)
+struct headTailOptions {
+    uint64_t count;
+    int bytes;
+    int inverse;
+    int follow;     // tail -f
+    int files;      // index of the first file argument
+};
+
+// parse the options of head, or of tail if tail is set, into opts. Returns 1 if there is one
+// it does not take
+int headTailParse(struct command* com, int tail, struct headTailOptions* opts) {
+    struct headTailOptions parsed = { 10, 0, 0, 0, 1 };
+    int i = 1;
+    for (; i < com->numArgs && com->args[i][0] == '-' && com->args[i][1] != 0; i++) {
+        char* arg = com->args[i];
+        char* value;
+        if (strcmp(arg, "--") == 0) {
+            i++;
+            break;
+        }
+        if (tail && strcmp(arg, "-f") == 0) {
+            parsed.follow = 1;
+            continue;
+        }
+        if (isdigit((unsigned char)arg[1])) {
+            value = arg + 1;    // -N is -n N
+        }
+        else if (arg[1] == 'n' || arg[1] == 'c') {
+            value = arg[2] != 0 ? arg + 2 : com->args[++i];
+        }
+        else {
+            return 1;
+        }
+        if (value == NULL)
+            return 1;
+        parsed.bytes = arg[1] == 'c';
+        parsed.inverse = *value == (tail ? '+' : '-');
+        value += *value == '+' || *value == '-';
+        if (*value == 0 || strspn(value, "0123456789") != strlen(value))
+            return 1;   // the utilities also take unit suffixes
+        parsed.count = strtoull(value, NULL, 10);
+    }
+    // options after the files, as the utilities take them, are left to them
+    for (int j = i; j < com->numArgs && (i == 1 || strcmp(com->args[i - 1], "--") != 0); j++) {
+        if (com->args[j][0] == '-' && com->args[j][1] != 0)
+            return 1;
+    }
+    parsed.files = i;
+    if (opts != NULL)
+        *opts = parsed;
+    return 0;
+}
+
+// offset just past the first *count lines of p[0..n), taking them off *count; n if it has
+// fewer whole lines than that
+size_t skipLines(const char* p, size_t n, uint64_t* count) {
+    size_t at = 0;
+    while (*count > 0 && at < n) {
+        const char* newline = memchr(p + at, '\n', n - at);
+        if (newline == NULL)
+            return n;
+        at = newline + 1 - p;
+        (*count)--;
+    }
+    return at;
+}
+
+// offset where the last count lines of p[0..n) start, scanning back from the end; a last line
+// without a newline counts as one
+size_t lastLines(const char* p, size_t n, uint64_t count) {
+    if (count == 0)
+        return n;
+    size_t at = n > 0 && p[n - 1] == '\n' ? n - 1 : n;
+    while (at > 0) {
+        const char* newline = memrchr(p, '\n', at);
+        if (newline == NULL)
+            return 0;
+        if (--count == 0)
+            return newline + 1 - p;
+        at = newline - p;
+    }
+    return 0;
+}
+
+// the part of p[0..n) head or tail prints, as [*start, *end)
+void headTailRange(const struct headTailOptions* o, int tail, const char* p, size_t n, size_t* start, size_t* end) {
+    uint64_t count = o->count;
+    size_t bytes = count < n ? count : n;
+    *start = 0;
+    *end = n;
+    if (tail && o->inverse) {
+        // tail +N starts at line or byte N, counting from 1
+        count -= count > 0;
+        *start = o->bytes ? (count < n ? count : n) : skipLines(p, n, &count);
+    }
+    else if (tail) {
+        *start = o->bytes ? n - bytes : lastLines(p, n, count);
+    }
+    else if (o->inverse) {
+        *end = o->bytes ? n - bytes : lastLines(p, n, count);
+    }
+    else {
+        *end = o->bytes ? bytes : skipLines(p, n, &count);
+    }
+}
+
+// head or tail of a stream that cannot be mapped. The start of the input is copied out as it
+// arrives and the rest left unread once done; the end is kept in a buffer that drops what can
+// no longer be part of it whenever it doubles. Returns -1 with errno set on an error
+int headTailStream(const struct headTailOptions* o, int tail, int fd, int out) {
+    struct buffer b = { NULL, 0, 0 };
+    uint64_t count = o->count - (tail && o->inverse && o->count > 0);
+    int fromStart = tail == o->inverse;     // head -n N and tail -n +N
+    size_t trimAt = 1 << 20;
+    int result = 0;
+    while (result == 0) {
+        bufferReserve(&b, 65536);
+        ssize_t n = read(fd, b.data + b.len, b.cap - b.len);
+        if (n == -1 && errno == EINTR && !copyInterrupted)
+            continue;
+        if (n == -1) {
+            result = -1;
+            break;
+        }
+        if (fromStart) {
+            // the first count lines or bytes are printed by head and skipped by tail
+            size_t take = !o->bytes ? skipLines(b.data, n, &count) : count < (uint64_t)n ? count : (size_t)n;
+            count -= o->bytes ? take : 0;
+            if (!tail) {
+                if (writeAll(out, b.data, take) == -1)
+                    result = -1;
+                else if (n == 0 || count == 0)
+                    break;
+                continue;
+            }
+            if (count > 0 && n > 0)
+                continue;
+            // past them tail prints the rest of this read and of the stream
+            if (n > 0 && (writeAll(out, b.data + take, n - take) == -1 || copyFD(fd, out) == -1))
+                result = -1;
+            break;
+        }
+        b.len += n;
+        if (n != 0 && b.len < trimAt)
+            continue;
+        // the last count lines or bytes are all tail prints and all head leaves out
+        size_t keep = o->bytes ? b.len - (count < b.len ? count : b.len) : lastLines(b.data, b.len, count);
+        if (!tail && writeAll(out, b.data, keep) == -1)
+            result = -1;
+        else if (tail && n == 0 && writeAll(out, b.data + keep, b.len - keep) == -1)
+            result = -1;
+        if (n == 0)
+            break;
+        memmove(b.data, b.data + keep, b.len - keep);
+        b.len -= keep;
+        trimAt = b.len * 2 > (1 << 20) ? b.len * 2 : 1 << 20;
+    }
+    free(b.data);
+    return result;
+}
+
+// head or tail of fd. A regular file is mapped and only what is printed is touched: tail scans
+// back from its end, head forward from its start. fd is left just after the part printed, as
+// the utilities leave a shared stdin. Returns -1 with errno set on an error
+int headTailFD(const struct headTailOptions* o, int tail, int fd, int out) {
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+        return -1;
+    off_t offset = S_ISREG(st.st_mode) ? lseek(fd, 0, SEEK_CUR) : -1;
+    if (offset == -1)
+        return headTailStream(o, tail, fd, out);
+    if (st.st_size <= offset)
+        return 0;
+    char* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+        return headTailStream(o, tail, fd, out);
+    size_t start, end;
+    headTailRange(o, tail, data + offset, st.st_size - offset, &start, &end);
+    int result = writeAll(out, data + offset + start, end - start);
+    munmap(data, st.st_size);
+    lseek(fd, offset + end, SEEK_SET);
+    return result;
+}
+
+// remove the inotify watch wd unless a follower still uses it; inotify gives every watch on
+// one file the same descriptor
+void followUnwatch(int wd) {
+    for (int i = 0; i < sizeof(followers) / sizeof(struct follower); i++) {
+        if (followers[i].name != NULL && followers[i].wd == wd)
+            return;
+    }
+    inotify_rm_watch(followInotify, wd);
+}
+
+// stop following f
+void followEnd(struct follower* f) {
+    free(f->name);
+    f->name = NULL;
+    followUnwatch(f->wd);
+    close(f->fd);
+    close(f->out);
+    followShown = followShown == f ? NULL : followShown;
+    followCount--;
+}
+
+// follow the file open on fd as name, printing to out; both are duplicated. Returns the
+// follower, NULL if the table is full or the file cannot be watched
+struct follower* followStart(const char* name, int fd, int out, int headers, int background) {
+    if (followInotify == -1 && (followInotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1) {
+        perror("tail: inotify_init1");
+        return NULL;
+    }
+    for (int i = 0; i < sizeof(followers) / sizeof(struct follower); i++) {
+        if (followers[i].name != NULL)
+            continue;
+        // watch the file that is open, wherever its name points now
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+        struct follower f = { strdup(name), fcntl(fd, F_DUPFD_CLOEXEC, 3), fcntl(out, F_DUPFD_CLOEXEC, 3),
+            inotify_add_watch(followInotify, path, IN_MODIFY | IN_ATTRIB), headers, background };
+        if (f.wd == -1 || f.fd == -1 || f.out == -1) {
+            fprintf(stderr, "tail: ");
+            perror(name);
+            if (f.wd != -1)
+                followUnwatch(f.wd);
+            close(f.fd);
+            close(f.out);
+            free(f.name);
+            return NULL;
+        }
+        followers[i] = f;
+        followCount++;
+        return &followers[i];
+    }
+    printf("tail: too many files followed\n");
+    fflush(stdout);
+    return NULL;
+}
+
+// print what was appended to f's file since it was last looked at. Returns 1 if anything was,
+// -1 if its output failed
+int followUpdate(struct follower* f) {
+    struct stat st;
+    off_t at = lseek(f->fd, 0, SEEK_CUR);
+    if (fstat(f->fd, &st) == -1 || at == -1)
+        return 0;
+    if (st.st_size < at) {
+        fprintf(stderr, "tail: %s: file truncated\n", f->name);
+        lseek(f->fd, 0, SEEK_SET);
+    }
+    else if (st.st_size == at) {
+        return 0;
+    }
+    if (f->headers && followShown != f)
+        dprintf(f->out, "\n==> %s <==\n", f->name);
+    followShown = f;
+    return copyFD(f->fd, f->out) == -1 ? -1 : 1;
+}
+
+// handle the inotify events waiting for the followers without blocking. A follower whose
+// output fails ends, and so does one in the background whose file was removed. Returns the
+// number of times anything was printed
+int followEvents() {
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int printed = 0;
+    ssize_t n;
+    while (followCount > 0 && (n = read(followInotify, events, sizeof(events))) > 0) {
+        const struct inotify_event* e;
+        for (char* p = events; p < events + n; p += sizeof(struct inotify_event) + e->len) {
+            e = (const struct inotify_event*)p;
+            for (int i = 0; i < sizeof(followers) / sizeof(struct follower); i++) {
+                struct follower* f = &followers[i];
+                if (f->name == NULL || f->wd != e->wd)
+                    continue;
+                int updated = followUpdate(f);
+                struct stat st;
+                if (updated == -1 || (f->background && fstat(f->fd, &st) == 0 && st.st_nlink == 0)) {
+                    printf("tail: stopped following %s\n", f->name);
+                    fflush(stdout);
+                    followEnd(f);
+                    printed++;
+                }
+                printed += updated == 1;
+            }
+        }
+    }
+    return printed;
+}
+
+// head [-n N | -c N | -N] [FILE...]: print the first N lines or bytes of the files, or stdin
+// for none or -, 10 lines by default; with a negative N all but the last N
+// tail [-n N | -c N | -N] [-f] [FILE...]: print the last N lines or bytes, with +N everything
+// from the Nth on. With -f it goes on printing what is appended to regular files until
+// interrupted, or with & in the background while the shell waits for input until the file is
+// removed. Other options run the utilities instead
+int headTailBuiltin(struct command* com) {
+    int tail = strcmp(com->args[0], "tail") == 0;
+    struct headTailOptions opts;
+    headTailParse(com, tail, &opts);
+    struct dataIO io;
+    int result = 0;
+    if (dataStart(com, &io, 1, 1))
+        return 1;
+    char* stdinOnly[] = { "-" };
+    char** names = opts.files < com->numArgs ? com->args + opts.files : stdinOnly;
+    int count = opts.files < com->numArgs ? com->numArgs - opts.files : 1;
+    int following = 0;
+    for (int i = 0; i < count && !copyInterrupted; i++) {
+        const char* name = strcmp(names[i], "-") == 0 ? "standard input" : names[i];
+        int fd = strcmp(names[i], "-") == 0 ? io.in : open(names[i], O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            fprintf(stderr, "%s: cannot open '%s' for reading: %s\n", com->args[0], names[i], strerror(errno));
+            result = 1;
+            continue;
+        }
+        if (count > 1)
+            dprintf(io.out, "%s==> %s <==\n", i > 0 ? "\n" : "", name);
+        if (headTailFD(&opts, tail, fd, io.out) == -1 && !copyInterrupted) {
+            if (errno != EPIPE) {
+                fprintf(stderr, "%s: %s: %s\n", com->args[0], name, strerror(errno));
+                result = 1;
+            }
+        }
+        else if (opts.follow) {
+            // a pipe has nothing more to give once it ends
+            struct stat st;
+            struct follower* f = NULL;
+            if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+                f = followStart(name, fd, io.out, count > 1, com->background);
+            following += f != NULL;
+            followShown = f != NULL ? f : followShown;
+        }
+        if (fd != io.in)
+            close(fd);
+    }
+    if (following > 0 && com->background) {
+        printf("following %d file%s in background\n", following, following > 1 ? "s" : "");
+        fflush(stdout);
+    }
+    else if (following > 0) {
+        // until interrupted or no output is left; files followed in the background are fed
+        // meanwhile too
+        while (!copyInterrupted && following > 0) {
+            struct pollfd pfd = { followInotify, POLLIN, 0 };
+            if (poll(&pfd, 1, -1) > 0)
+                followEvents();
+            following = 0;
+            for (int i = 0; i < sizeof(followers) / sizeof(struct follower); i++) {
+                following += followers[i].name != NULL && !followers[i].background;
+            }
+        }
+        for (int i = 0; i < sizeof(followers) / sizeof(struct follower); i++) {
+            if (followers[i].name != NULL && !followers[i].background)
+                followEnd(&followers[i]);
+        }
+    }
+    return dataFinish(&io, result);
+}
+
+// how xargs splits its input and runs the command
+struct xargsOptions {
+    int nul;            // -0: items end with NUL rather than newline
+    size_t maxItems;    // -n: at most this many per command, 0 for as many as fit
+    int procs;          // -P: commands run at once, 0 for as many as the job table takes
+    int noEmpty;        // -r: no command at all for empty input
+    int command;        // index of the command in the arguments
+};
+
+// parse the options of xargs into opts. Returns 1 if there is one it does not take
+int xargsParse(struct command* com, struct xargsOptions* opts) {
+    struct xargsOptions parsed = { 0, 0, 1, 0, 1 };
+    int i = 1;
+    for (; i < com->numArgs && com->args[i][0] == '-' && com->args[i][1] != 0; i++) {
+        if (strcmp(com->args[i], "--") == 0) {
+            i++;
+            break;
+        }
+        for (char* o = com->args[i] + 1; *o != 0; o++) {
+            if (*o == '0' || *o == 'r') {
+                parsed.nul |= *o == '0';
+                parsed.noEmpty |= *o == 'r';
+                continue;
+            }
+            if (*o != 'n' && *o != 'P')
+                return 1;
+            // the number is the rest of the word or the next one
+            char* value = o[1] != 0 ? o + 1 : com->args[i + 1];
+            if (value == NULL || *value == 0 || strspn(value, "0123456789") != strlen(value))
+                return 1;
+            if (o[1] == 0)
+                i++;
+            long n = atol(value);
+            if (*o == 'n' && n == 0)
+                return 1;
+            if (*o == 'n')
+                parsed.maxItems = n;
+            else
+                parsed.procs = n;
+            break;
+        }
+    }
+    parsed.command = i;
+    if (opts != NULL)
+        *opts = parsed;
+    return 0;
+}
+
+// what seq prints
+struct seqOptions {
+    long long first;
+    long long step;
+    long long last;
+    const char* separator;  // -s: between the numbers, which still end with a newline
+    int equalWidth;         // -w: zero padded to the width of the widest
+};
+
+// parse the arguments of seq into opts when not NULL. Returns 1 for what only the utility
+// does: -f, numbers other than integers and a zero step, and its usage errors
+int seqParse(struct command* com, struct seqOptions* opts) {
+    struct seqOptions parsed = { 1, 1, 0, "\n", 0 };
+    long long numbers[3];
+    int count = 0;
+    int i = 1;
+    // a negative number ends the options
+    for (; i < com->numArgs && com->args[i][0] == '-' && com->args[i][1] != 0 && !isdigit((unsigned char)com->args[i][1]); i++) {
+        char* a = com->args[i];
+        if (strcmp(a, "--") == 0) {
+            i++;
+            break;
+        }
+        if (strcmp(a, "-w") == 0) {
+            parsed.equalWidth = 1;
+        }
+        else if (a[1] == 's' && (a[2] != 0 || i + 1 < com->numArgs)) {
+            parsed.separator = a[2] != 0 ? a + 2 : com->args[++i];
+        }
+        else {
+            return 1;
+        }
+    }
+    for (; i < com->numArgs; i++) {
+        char* end;
+        errno = 0;
+        if (count == 3)
+            return 1;
+        numbers[count++] = strtoll(com->args[i], &end, 10);
+        if (com->args[i][0] == 0 || *end != 0 || errno == ERANGE)
+            return 1;
+    }
+    if (count == 0)
+        return 1;
+    parsed.last = numbers[count - 1];
+    if (count > 1)
+        parsed.first = numbers[0];
+    if (count == 3)
+        parsed.step = numbers[1];
+    if (parsed.step == 0)
+        return 1;
+    if (opts != NULL)
+        *opts = parsed;
+    return 0;
+}
+
+// write v at p in decimal, with its sign and zeros padding it to width. Returns the length
+size_t seqFormat(char* p, long long v, int width) {
+    char digits[24];
+    unsigned long long u = v < 0 ? -(unsigned long long)v : (unsigned long long)v;
+    int n = 0;
+    do {
+        digits[n++] = '0' + u % 10;
+        u /= 10;
+    } while (u > 0);
+    size_t len = 0;
+    if (v < 0)
+        p[len++] = '-';
+    for (int pad = width - n - (v < 0); pad > 0; pad--) {
+        p[len++] = '0';
+    }
+    while (n > 0) {
+        p[len++] = digits[--n];
+    }
+    return len;
+}
+
+// seq [-w] [-s SEP] [FIRST [STEP]] LAST: print the integers from FIRST to LAST, formatted
+// into 64KB blocks rather than a write each. Anything else runs the utility instead
+int seqBuiltin(struct command* com) {
+    struct seqOptions opts;
+    seqParse(com, &opts);
+    struct dataIO io;
+    int result = 0;
+    if (dataStart(com, &io, 1, 1))
+        return 1;
+    int width = 0;
+    if (opts.equalWidth) {
+        char scratch[24];
+        size_t a = seqFormat(scratch, opts.first, 0);
+        size_t b = seqFormat(scratch, opts.last, 0);
+        width = a > b ? a : b;
+    }
+    size_t separatorLen = strlen(opts.separator);
+    size_t cap = 65536 + separatorLen + 32;
+    char* buf = malloc(cap);
+    size_t len = 0;
+    long long v = opts.first;
+    int any = 0;
+    // counting up by one from zero or more, each number is the last with a carry added to
+    // its digits, kept right aligned in counter, rather than formatted afresh
+    char counter[24];
+    size_t counted = 0;
+    int counting = opts.step == 1 && opts.first >= 0 && width == 0;
+    if (counting) {
+        char first[24];
+        counted = seqFormat(first, opts.first, 0);
+        memcpy(counter + sizeof(counter) - counted, first, counted);
+    }
+    while (opts.step > 0 ? v <= opts.last : v >= opts.last) {
+        if (any) {
+            memcpy(buf + len, opts.separator, separatorLen);
+            len += separatorLen;
+        }
+        if (counting) {
+            memcpy(buf + len, counter + sizeof(counter) - counted, counted);
+            len += counted;
+            char* d = counter + sizeof(counter) - 1;
+            while (d >= counter + sizeof(counter) - counted && *d == '9')
+                *d-- = '0';
+            if (d < counter + sizeof(counter) - counted) {
+                *d = '1';
+                counted++;
+            }
+            else {
+                (*d)++;
+            }
+        }
+        else {
+            len += seqFormat(buf + len, v, width);
+        }
+        any = 1;
+        if (len >= 65536) {
+            if (copyInterrupted || writeAll(io.out, buf, len) == -1) {
+                len = 0;
+                break;
+            }
+            len = 0;
+        }
+        // stop rather than wrap around at the ends of the range
+        if (opts.step > 0 ? v > LLONG_MAX - opts.step : v < LLONG_MIN - opts.step)
+            break;
+        v += opts.step;
+    }
+    if (any && !copyInterrupted)
+        buf[len++] = '\n';
+    if (!copyInterrupted && writeAll(io.out, buf, len) == -1) {
+        if (errno != EPIPE && errno != EINTR)
+            perror("seq: write");
+        result = 1;
+    }
+    free(buf);
+    return dataFinish(&io, result);
+}
+
+// sleep DURATION...: wait for the sum of the durations, each a number with an optional s, m,
+// h or d suffix. The wait polls the job pidfds and the tail -f followers, so finished
+// background jobs are reported, queued ones admitted and followed files printed meanwhile,
+// and SIGINT ends it
+int sleepBuiltin(struct command* com) {
+    double total = 0;
+    if (com->numArgs < 2) {
+        printf("usage: sleep NUMBER[smhd]...\n");
+        fflush(stdout);
+        lfStatus = 1 << 8;
+        return 1;
+    }
+    for (int i = 1; i < com->numArgs; i++) {
+        char* end;
+        double value = strtod(com->args[i], &end);
+        const char* units = "smhd";
+        double scale[] = { 1, 60, 3600, 86400 };
+        const char* unit = *end != 0 && end[1] == 0 ? strchr(units, *end) : NULL;
+        if (end == com->args[i] || value < 0 || value != value || (*end != 0 && unit == NULL)) {
+            printf("sleep: invalid time interval '%s'\n", com->args[i]);
+            fflush(stdout);
+            lfStatus = 1 << 8;
+            return 1;
+        }
+        total += value * (unit != NULL ? scale[unit - units] : 1);
+    }
+    struct dataIO io;
+    if (dataStart(com, &io, 1, 1))
+        return 1;
+    double deadline = monotonicSeconds() + total;
+    while (!copyInterrupted) {
+        double left = deadline - monotonicSeconds();
+        if (left <= 0)
+            break;
+        struct pollfd pfd[sizeof(bgJobs) / sizeof(struct job) + 1];
+        int count = 0;
+        int blind = 0;  // a job without a pidfd, which only a periodic check sees end
+        for (int ind = 0; ind < (sizeof(bgJobs) / sizeof(struct job)); ind++) {
+            if (bgJobs[ind].pid == 0)
+                continue;
+            if (bgJobs[ind].pidfd == -1) {
+                blind = 1;
+                continue;
+            }
+            struct pollfd p = { bgJobs[ind].pidfd, POLLIN, 0 };
+            pfd[count++] = p;
+        }
+        if (followCount > 0) {
+            struct pollfd p = { followInotify, POLLIN, 0 };
+            pfd[count++] = p;
+        }
+        // queued jobs are retried every half second, as while waiting for input
+        if (admitQueued > 0 && left > 0.5)
+            left = 0.5;
+        if (blind && left > 0.1)
+            left = 0.1;
+        struct timespec timeout = { (time_t)left, (long)((left - (time_t)left) * 1e9) };
+        int ready = ppoll(pfd, count, &timeout, NULL);
+        if (ready == -1 && errno == EINTR)
+            continue;
+        if (ready == -1) {
+            perror("sleep: poll");
+            break;
+        }
+        if (ready > 0 || blind)
+            reapJobs();
+        if (ready > 0 && followCount > 0)
+            followEvents();
+        if (admitQueued > 0)
+            admitJobs();
+    }
+    return dataFinish(&io, 0);
+}
+
+// 1 if text[j] is an unquoted $IFS character, which ends a field for read; with white, only
+// one that is also white space
+int readDelimiter(const char* ifs, const char* text, const char* quoted, size_t j, int white) {
+    return text[j] != 0 && !quoted[j] && strchr(ifs, text[j]) != NULL && (!white || strchr(" \t\n", text[j]) != NULL);
+}
+
+// read [-r] [NAME...]: read a line of stdin into the NAMEs, split into fields at $IFS as
+// words are, the last NAME taking the rest of the line, or the whole line into REPLY for no
+// NAME. Without -r a backslash quotes the next character and one at the end of a line joins
+// the next line to it. Stdin is read through the shell's own reader when the commands come
+// from it, and otherwise through one of its own that reads exactly one line at a time from
+// a pipe; what either reads past the line is given back to a seekable stdin before another
+// command runs, so nothing is lost to it. Ends with 1 at end of file
+int readBuiltin(struct command* com) {
+    static struct buffer line = { NULL, 0, 0 };
+    int raw = 0;
+    int i = 1;
+    for (; i < com->numArgs && com->args[i][0] == '-' && com->args[i][1] != 0; i++) {
+        if (strcmp(com->args[i], "--") == 0) {
+            i++;
+            break;
+        }
+        if (strcmp(com->args[i], "-r") != 0) {
+            printf("read: %s: invalid option\n", com->args[i]);
+            fflush(stdout);
+            lfStatus = 2 << 8;
+            return 2;
+        }
+        raw = 1;
+    }
+    char** names = com->args + i;
+    int nameCount = com->numArgs - i;
+    for (int j = 0; j < nameCount; j++) {
+        if (nameLength(names[j]) != strlen(names[j])) {
+            printf("read: %s: not a valid identifier\n", names[j]);
+            fflush(stdout);
+            lfStatus = 2 << 8;
+            return 2;
+        }
+    }
+    // a redirected read has a reader of its own for the one line
+    struct reader own = { -1 };
+    struct reader* r = input.fd == 0 ? &input : &stdinReader;
+    if (strcmp(com->input, "") != 0) {
+        own.fd = open(com->input, O_RDONLY | O_CLOEXEC);
+        if (own.fd == -1) {
+            perror(com->input);
+            lfStatus = 1 << 8;
+            return 1;
+        }
+        r = &own;
+    }
+    else if (com->inFD != -1) {
+        own.fd = com->inFD;
+        r = &own;
+    }
+    else if (r == &stdinReader && stdinReader.data == NULL) {
+        stdinReader.exact = lseek(0, 0, SEEK_CUR) == -1;
+    }
+    struct sigaction saved[2];
+    int interruptible = 0;
+    line.len = 0;
+    int atEnd = 0;
+    copyInterrupted = 0;
+    while (!copyInterrupted) {
+        // SIGINT only needs to interrupt a read that may block, not take a buffered line
+        if (!interruptible && (r->end == r->start || memchr(r->data + r->start, '\n', r->end - r->start) == NULL)) {
+            copySignals(1, saved);
+            interruptible = 1;
+        }
+        size_t from = line.len;
+        ssize_t n = readerLine(r, &line);
+        if (n == -1)
+            continue;
+        if (n == 0 || line.data[line.len - 1] != '\n') {
+            atEnd = 1;
+            break;
+        }
+        line.len--;
+        // an odd run of backslashes at the end escapes the newline: the next line goes on
+        size_t slashes = 0;
+        while (!raw && from + slashes < line.len && line.data[line.len - 1 - slashes] == '\\')
+            slashes++;
+        if (slashes % 2 == 0)
+            break;
+        line.len--;
+    }
+    if (interruptible)
+        copySignals(0, saved);
+    if (r == &own) {
+        free(own.data);
+        if (strcmp(com->input, "") != 0)
+            close(own.fd);
+    }
+    if (copyInterrupted) {
+        lfStatus = 2;
+        printf("terminated by signal 2\n");
+        fflush(stdout);
+        return 1;
+    }
+    // drop the quoting backslashes, marking what they quoted so it does not split
+    bufferReserve(&line, line.len + 1);
+    char* quoted = malloc(line.len + 1);
+    size_t len = 0;
+    for (size_t j = 0; j < line.len; j++) {
+        int escaped = !raw && line.data[j] == '\\' && j + 1 < line.len;
+        if (!raw && line.data[j] == '\\' && !escaped)
+            continue;   // a backslash at the end of the input quotes nothing
+        j += escaped;
+        quoted[len] = escaped;
+        line.data[len++] = line.data[j];
+    }
+    line.data[len] = 0;
+    char* text = line.data;
+    if (nameCount == 0) {
+        varSet("REPLY", text, -1);
+    }
+    else {
+        const char* ifs = varGet("IFS") != NULL ? varGet("IFS") : " \t\n";
+        size_t p = 0;
+        while (readDelimiter(ifs, text, quoted, p, 1))
+            p++;
+        for (int j = 0; j < nameCount; j++) {
+            size_t start = p;
+            size_t end = len;
+            if (j + 1 < nameCount) {
+                while (p < len && !readDelimiter(ifs, text, quoted, p, 0))
+                    p++;
+                end = p;
+                // the delimiter: IFS white space around at most one other IFS character
+                while (readDelimiter(ifs, text, quoted, p, 1))
+                    p++;
+                if (readDelimiter(ifs, text, quoted, p, 0))
+                    p++;
+                while (readDelimiter(ifs, text, quoted, p, 1))
+                    p++;
+            }
+            else {
+                while (end > start && readDelimiter(ifs, text, quoted, end - 1, 1))
+                    end--;
+            }
+            char kept = text[end];
+            text[end] = 0;
+            varSet(names[j], text + start, -1);
+            text[end] = kept;
+        }
+    }
+    free(quoted);
+    lfStatus = atEnd << 8;
+    return atEnd;
+}
+
+// a file for copy's threads to copy, or a directory it created, whose mode and times are set
+// once its files are in
+struct copyJob {
+    char* from;
+    char* to;
+    struct stat st;
+};
+
+// what copy does, planned by the shell thread before its threads take the files in turn
+struct copyPlan {
+    struct copyJob* files;
+    size_t fileCount;
+    size_t fileCap;
+    struct copyJob* dirs;
+    size_t dirCount;
+    size_t dirCap;
+    int recursive;      // -r: directories too, symbolic links in them copied as links
+    int preserve;       // -p: owner, mode and times as well
+    int noReflink;      // FICLONE was refused, by the filesystem or for crossing them
+    size_t next;        // the next file to take
+    int failed;
+};
+
+// append a job copying from to to to list, growing it as needed
+void copyAdd(struct copyJob** list, size_t* count, size_t* cap, const char* from, const char* to, const struct stat* st) {
+    if (*count == *cap) {
+        *cap = *cap == 0 ? 256 : *cap * 2;
+        *list = realloc(*list, sizeof(struct copyJob) * *cap);
+    }
+    struct copyJob job = { strdup(from), strdup(to), *st };
+    (*list)[(*count)++] = job;
+}
+
+// dir/name, without doubling a slash dir ends with
+char* copyJoin(const char* dir, const char* name) {
+    size_t n = strlen(dir);
+    char* path = malloc(n + strlen(name) + 2);
+    sprintf(path, n > 0 && dir[n - 1] == '/' ? "%s%s" : "%s/%s", dir, name);
+    return path;
+}
+
+// report an error copy met at path
+void copyError(struct copyPlan* plan, const char* path, const char* message) {
+    fprintf(stderr, "copy: %s: %s\n", path, message);
+    __atomic_store_n(&plan->failed, 1, __ATOMIC_RELAXED);
+}
+
+// plan copying from to to: a regular file is queued for the threads, and with -r a symbolic
+// link is recreated and a directory created here, its entries planned in turn. fresh is 1
+// when to is in a directory just created, where nothing can be in the way
+void copyCollect(struct copyPlan* plan, const char* from, const char* to, int fresh) {
+    struct stat st;
+    if ((plan->recursive ? lstat(from, &st) : stat(from, &st)) == -1) {
+        copyError(plan, from, strerror(errno));
+        return;
+    }
+    if (S_ISREG(st.st_mode)) {
+        // the same file on both ends would be emptied before it was read
+        struct stat target;
+        if (!fresh && stat(to, &target) == 0 && target.st_dev == st.st_dev && target.st_ino == st.st_ino)
+            copyError(plan, from, "is the same file as its copy");
+        else
+            copyAdd(&plan->files, &plan->fileCount, &plan->fileCap, from, to, &st);
+        return;
+    }
+    if (S_ISLNK(st.st_mode)) {
+        char target[PATH_MAX];
+        ssize_t n = readlink(from, target, sizeof(target) - 1);
+        if (n == -1) {
+            copyError(plan, from, strerror(errno));
+            return;
+        }
+        target[n] = 0;
+        if (symlink(target, to) == -1 && (fresh || errno != EEXIST || unlink(to) == -1 || symlink(target, to) == -1))
+            copyError(plan, to, strerror(errno));
+        return;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        copyError(plan, from, "not a regular file, directory or symbolic link");
+        return;
+    }
+    if (!plan->recursive) {
+        copyError(plan, from, "is a directory, copied only with -r");
+        return;
+    }
+    // writable until its files are in, its own mode set after them
+    int created = mkdir(to, (st.st_mode & 07777) | S_IRWXU) == 0;
+    if (!created && errno != EEXIST) {
+        copyError(plan, to, strerror(errno));
+        return;
+    }
+    copyAdd(&plan->dirs, &plan->dirCount, &plan->dirCap, from, to, &st);
+    DIR* dir = opendir(from);
+    if (dir == NULL) {
+        copyError(plan, from, strerror(errno));
+        return;
+    }
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL && !copyInterrupted) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+        char* fromEntry = copyJoin(from, entry->d_name);
+        char* toEntry = copyJoin(to, entry->d_name);
+        copyCollect(plan, fromEntry, toEntry, created);
+        free(fromEntry);
+        free(toEntry);
+    }
+    closedir(dir);
+}
+
+// copy length bytes at offset of in, or up to its end if that comes first, to the same offset
+// of out, in the kernel with copy_file_range or, once it refuses (another filesystem type, an
+// old kernel), through buf. Returns 1 if in ended first, -1 with errno set on an error
+int copyRange(int in, int out, off_t offset, off_t length, char* buf, int* plain) {
+    while (length > 0 && !copyInterrupted) {
+        // in pieces of 64MB, so SIGINT is not left waiting for a whole large file
+        size_t chunk = length < (1 << 26) ? length : (1 << 26);
+        ssize_t n;
+        if (!*plain) {
+            loff_t inOffset = offset;
+            loff_t outOffset = offset;
+            n = copy_file_range(in, &inOffset, out, &outOffset, chunk, 0);
+            // some kernels copy nothing from procfs or sysfs files either: pread finds the end
+            if (n == 0 || (n == -1 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP || errno == EBADF))) {
+                *plain = 1;
+                continue;
+            }
+        }
+        else {
+            n = pread(in, buf, chunk < (1 << 17) ? chunk : (1 << 17), offset);
+            for (ssize_t written = 0; n > 0 && written < n; ) {
+                ssize_t w = pwrite(out, buf + written, n - written, offset + written);
+                if (w == -1 && errno == EINTR && !copyInterrupted)
+                    continue;
+                if (w == -1)
+                    return -1;
+                written += w;
+            }
+        }
+        if (n == 0)
+            return 1;   // shorter than its size said, or cut short while it was copied
+        if (n == -1) {
+            if (errno == EINTR && !copyInterrupted)
+                continue;
+            return -1;
+        }
+        offset += n;
+        length -= n;
+    }
+    return 0;
+}
+
+// copy the regular file of job: shared with a FICLONE reflink where the filesystem can,
+// otherwise its data, only the extents SEEK_DATA and SEEK_HOLE find in a sparse file, with
+// copyRange and the file then given its size, so holes stay holes. buf is the thread's own.
+// Returns -1 with errno set and the path it concerns in *path on an error
+int copyFile(struct copyPlan* plan, struct copyJob* job, char* buf, const char** path) {
+    *path = job->from;
+    int in = open(job->from, O_RDONLY | O_CLOEXEC);
+    if (in == -1)
+        return -1;
+    *path = job->to;
+    int out = open(job->to, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, job->st.st_mode & 07777);
+    if (out == -1) {
+        close(in);
+        return -1;
+    }
+    int result = 0;
+    // one refusal stands for the rest, saving a failed call a file
+    int cloned = !__atomic_load_n(&plan->noReflink, __ATOMIC_RELAXED) && ioctl(out, FICLONE, in) == 0;
+    if (!cloned && (errno == EOPNOTSUPP || errno == ENOTTY || errno == EINVAL || errno == EXDEV))
+        __atomic_store_n(&plan->noReflink, 1, __ATOMIC_RELAXED);
+    if (!cloned) {
+        off_t size = job->st.st_size;
+        int sparse = (off_t)job->st.st_blocks * 512 < size;
+        // other files are copied to their end, not their size, which is 0 for the files of
+        // procfs and sysfs; those of sysfs claim 4096 bytes in no blocks, and look sparse
+        off_t end = sparse ? size : INT64_MAX;
+        int ended = 0;
+        int plain = 0;
+        off_t data = 0;
+        while (result == 0 && data < end && !copyInterrupted) {
+            off_t hole = end;
+            if (sparse) {
+                off_t at = lseek(in, data, SEEK_DATA);
+                if (at == -1 && errno == ENXIO)
+                    break;  // a hole up to the end
+                if (at == -1) {
+                    sparse = 0;     // not told where the data is, so all of it is copied
+                    continue;
+                }
+                data = at;
+                hole = lseek(in, data, SEEK_HOLE);
+                hole = hole == -1 || hole > size ? size : hole;
+            }
+            *path = job->from;
+            result = copyRange(in, out, data, hole - data, buf, &plain);
+            ended = result == 1;
+            result = result == 1 ? 0 : result;
+            data = ended ? end : hole;
+        }
+        *path = job->to;
+        if (result == 0 && sparse && !ended && ftruncate(out, size) == -1)
+            result = -1;
+    }
+    if (result == 0 && plan->preserve) {
+        struct timespec times[2] = { job->st.st_atim, job->st.st_mtim };
+        if (fchown(out, job->st.st_uid, job->st.st_gid) == -1)
+            job->st.st_mode &= ~(S_ISUID | S_ISGID);    // as cp does when it cannot keep the owner
+        if (fchmod(out, job->st.st_mode & 07777) == -1 || futimens(out, times) == -1)
+            result = -1;
+    }
+    int error = errno;
+    if (close(out) == -1 && result == 0) {
+        result = -1;
+        error = errno;
+    }
+    close(in);
+    errno = error;
+    return result;
+}
+
+// one copy thread: take the next file until there are none left
+void* copyThread(void* arg) {
+    struct copyPlan* plan = arg;
+    char* buf = malloc(1 << 17);
+    while (!copyInterrupted) {
+        size_t i = __atomic_fetch_add(&plan->next, 1, __ATOMIC_RELAXED);
+        if (i >= plan->fileCount)
+            break;
+        const char* path;
+        if (copyFile(plan, &plan->files[i], buf, &path) == -1 && !copyInterrupted)
+            copyError(plan, path, strerror(errno));
+    }
+    free(buf);
+    return NULL;
+}
+
+// copy [-rp] [-j THREADS] SOURCE... DEST: copy the files to DEST, or into it when it is a
+// directory or there are several. With -r directories are copied with everything in them and
+// symbolic links as links, with -p owners, modes and times are kept. The directories are
+// read and created first, then a pool of threads, one per CPU unless -j says, copies the
+// files, each with a reflink where the filesystem shares extents and in the kernel otherwise,
+// holes in sparse files kept
+int copyBuiltin(struct command* com) {
+    struct copyPlan plan;
+    memset(&plan, 0, sizeof(plan));
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    long threads = cpus < 1 ? 1 : cpus;
+    int i = 1;
+    int usage = 0;
+    for (; i < com->numArgs && com->args[i][0] == '-' && com->args[i][1] != 0 && !usage; i++) {
+        if (strcmp(com->args[i], "--") == 0) {
+            i++;
+            break;
+        }
+        for (char* o = com->args[i] + 1; *o != 0 && !usage; o++) {
+            if (*o == 'r' || *o == 'R' || *o == 'p') {
+                plan.recursive |= *o != 'p';
+                plan.preserve |= *o == 'p';
+                continue;
+            }
+            // the count is the rest of the word or the next one
+            char* value = o[1] != 0 ? o + 1 : com->args[i + 1];
+            usage = *o != 'j' || value == NULL || *value == 0 || strspn(value, "0123456789") != strlen(value) || strlen(value) > 4;
+            if (usage)
+                break;
+            if (o[1] == 0)
+                i++;
+            threads = atol(value);
+            break;
+        }
+    }
+    if (usage || com->numArgs - i < 2) {
+        printf("usage: copy [-rp] [-j THREADS] SOURCE... DEST\n");
+        fflush(stdout);
+        lfStatus = 2 << 8;
+        return 2;
+    }
+    char** sources = com->args + i;
+    int sourceCount = com->numArgs - i - 1;
+    const char* dest = com->args[com->numArgs - 1];
+    struct stat destStat;
+    int intoDir = stat(dest, &destStat) == 0 && S_ISDIR(destStat.st_mode);
+    if (sourceCount > 1 && !intoDir) {
+        fprintf(stderr, "copy: %s: not a directory\n", dest);
+        lfStatus = 1 << 8;
+        return 1;
+    }
+    struct dataIO io;
+    if (dataStart(com, &io, 1, 1))
+        return 1;
+    for (int s = 0; s < sourceCount && !copyInterrupted; s++) {
+        // into a directory under the last component of the source, trailing slashes aside
+        char* name = strdup(sources[s]);
+        size_t n = strlen(name);
+        while (n > 1 && name[n - 1] == '/')
+            name[--n] = 0;
+        char* base = strrchr(name, '/');
+        base = base != NULL && base[1] != 0 ? base + 1 : name;
+        char* to = intoDir ? copyJoin(dest, base) : strdup(dest);
+        // a directory copied to a place inside itself would go on copying its own copy
+        char* parent = strdup(dest);
+        char* slash = strrchr(parent, '/');
+        if (!intoDir && slash == NULL)
+            strcpy(parent, ".");
+        else if (!intoDir)
+            slash[slash == parent] = 0;     // the parent of /x is /
+        char* realFrom = plan.recursive ? realpath(sources[s], NULL) : NULL;
+        char* realParent = realFrom != NULL ? realpath(parent, NULL) : NULL;
+        size_t len = realFrom != NULL ? strlen(realFrom) : 0;
+        struct stat st;
+        if (realParent != NULL && lstat(sources[s], &st) == 0 && S_ISDIR(st.st_mode) && strncmp(realParent, realFrom, len) == 0 &&
+            (realParent[len] == 0 || realParent[len] == '/' || len == 1))
+            copyError(&plan, sources[s], "not copied into itself");
+        else
+            copyCollect(&plan, sources[s], to, 0);
+        free(realFrom);
+        free(realParent);
+        free(parent);
+        free(to);
+        free(name);
+    }
+
+    // the threads leave SIGINT to the shell thread, which copies alongside them
+    threads = threads < 1 ? 1 : threads > 64 ? 64 : threads;
+    threads = (size_t)threads < plan.fileCount ? threads : (long)plan.fileCount;
+    pthread_t workers[64];
+    int started = 0;
+    sigset_t all, before;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &before);
+    for (; started + 1 < threads && !copyInterrupted; started++) {
+        if (pthread_create(&workers[started], NULL, copyThread, &plan) != 0)
+            break;  // the files are shared out among those that did start
+    }
+    pthread_sigmask(SIG_SETMASK, &before, NULL);
+    copyThread(&plan);
+    for (int t = 0; t < started; t++) {
+        pthread_join(workers[t], NULL);
+    }
+    // directories get their mode and times last, the deepest first, as adding files moved them
+    for (size_t d = plan.dirCount; d-- > 0 && !copyInterrupted; ) {
+        struct copyJob* dir = &plan.dirs[d];
+        struct timespec times[2] = { dir->st.st_atim, dir->st.st_mtim };
+        if (plan.preserve && lchown(dir->to, dir->st.st_uid, dir->st.st_gid) == -1)
+            dir->st.st_mode &= ~(S_ISUID | S_ISGID);
+        if ((plan.preserve || (dir->st.st_mode & S_IRWXU) != S_IRWXU) && chmod(dir->to, dir->st.st_mode & 07777) == -1)
+            copyError(&plan, dir->to, strerror(errno));
+        if (plan.preserve && utimensat(AT_FDCWD, dir->to, times, 0) == -1)
+            copyError(&plan, dir->to, strerror(errno));
+    }
+    for (size_t f = 0; f < plan.fileCount; f++) {
+        free(plan.files[f].from);
+        free(plan.files[f].to);
+    }
+    for (size_t d = 0; d < plan.dirCount; d++) {
+        free(plan.dirs[d].from);
+        free(plan.dirs[d].to);
+    }
+    free(plan.files);
+    free(plan.dirs);
+    return dataFinish(&io, plan.failed);
+}
+
+int coprocBuiltin(struct command* com);
+int walkBuiltin(struct command* com);
+int xargsBuiltin(struct command* com);
+
+// command run by the shell itself
+struct builtin {
+    const char* name;
+    int (*run)(struct command* com);
+    int pure;   // only reports state, so command substitution runs it without a fork
+};
+
+struct builtin builtins[] = {
+    { "exit", exitBuiltin, 0 },
+    { "cd", cdBuiltin, 0 },
+    { "status", statusBuiltin, 1 },
+    { "export", exportBuiltin, 0 },
+    { "unset", unsetBuiltin, 0 },
+    { "set", setBuiltin, 1 },
+    { "env", envBuiltin, 1 },
+    { "ulimit", ulimitBuiltin, 0 },
+    { "ratelimit", ratelimitBuiltin, 0 },
+    { "admit", admitBuiltin, 0 },
+    { "bgpolicy", bgpolicyBuiltin, 0 },
+    { "jobs", jobsBuiltin, 1 },
+    { "cgroup", cgroupBuiltin, 0 },
+    { "forkserver", forkserverBuiltin, 0 },
+    { "globcache", globcacheBuiltin, 0 },
+    { "let", letBuiltin, 0 },
+    { "coproc", coprocBuiltin, 0 },
+    { "cat", catBuiltin, 0 },
+    { "tee", teeBuiltin, 0 },
+    { "wc", wcBuiltin, 0 },
+    { "search", searchBuiltin, 0 },
+    { "sort", sortBuiltin, 0 },
+    { "head", headTailBuiltin, 0 },
+    { "tail", headTailBuiltin, 0 },
+    { "walk", walkBuiltin, 0 },
+    { "xargs", xargsBuiltin, 0 },
+    { "seq", seqBuiltin, 0 },
+    { "sleep", sleepBuiltin, 0 },
+    { "read", readBuiltin, 0 },
+    { "copy", copyBuiltin, 0 },
+};
+
+// the builtin com runs, NULL if it is an external command
+struct builtin* findBuiltin(struct command* com) {
+    for (int i = 0; i < sizeof(builtins) / sizeof(struct builtin); i++) {
+        if (strcmp(com->args[0], builtins[i].name) != 0)
+            continue;
+        // set and env with arguments run the utilities
+        if ((builtins[i].run == setBuiltin || builtins[i].run == envBuiltin) && com->numArgs > 1)
+            return NULL;
+        // so do cat, tee and wc with options they do not take
+        const char* letters = builtins[i].run == catBuiltin ? "u" : builtins[i].run == teeBuiltin ? "a" :
+            builtins[i].run == wcBuiltin ? "lwc" : NULL;
+        for (int j = 1; letters != NULL && j < com->numArgs; j++) {
+            if (com->args[j][0] == '-' && com->args[j][1] != 0 && strspn(com->args[j] + 1, letters) != strlen(com->args[j] + 1))
+                return NULL;
+        }
+        // and sort, head, tail, xargs and seq with any their parsers do not know
+        if (builtins[i].run == sortBuiltin && sortParse(com, NULL) != 0)
+            return NULL;
+        if (builtins[i].run == headTailBuiltin && headTailParse(com, builtins[i].name[0] == 't', NULL) != 0)
+            return NULL;
+        if (builtins[i].run == xargsBuiltin && xargsParse(com, NULL) != 0)
+            return NULL;
+        if (builtins[i].run == seqBuiltin && seqParse(com, NULL) != 0)
+            return NULL;
+        // a sleep in the background is a job like any other
+        if (builtins[i].run == sleepBuiltin && com->background == 1)
+            return NULL;
+        return &builtins[i];
+    }
+    return NULL;
+}
+
+// 1 for a builtin that only moves data between files and descriptors, which xargs and walk
+// -exec may run in the shell itself; the others would change the shell (cd, exit, export)
+int dataBuiltin(struct builtin* b) {
+    return b->run == catBuiltin || b->run == teeBuiltin || b->run == wcBuiltin || b->run == searchBuiltin ||
+        b->run == sortBuiltin || b->run == headTailBuiltin || b->run == walkBuiltin || b->run == xargsBuiltin ||
+        b->run == seqBuiltin || b->run == copyBuiltin;
+}
+
+// 1 if b runs as a background job for com with &: a data builtin, apart from tail -f, which
+// the shell feeds itself while it waits for input
+int builtinJob(struct command* com, struct builtin* b) {
+    struct headTailOptions opts;
+    if (b->run == headTailBuiltin && headTailParse(com, b->name[0] == 't', &opts) == 0 && opts.follow)
+        return 0;
+    return dataBuiltin(b);
+}
+
+// initialize the data members of a command
+void commandInit(struct command* com) {
+    com->args = NULL;
+    strcpy(com->input, "");
+    strcpy(com->output, "");
+    com->background = 0;
+    com->numArgs = 0;
+    memset(&com->attr, 0, sizeof(com->attr));
+    com->cwdFD = -1;
+    com->outFD = -1;
+    com->inFD = -1;
+    com->auxCount = 0;
+}
+
+// close the here-document and process substitution pipes and the >&N copy com was given
+void closeCommandFDs(struct command* com) {
+    if (com->inFD != -1)
+        close(com->inFD);
+    if (com->outFD != -1)
+        close(com->outFD);
+    for (int i = 0; i < com->auxCount; i++) {
+        close(com->auxFDs[i]);
+    }
+    com->inFD = -1;
+    com->outFD = -1;
+    com->auxCount = 0;
+}
+
+// apply foreground-only mode, the prefixes before the command and the background policy.
+// Returns 1 if a prefix was invalid
+int prepareCommand(struct command* com) {
+    // if in foreground mode ignore requested '&'
+    if (foregroundOnly == 1) {
+        com->background = 0;
+    }
+
+    // prefixes adjusting how the command that follows is run, in any order
+    while (com->args[0] != NULL) {
+        int prefixError;
+        if (strcmp(com->args[0], "limit") == 0)
+            prefixError = parseLimitPrefix(com);
+        else if ((strcmp(com->args[0], "affinity") == 0 || strcmp(com->args[0], "nice") == 0 || strcmp(com->args[0], "ionice") == 0) && com->args[1] != NULL)
+            prefixError = parseSchedPrefix(com); // a bare nice or ionice runs the utility itself
+        else
+            break;
+        if (prefixError == 1)
+            return 1;
+    }
+    if (com->background == 1) {
+        applyBgPolicy(com);
+    }
+    return 0;
+}
+
+// run builtin b for com in a forked subshell with stdout on outFD, so exit and cd only
+// affect the subshell; shellFD, the shell's end of its pipe, is closed in it.
+// Returns 0 with the process in *sp, or 1 if it was not started
+int spawnSubshell(struct command* com, struct builtin* b, int outFD, int shellFD, struct spawned* sp) {
+    fflush(stdout);
+    sp->pid = forkWithPidfd(&sp->pidfd, -1);
+    sp->cgroupFD = -1;
+    sp->cgroupPath = NULL;
+    if (sp->pid == 0) {
+        subshell = 1;
+        backgroundSubshell = com->background;
+        childSignals(com->background);
+        close(shellFD);
+        if (outFD != -1)
+            dup2(outFD, 1);
+        if (com->inFD != -1)
+            dup2(com->inFD, 0);
+        int result = b->run(com);
+        fflush(stdout);
+        _exit(result);
+    }
+    if (sp->pid == -1) {
+        perror("fork()");
+        return 1;
+    }
+    return 0;
+}
+
+// start data builtin b for com as a background job in a subshell, its stdin and stdout on
+// /dev/null unless redirected, as for a background child. Returns 1 if it was not started
+int spawnBuiltinJob(struct command* com, struct builtin* b, struct spawned* sp) {
+    if (strcmp(com->input, "") == 0 && com->inFD == -1)
+        strcpy(com->input, "/dev/null");
+    if (strcmp(com->output, "") == 0 && com->outFD == -1)
+        strcpy(com->output, "/dev/null");
+    return spawnSubshell(com, b, -1, -1, sp);
+}
+
+// run the command line text and return its standard output with trailing newlines removed,
+// its length in *len; the caller frees it. Builtins that only report state run in-process
+// with stdout pointed at a memfd, other builtins in a forked subshell and external commands
+// in the foreground with stdout on a pipe
+char* captureCommand(char* text, size_t* len) {
+    struct buffer out = { NULL, 0, 0 };
+    struct arena arena = { NULL, -1 };  // own arena, the caller's is mid expansion
+    struct command com;
+    commandInit(&com);
+    char* line = strdup(text);
+    if (parseCommand(line, &com, &arena) == 0 && prepareCommand(&com) == 0) {
+        com.background = 0;    // a substitution always runs to completion
+        struct builtin* b = findBuiltin(&com);
+        if (b != NULL && b->pure) {
+            int memFD = memfd_create("substitution", MFD_CLOEXEC);
+            int savedFD = dup(1);
+            if (memFD == -1 || savedFD == -1) {
+                perror("memfd_create");
+            }
+            else {
+                fflush(stdout);
+                dup2(memFD, 1);
+                b->run(&com);
+                fflush(stdout);
+                dup2(savedFD, 1);
+                lseek(memFD, 0, SEEK_SET);
+                bufferReadFD(&out, memFD);
+            }
+            if (memFD != -1)
+                close(memFD);
+            if (savedFD != -1)
+                close(savedFD);
+        }
+        else {
+            int pipeFD[2];
+            struct spawned sp;
+            int started = 0;
+            if (pipe2(pipeFD, O_CLOEXEC) == -1) {
+                perror("pipe");
+                pipeFD[0] = -1;
+            }
+            else {
+                // fewer, larger reads for big outputs
+                fcntl(pipeFD[0], F_SETPIPE_SZ, 1 << 20);
+                if (b != NULL) {
+                    started = spawnSubshell(&com, b, pipeFD[1], pipeFD[0], &sp) == 0;
+                }
+                else if (com.outFD != -1) {
+                    started = spawnCommand(&com, &sp) == 0;  // >&N goes where it says
+                }
+                else {
+                    com.outFD = pipeFD[1];
+                    started = spawnCommand(&com, &sp) == 0;
+                    com.outFD = -1;     // closed below, not with the command
+                }
+                close(pipeFD[1]);
+            }
+            if (pipeFD[0] != -1) {
+                if (bufferReadFD(&out, pipeFD[0]) == -1)
+                    perror("read");
+                close(pipeFD[0]);
+            }
+            if (started)
+                waitForeground(&com, &sp);
+        }
+    }
+    closeCommandFDs(&com);
+    free(line);
+    arenaFree(&arena);
+    while (out.len > 0 && out.data[out.len - 1] == '\n')
+        out.len--;
+    *len = out.len;
+    return out.data;
+}
+
+// start the command line text as a process substitution for the command being parsed: with
+// output set its stdout, otherwise its stdin, is a pipe whose other end is returned. The
+// process goes in the job table, to be reaped quietly once it is done. Returns -1 if it was
+// not started
+int startProcSubst(char* text, int output, pid_t* pid) {
+    int pipeFD[2];
+    if (pipe2(pipeFD, O_CLOEXEC) == -1) {
+        perror("pipe");
+        return -1;
+    }
+    int childEnd = output ? pipeFD[0] : pipeFD[1];
+    int shellEnd = output ? pipeFD[1] : pipeFD[0];
+    struct arena arena = { NULL, -1 };  // own arena, the caller's is mid expansion
+    struct command com;
+    commandInit(&com);
+    char* line = strdup(text);
+    int started = 0;
+    if (parseCommand(line, &com, &arena) == 0 && prepareCommand(&com) == 0) {
+        com.background = 0;    // stdin stays the terminal's, like a foreground command
+        struct builtin* b = findBuiltin(&com);
+        struct spawned sp;
+        if (output) {
+            if (com.inFD != -1)
+                close(com.inFD);
+            com.inFD = childEnd;
+        }
+        if (b != NULL) {
+            started = spawnSubshell(&com, b, output ? -1 : childEnd, shellEnd, &sp) == 0;
+        }
+        else {
+            if (!output && com.outFD != -1)
+                close(com.outFD);
+            com.outFD = output ? com.outFD : childEnd;
+            started = spawnCommand(&com, &sp) == 0;
+        }
+        if (output)
+            com.inFD = -1;
+        else
+            com.outFD = -1;
+        int ind = started ? addJob(&com, &sp, -1) : -1;
+        if (started && ind == -1) {
+            printf("smallsh: job table full\n");
+            fflush(stdout);
+            kill(sp.pid, SIGKILL);
+            waitForeground(&com, &sp);
+            started = 0;
+        }
+        else if (started) {
+            *pid = sp.pid;
+            snprintf(bgJobs[ind].command, sizeof(bgJobs[ind].command), "%s(%s)", output ? ">" : "<", text);
+        }
+    }
+    closeCommandFDs(&com);
+    close(childEnd);
+    free(line);
+    arenaFree(&arena);
+    if (!started) {
+        close(shellEnd);
+        return -1;
+    }
+    return shellEnd;
+}
+
+// coproc NAME command [args...]: start command as a background job with its stdin and
+// stdout on pipes to the shell, whose ends are NAME_1 and NAME_0 for >& and <& redirections
+// and its pid NAME_PID. They are removed when the job is reaped
+int coprocBuiltin(struct command* com) {
+    size_t n = com->numArgs >= 3 ? nameLength(com->args[1]) : 0;
+    if (n == 0 || com->args[1][n] != 0 || n > 255) {
+        printf("usage: coproc NAME command [args...]\n");
+        fflush(stdout);
+        return 1;
+    }
+    for (int ind = 0; ind < (sizeof(bgJobs) / sizeof(struct job)); ind++) {
+        if (bgJobs[ind].pid != 0 && bgJobs[ind].coprocName != NULL && strcmp(bgJobs[ind].coprocName, com->args[1]) == 0) {
+            printf("coproc: %s: still running as %d\n", com->args[1], bgJobs[ind].pid);
+            fflush(stdout);
+            return 1;
+        }
+    }
+    int toChild[2];
+    int fromChild[2];
+    if (pipe2(toChild, O_CLOEXEC) == -1) {
+        perror("pipe");
+        return 1;
+    }
+    if (pipe2(fromChild, O_CLOEXEC) == -1) {
+        perror("pipe");
+        close(toChild[0]);
+        close(toChild[1]);
+        return 1;
+    }
+    // the command after the name, with its own prefixes and the background policy
+    struct command child = *com;
+    child.args = com->args + 2;
+    child.numArgs = com->numArgs - 2;
+    child.background = 1;
+    child.inFD = toChild[0];
+    child.outFD = fromChild[1];
+    child.auxCount = 0;
+    int started = 0;
+    struct spawned sp;
+    if (prepareCommand(&child) == 0) {
+        child.background = 1;   // even in foreground-only mode, the shell does not wait for it
+        struct builtin* b = findBuiltin(&child);
+        if (b != NULL)
+            started = spawnSubshell(&child, b, fromChild[1], toChild[1], &sp) == 0;
+        else
+            started = spawnCommand(&child, &sp) == 0;
+    }
+    close(toChild[0]);
+    close(fromChild[1]);
+    int ind = started ? addJob(com, &sp, 0) : -1;
+    if (started && ind == -1) {
+        printf("smallsh: job table full\n");
+        fflush(stdout);
+        kill(sp.pid, SIGKILL);
+        waitForeground(&child, &sp);
+    }
+    if (ind == -1) {
+        close(toChild[1]);
+        close(fromChild[0]);
+        return 1;
+    }
+    bgJobs[ind].rlimitMask = child.attr.rlimitMask;
+    bgJobs[ind].coprocName = strdup(com->args[1]);
+    bgJobs[ind].coprocFDs[0] = fromChild[0];
+    bgJobs[ind].coprocFDs[1] = toChild[1];
+    const char* suffixes[] = { "_0", "_1", "_PID" };
+    int values[] = { fromChild[0], toChild[1], sp.pid };
+    char var[300];
+    char value[32];
+    for (int i = 0; i < 3; i++) {
+        snprintf(var, sizeof(var), "%s%s", com->args[1], suffixes[i]);
+        snprintf(value, sizeof(value), "%d", values[i]);
+        varSet(var, value, 0);
+    }
+    return 0;
+}
+
+// bytes of ARG_MAX left for the arguments added to cmd[0..cmdCount), after the environment
+long argSpace(char** cmd, int cmdCount) {
+    long space = sysconf(_SC_ARG_MAX) - 4096;
+    buildEnvp();
+    space -= envCacheBytes;
+    for (int i = 0; i < cmdCount; i++) {
+        space -= strlen(cmd[i]) + 1 + sizeof(char*);
+    }
+    return space;
+}
+
+// a command like com running cmd[0..cmdCount) on as many of the count NUL terminated items at
+// *items as fit in limit bytes and, unless 0, maxItems, at least one; *items and *count
+// advance past them. It runs in the foreground with stdin and stdout on inFD and outFD.
+// Free its args, which point into the items
+struct command batchCommand(struct command* com, char** cmd, int cmdCount, long limit, size_t maxItems, char** items, size_t* count, int inFD, int outFD) {
+    size_t taken = 0;
+    char* p = *items;
+    for (long used = 0; taken < *count && (maxItems == 0 || taken < maxItems); taken++) {
+        size_t n = strlen(p) + 1;
+        used += n + sizeof(char*);
+        if (taken > 0 && used > limit)
+            break;
+        p += n;
+    }
+    char** args = malloc(sizeof(char*) * (cmdCount + taken + 1));
+    memcpy(args, cmd, sizeof(char*) * cmdCount);
+    p = *items;
+    for (size_t i = 0; i < taken; i++) {
+        args[cmdCount + i] = p;
+        p += strlen(p) + 1;
+    }
+    args[cmdCount + taken] = NULL;
+    *items = p;
+    *count -= taken;
+    struct command child = *com;
+    child.args = args;
+    child.numArgs = cmdCount + taken;
+    child.background = 0;
+    strcpy(child.input, "");
+    strcpy(child.output, "");
+    child.inFD = inFD != 0 ? inFD : -1;
+    child.outFD = outFD != 1 ? outFD : -1;
+    child.auxCount = 0;
+    return child;
+}
+
+// start child, a batch of xargs or walk -exec: an external command as any other, a builtin
+// (b) in a forked subshell, so cd, exit and the like change the subshell and not the shell
+int spawnBatch(struct command* child, struct builtin* b, struct spawned* sp) {
+    if (b == NULL)
+        return spawnCommand(child, sp);
+    return spawnSubshell(child, b, child->outFD, -1, sp);
+}
+
+// a directory waiting to be read by walk
+struct walkDir {
+    char* path;
+    int depth;
+};
+
+// directories queued by one walk thread. Its owner pushes and pops at the back, going depth
+// first, and idle threads steal from the front, taking the oldest and usually largest subtrees
+struct walkDeque {
+    pthread_mutex_t lock;
+    struct walkDir* items;
+    size_t head;
+    size_t tail;
+    size_t cap;
+};
+
+// tests a path must pass to be printed or passed on, all of them
+struct walkTests {
+    const char* name;   // glob for the last component, NULL for any
+    int type;           // DT_ type, DT_UNKNOWN for any
+    int sizeCmp;        // -1, 0 or 1 for -size -N, N or +N, 2 for no size test
+    uint64_t size;      // in units of sizeUnit bytes, sizes rounded up
+    uint64_t sizeUnit;
+    int mtimeCmp;       // likewise for -mtime, in whole days
+    int64_t mtimeDays;
+    int minDepth;
+    int maxDepth;
+};
+
+// state shared by the threads of one walk and the shell thread taking its results
+struct walkPool {
+    struct walkTests tests;
+    time_t now;
+    int threads;
+    struct walkDeque deques[64];
+    size_t queued;      // directories in the deques
+    size_t active;      // directories queued or being read; the walk is over at 0
+    int sleepers;       // threads waiting for work on wake
+    int stop;           // interrupted, or nobody takes the results any more
+    int errors;
+    pthread_mutex_t idleLock;
+    pthread_cond_t wake;
+    // held for reading by every thread except while it waits, and for writing by the shell
+    // around a fork, so no thread is inside malloc or stdio when the child is cloned
+    pthread_rwlock_t spawnLock;
+    pthread_mutex_t resultLock;
+    pthread_cond_t resultReady;
+    pthread_cond_t resultRoom;
+    struct buffer results;  // NUL terminated paths found and not taken yet
+    int running;            // threads that have not finished
+};
+
+// one walk thread
+struct walkWorker {
+    pthread_t thread;
+    struct walkPool* pool;
+    int index;
+    struct buffer out;      // paths found, handed over 64KB at a time
+    char* records;          // getdents64 buffer
+};
+
+// queue dir on deque d
+void walkPush(struct walkPool* pool, struct walkDeque* d, struct walkDir dir) {
+    __atomic_add_fetch(&pool->active, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&d->lock);
+    if (d->tail == d->cap) {
+        // slide the items down over the stolen ones, growing only when that is not enough
+        memmove(d->items, d->items + d->head, sizeof(struct walkDir) * (d->tail - d->head));
+        d->tail -= d->head;
+        d->head = 0;
+        if (d->tail * 2 >= d->cap) {
+            d->cap = d->cap > 0 ? d->cap * 2 : 256;
+            d->items = realloc(d->items, sizeof(struct walkDir) * d->cap);
+        }
+    }
+    d->items[d->tail++] = dir;
+    pthread_mutex_unlock(&d->lock);
+    __atomic_add_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+    // a sleeper checks queued after announcing itself, so one of the two sees the other
+    if (__atomic_load_n(&pool->sleepers, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&pool->idleLock);
+        pthread_cond_signal(&pool->wake);
+        pthread_mutex_unlock(&pool->idleLock);
+    }
+}
+
+// take a directory for thread index: the newest of its own, else the oldest of another's.
+// Returns 0 if none was found
+int walkTake(struct walkPool* pool, int index, struct walkDir* dir) {
+    for (int k = 0; k < pool->threads; k++) {
+        struct walkDeque* d = &pool->deques[(index + k) % pool->threads];
+        pthread_mutex_lock(&d->lock);
+        int found = d->head < d->tail;
+        if (found)
+            *dir = k == 0 ? d->items[--d->tail] : d->items[d->head++];
+        pthread_mutex_unlock(&d->lock);
+        if (found) {
+            __atomic_sub_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// hand the paths w found over to the shell thread, waiting while it is behind by 16MB
+void walkFlush(struct walkWorker* w) {
+    struct walkPool* pool = w->pool;
+    if (w->out.len == 0)
+        return;
+    pthread_mutex_lock(&pool->resultLock);
+    while (pool->results.len >= (16 << 20) && !pool->stop) {
+        pthread_mutex_unlock(&pool->resultLock);
+        pthread_rwlock_unlock(&pool->spawnLock);
+        pthread_mutex_lock(&pool->resultLock);
+        while (pool->results.len >= (16 << 20) && !pool->stop)
+            pthread_cond_wait(&pool->resultRoom, &pool->resultLock);
+        // the lock order is spawnLock then resultLock
+        pthread_mutex_unlock(&pool->resultLock);
+        pthread_rwlock_rdlock(&pool->spawnLock);
+        pthread_mutex_lock(&pool->resultLock);
+    }
+    bufferReserve(&pool->results, w->out.len);
+    memcpy(pool->results.data + pool->results.len, w->out.data, w->out.len);
+    pool->results.len += w->out.len;
+    pthread_cond_signal(&pool->resultReady);
+    pthread_mutex_unlock(&pool->resultLock);
+    w->out.len = 0;
+}
+
+// true if the entry name, of DT_ type and with st filled in for the size and time tests,
+// passes the tests at depth
+int walkMatch(struct walkPool* pool, const char* name, int type, const struct stat* st, int depth) {
+    const struct walkTests* t = &pool->tests;
+    if (depth < t->minDepth || (t->type != DT_UNKNOWN && type != t->type))
+        return 0;
+    if (t->name != NULL && !globMatch(t->name, name))
+        return 0;
+    if (t->sizeCmp != 2) {
+        uint64_t units = ((uint64_t)st->st_size + t->sizeUnit - 1) / t->sizeUnit;
+        if (((units > t->size) - (units < t->size)) != t->sizeCmp)
+            return 0;
+    }
+    if (t->mtimeCmp != 2) {
+        int64_t age = pool->now - st->st_mtime;
+        int64_t days = age >= 0 ? age / 86400 : -((-age + 86399) / 86400);
+        if (((days > t->mtimeDays) - (days < t->mtimeDays)) != t->mtimeCmp)
+            return 0;
+    }
+    return 1;
+}
+
+// report an error walk met at path, to be reflected in its status
+void walkError(struct walkPool* pool, const char* path, int error) {
+    fprintf(stderr, "walk: %s: %s\n", path, strerror(error));
+    __atomic_store_n(&pool->errors, 1, __ATOMIC_RELAXED);
+}
+
+// read dir: test each entry, typed by getdents64 where the tests need no more, and queue
+// the subdirectories. Symbolic links are not followed
+void walkRead(struct walkWorker* w, struct walkDir* dir) {
+    struct walkPool* pool = w->pool;
+    int fd = openat(AT_FDCWD, dir->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd == -1) {
+        walkError(pool, dir->path, errno);
+        return;
+    }
+    char path[PATH_MAX];
+    size_t dirLen = strlen(dir->path);
+    memcpy(path, dir->path, dirLen);
+    if (dirLen == 0 || path[dirLen - 1] != '/')
+        path[dirLen++] = '/';
+    int needStat = pool->tests.sizeCmp != 2 || pool->tests.mtimeCmp != 2;
+    int depth = dir->depth + 1;
+    long n;
+    while (!__atomic_load_n(&pool->stop, __ATOMIC_RELAXED) && (n = syscall(SYS_getdents64, fd, w->records, 65536)) > 0) {
+        for (long off = 0; off < n; ) {
+            struct dirent64* d = (struct dirent64*)(w->records + off);
+            off += d->d_reclen;
+            const char* name = d->d_name;
+            if (name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0)))
+                continue;
+            size_t nameLen = strlen(name);
+            if (dirLen + nameLen >= sizeof(path)) {
+                walkError(pool, name, ENAMETOOLONG);
+                continue;
+            }
+            memcpy(path + dirLen, name, nameLen + 1);
+            int type = d->d_type;
+            struct stat st;
+            if (type == DT_UNKNOWN || (needStat && depth >= pool->tests.minDepth)) {
+                if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+                    walkError(pool, path, errno);
+                    continue;
+                }
+                type = IFTODT(st.st_mode);
+            }
+            if (walkMatch(pool, name, type, &st, depth)) {
+                bufferReserve(&w->out, dirLen + nameLen + 1);
+                memcpy(w->out.data + w->out.len, path, dirLen + nameLen + 1);
+                w->out.len += dirLen + nameLen + 1;
+                if (w->out.len >= 65536)
+                    walkFlush(w);
+            }
+            if (type == DT_DIR && depth < pool->tests.maxDepth) {
+                struct walkDir sub = { strdup(path), depth };
+                walkPush(pool, &pool->deques[w->index], sub);
+            }
+        }
+    }
+    if (n == -1)
+        walkError(pool, dir->path, errno);
+    close(fd);
+}
+
+void* walkThread(void* arg) {
+    struct walkWorker* w = arg;
+    struct walkPool* pool = w->pool;
+    pthread_rwlock_rdlock(&pool->spawnLock);
+    while (1) {
+        struct walkDir dir;
+        if (walkTake(pool, w->index, &dir)) {
+            if (!__atomic_load_n(&pool->stop, __ATOMIC_RELAXED))
+                walkRead(w, &dir);
+            free(dir.path);
+            if (__atomic_sub_fetch(&pool->active, 1, __ATOMIC_SEQ_CST) == 0) {
+                pthread_mutex_lock(&pool->idleLock);
+                pthread_cond_broadcast(&pool->wake);
+                pthread_mutex_unlock(&pool->idleLock);
+            }
+            continue;
+        }
+        // nothing to take: hand over what was found and sleep until there is
+        walkFlush(w);
+        pthread_rwlock_unlock(&pool->spawnLock);
+        pthread_mutex_lock(&pool->idleLock);
+        __atomic_add_fetch(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST) == 0 && __atomic_load_n(&pool->active, __ATOMIC_SEQ_CST) > 0)
+            pthread_cond_wait(&pool->wake, &pool->idleLock);
+        __atomic_sub_fetch(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&pool->idleLock);
+        pthread_rwlock_rdlock(&pool->spawnLock);
+        if (__atomic_load_n(&pool->active, __ATOMIC_SEQ_CST) == 0)
+            break;
+    }
+    pthread_rwlock_unlock(&pool->spawnLock);
+    pthread_mutex_lock(&pool->resultLock);
+    if (--pool->running == 0)
+        pthread_cond_signal(&pool->resultReady);
+    pthread_mutex_unlock(&pool->resultLock);
+    return NULL;
+}
+
+// run the -exec command with as many of the count NUL terminated paths at *paths as fit in
+// limit bytes, advancing *paths and *count past them. Builtins run in the shell, other
+// commands in the foreground. Returns the command's exit code
+int walkExec(struct walkPool* pool, struct command* com, char** cmd, int cmdCount, long limit, char** paths, size_t* count, int inFD, int outFD) {
+    struct command child = batchCommand(com, cmd, cmdCount, limit, 0, paths, count, inFD, outFD);
+    struct builtin* b = findBuiltin(&child);
+    if (b != NULL && dataBuiltin(b)) {
+        b->run(&child);
+    }
+    else {
+        struct spawned sp;
+        pthread_rwlock_wrlock(&pool->spawnLock);
+        int failed = spawnBatch(&child, b, &sp);
+        pthread_rwlock_unlock(&pool->spawnLock);
+        if (failed)
+            lfStatus = 1 << 8;
+        else
+            waitForeground(&child, &sp);
+    }
+    free(child.args);
+    return lastExitCode();
+}
+
+// parse the number at text for -size, -mtime or a depth into *value with its sign into *cmp
+// (-1, 0 or 1 for -N, N and +N) when cmp is given. Returns the characters after the digits,
+// NULL if there are none
+const char* walkNumber(const char* text, int* cmp, uint64_t* value) {
+    if (cmp != NULL) {
+        *cmp = *text == '+' ? 1 : *text == '-' ? -1 : 0;
+        text += *cmp != 0;
+    }
+    if (!isdigit((unsigned char)*text))
+        return NULL;
+    char* end;
+    *value = strtoull(text, &end, 10);
+    return end;
+}
+
+// walk [DIR...] [-name PATTERN] [-type f|d|l|p|s|b|c] [-size [+-]N[bckMG]] [-mtime [+-]N]
+//      [-mindepth N] [-maxdepth N] [-j THREADS] [-print0] [-exec CMD [ARG...] {} +]
+// print the paths under the directories, . by default and themselves included, that pass all
+// of the tests, which read like find's. A pool of threads, one per CPU unless -j says, reads
+// the directories with getdents64, each working depth first on its own deque and stealing
+// from the others when it runs dry, so the order is not find's. With -exec the paths are
+// handed to CMD in batches as large as ARG_MAX allows while the walk goes on
+int walkBuiltin(struct command* com) {
+    struct walkPool* pool = calloc(1, sizeof(struct walkPool));
+    struct walkTests tests = { NULL, DT_UNKNOWN, 2, 0, 512, 2, 0, 0, INT_MAX };
+    char separator = '\n';
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint64_t threads = cpus < 1 ? 1 : cpus;
+    char** cmd = NULL;
+    int cmdCount = 0;
+    int roots = 1;
+    while (roots < com->numArgs && (com->args[roots][0] != '-' || com->args[roots][1] == 0))
+        roots++;
+    int usage = 0;
+    for (int i = roots; i < com->numArgs && !usage; i++) {
+        const char* opt = com->args[i];
+        const char* value = com->args[i + 1];
+        const char* end = NULL;
+        uint64_t n = 0;
+        if (strcmp(opt, "-print0") == 0) {
+            separator = 0;
+            continue;
+        }
+        if (strcmp(opt, "-print") == 0)
+            continue;
+        if (strcmp(opt, "-exec") == 0) {
+            cmd = com->args + i + 1;
+            for (cmdCount = 0; i + 2 + cmdCount < com->numArgs; cmdCount++) {
+                if (strcmp(cmd[cmdCount], "{}") == 0 && strcmp(cmd[cmdCount + 1], "+") == 0)
+                    break;
+            }
+            usage = cmdCount == 0 || i + 2 + cmdCount >= com->numArgs;
+            i += cmdCount + 2;
+            continue;
+        }
+        usage = value == NULL;
+        i++;
+        if (usage)
+            break;
+        if (strcmp(opt, "-name") == 0) {
+            tests.name = value;
+        }
+        else if (strcmp(opt, "-type") == 0) {
+            const char* types = "fdlpsbc";
+            const int codes[] = { DT_REG, DT_DIR, DT_LNK, DT_FIFO, DT_SOCK, DT_BLK, DT_CHR };
+            usage = value[0] == 0 || value[1] != 0 || strchr(types, value[0]) == NULL;
+            tests.type = usage ? DT_UNKNOWN : codes[strchr(types, value[0]) - types];
+        }
+        else if (strcmp(opt, "-size") == 0) {
+            end = walkNumber(value, &tests.sizeCmp, &tests.size);
+            const char* units = "bckMG";
+            const uint64_t bytes[] = { 512, 1, 1024, 1 << 20, 1 << 30 };
+            usage = end == NULL || (*end != 0 && (strchr(units, *end) == NULL || end[1] != 0));
+            tests.sizeUnit = usage || *end == 0 ? 512 : bytes[strchr(units, *end) - units];
+        }
+        else if (strcmp(opt, "-mtime") == 0) {
+            end = walkNumber(value, &tests.mtimeCmp, &n);
+            tests.mtimeDays = n;
+            usage = end == NULL || *end != 0;
+        }
+        else if (strcmp(opt, "-mindepth") == 0 || strcmp(opt, "-maxdepth") == 0 || strcmp(opt, "-j") == 0) {
+            end = walkNumber(value, NULL, &n);
+            usage = end == NULL || *end != 0 || n > INT_MAX;
+            if (opt[2] == 'i')
+                tests.minDepth = n;
+            else if (opt[2] == 'a')
+                tests.maxDepth = n;
+            else
+                threads = n;
+        }
+        else {
+            usage = 1;
+        }
+    }
+    if (usage) {
+        printf("usage: walk [DIR...] [-name PATTERN] [-type f|d|l|p|s|b|c] [-size [+-]N[bckMG]] [-mtime [+-]N]\n"
+            "            [-mindepth N] [-maxdepth N] [-j THREADS] [-print0] [-exec CMD [ARG...] {} +]\n");
+        fflush(stdout);
+        free(pool);
+        lfStatus = 2 << 8;
+        return 2;
+    }
+    struct dataIO io;
+    if (dataStart(com, &io, 1, 1)) {
+        free(pool);
+        return 1;
+    }
+
+    pool->tests = tests;
+    pool->now = time(NULL);
+    pool->threads = threads < 1 ? 1 : threads > 64 ? 64 : threads;
+    pthread_mutex_init(&pool->idleLock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_rwlockattr_t writerFirst;   // a fork waits for no more than the directories being read
+    pthread_rwlockattr_init(&writerFirst);
+    pthread_rwlockattr_setkind_np(&writerFirst, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&pool->spawnLock, &writerFirst);
+    pthread_rwlockattr_destroy(&writerFirst);
+    pthread_mutex_init(&pool->resultLock, NULL);
+    pthread_cond_init(&pool->resultReady, NULL);
+    pthread_cond_init(&pool->resultRoom, NULL);
+    for (int i = 0; i < pool->threads; i++) {
+        pthread_mutex_init(&pool->deques[i].lock, NULL);
+    }
+
+    // the starting points are tested and queued here, so their errors come first
+    struct walkWorker* workers = calloc(pool->threads, sizeof(struct walkWorker));
+    char* dot[] = { "." };
+    char** rootNames = roots > 1 ? com->args + 1 : dot;
+    for (int i = 0; i < (roots > 1 ? roots - 1 : 1); i++) {
+        struct stat st;
+        if (lstat(rootNames[i], &st) == -1) {
+            walkError(pool, rootNames[i], errno);
+            continue;
+        }
+        const char* base = strrchr(rootNames[i], '/');
+        base = base != NULL && base[1] != 0 ? base + 1 : rootNames[i];
+        if (walkMatch(pool, base, IFTODT(st.st_mode), &st, 0)) {
+            bufferReserve(&pool->results, strlen(rootNames[i]) + 1);
+            memcpy(pool->results.data + pool->results.len, rootNames[i], strlen(rootNames[i]) + 1);
+            pool->results.len += strlen(rootNames[i]) + 1;
+        }
+        if (S_ISDIR(st.st_mode) && tests.maxDepth > 0) {
+            struct walkDir root = { strdup(rootNames[i]), 0 };
+            walkPush(pool, &pool->deques[i % pool->threads], root);
+        }
+    }
+    // the threads leave SIGINT to the shell thread
+    sigset_t all, before;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &before);
+    pool->running = pool->threads;     // before any of them can finish
+    int error = 0;
+    for (int i = 0; i < pool->threads; i++) {
+        workers[i].pool = pool;
+        workers[i].index = i;
+        workers[i].records = malloc(65536);
+        if (error == 0 && (error = pthread_create(&workers[i].thread, NULL, walkThread, &workers[i])) == 0)
+            continue;
+        // the walk goes on with the threads that started, which drain the other deques
+        workers[i].thread = 0;
+        pthread_mutex_lock(&pool->resultLock);
+        pool->running--;
+        pthread_mutex_unlock(&pool->resultLock);
+    }
+    pthread_sigmask(SIG_SETMASK, &before, NULL);
+    if (workers[0].thread == 0) {
+        fprintf(stderr, "walk: pthread_create: %s\n", strerror(error));
+        pool->errors = 1;
+    }
+
+    // take the paths as they come, printing them or gathering them for the command
+    struct buffer taken = { NULL, 0, 0 };
+    struct buffer pending = { NULL, 0, 0 };     // paths for the next -exec batches
+    size_t pendingCount = 0;
+    long limit = cmd != NULL ? argSpace(cmd, cmdCount) : 0;
+    int result = 0;
+    int childInterrupted = 0;
+    while (1) {
+        pthread_mutex_lock(&pool->resultLock);
+        while (pool->results.len == 0 && pool->running > 0 && !copyInterrupted) {
+            // a signal need not end the wait, so check for one now and then
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_nsec += 100000000;
+            until.tv_sec += until.tv_nsec / 1000000000;
+            until.tv_nsec %= 1000000000;
+            pthread_cond_timedwait(&pool->resultReady, &pool->resultLock, &until);
+        }
+        struct buffer swap = pool->results;
+        pool->results = taken;
+        taken = swap;
+        int finished = pool->running == 0;
+        pthread_cond_broadcast(&pool->resultRoom);
+        pthread_mutex_unlock(&pool->resultLock);
+        if (copyInterrupted || pool->stop)
+            break;
+        if (cmd == NULL && separator != 0) {
+            for (char* p = taken.data; (p = memchr(p, 0, taken.data + taken.len - p)) != NULL; p++)
+                *p = separator;
+        }
+        if (cmd == NULL && writeAll(io.out, taken.data, taken.len) == -1) {
+            if (errno != EPIPE) {
+                perror("walk: write");
+                result = 1;
+            }
+            break;
+        }
+        if (cmd != NULL) {
+            bufferReserve(&pending, taken.len);
+            memcpy(pending.data + pending.len, taken.data, taken.len);
+            pending.len += taken.len;
+            for (char* p = taken.data; (p = memchr(p, 0, taken.data + taken.len - p)) != NULL; p++)
+                pendingCount++;
+            // run full batches now, the last one once the walk is over
+            char* next = pending.data;
+            while (pendingCount > 0 && !copyInterrupted &&
+                (finished || (long)(pending.data + pending.len - next + pendingCount * sizeof(char*)) > limit)) {
+                result |= walkExec(pool, com, cmd, cmdCount, limit, &next, &pendingCount, io.in, io.out) != 0;
+                childInterrupted |= lfStatus == 2;
+            }
+            memmove(pending.data, next, pending.data + pending.len - next);
+            pending.len -= next - pending.data;
+        }
+        taken.len = 0;
+        if (finished)
+            break;
+    }
+    // stop and collect the threads, freeing whatever they left queued
+    __atomic_store_n(&pool->stop, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&pool->resultLock);
+    pthread_cond_broadcast(&pool->resultRoom);
+    pthread_mutex_unlock(&pool->resultLock);
+    for (int i = 0; i < pool->threads; i++) {
+        if (workers[i].thread != 0)
+            pthread_join(workers[i].thread, NULL);
+        for (size_t j = pool->deques[i].head; j < pool->deques[i].tail; j++) {
+            free(pool->deques[i].items[j].path);
+        }
+        free(pool->deques[i].items);
+        free(workers[i].out.data);
+        free(workers[i].records);
+        pthread_mutex_destroy(&pool->deques[i].lock);
+    }
+    result |= pool->errors;
+    free(workers);
+    free(taken.data);
+    free(pending.data);
+    free(pool->results.data);
+    pthread_rwlock_destroy(&pool->spawnLock);
+    free(pool);
+    io.reported = childInterrupted;
+    return dataFinish(&io, result);
+}
+
+// the status xargs ends with given that of a command it ran, folded into the worst so far as
+// in xargs: 123 for a failure, 124 for an exit code of 255, 125 for a signal
+int xargsStatus(int worst, int status) {
+    int code = WIFSIGNALED(status) ? 125 : WEXITSTATUS(status) == 255 ? 124 : WEXITSTATUS(status) != 0 ? 123 : 0;
+    return code > worst ? code : worst;
+}
+
+// wait for at least one of the jobs running[0..*count) that xargs started, taking the ones
+// that finished out of the job table and of running. Returns the worst status as xargsStatus
+int xargsWait(int* running, int* count, int worst) {
+    struct pollfd pfd[1000];
+    int polled = 1;
+    for (int i = 0; i < *count; i++) {
+        struct pollfd p = { bgJobs[running[i]].pidfd, POLLIN, 0 };
+        pfd[i] = p;
+        polled &= p.fd != -1;
+    }
+    // a pidfd becomes readable when its process exits; without them the oldest is waited for
+    if (polled && poll(pfd, *count, -1) <= 0)
+        return worst;
+    int kept = 0;
+    for (int i = 0; i < *count; i++) {
+        int ind = running[i];
+        int status;
+        if (polled ? pfd[i].revents == 0 : i > 0) {
+            running[kept++] = ind;
+            continue;
+        }
+        waitChild(bgJobs[ind].pid, bgJobs[ind].pidfd, &status, 0);
+        removeJob(ind);
+        worst = xargsStatus(worst, status);
+        lfStatus = status;
+    }
+    *count = kept;
+    return worst;
+}
+
+// xargs [-0] [-r] [-n MAX] [-P PROCS] [COMMAND [ARG...]]: run COMMAND, echo by default, with
+// the items read from stdin as further arguments, one per line or NUL terminated with -0. The
+// items are packed into as few commands as ARG_MAX, less the environment, and -n allow, each
+// started as soon as it is full; with -P up to PROCS of them run at once as jobs in the job
+// table. Options other than these run the utility instead
+int xargsBuiltin(struct command* com) {
+    struct xargsOptions opts;
+    xargsParse(com, &opts);
+    char* echo[] = { "echo" };
+    char** cmd = opts.command < com->numArgs ? com->args + opts.command : echo;
+    int cmdCount = opts.command < com->numArgs ? com->numArgs - opts.command : 1;
+    struct dataIO io;
+    if (dataStart(com, &io, 1, 1))
+        return 1;
+    long limit = argSpace(cmd, cmdCount);
+    int procs = opts.procs > 0 && opts.procs < 1000 ? opts.procs : 1000;
+    int* running = malloc(sizeof(int) * procs);
+    int runningCount = 0;
+    char delimiter = opts.nul ? 0 : '\n';
+    struct buffer items = { NULL, 0, 0 };  // NUL terminated items, then the start of the next
+    size_t itemCount = 0;
+    size_t itemStart = 0;   // where the item being read began
+    int batches = 0;
+    int worst = 0;
+    int readError = 0;
+    while (!copyInterrupted) {
+        bufferReserve(&items, 65536);
+        ssize_t n = read(io.in, items.data + items.len, items.cap - items.len);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1) {
+            perror("xargs: read");
+            readError = 1;
+            n = 0;
+        }
+        // end the items in place, dropping empty lines
+        size_t out = items.len;
+        for (size_t i = items.len; i < items.len + n; i++) {
+            char c = items.data[i];
+            if (c != delimiter) {
+                items.data[out++] = c;
+            }
+            else if (out > itemStart || opts.nul) {
+                items.data[out++] = 0;
+                itemStart = out;
+                itemCount++;
+            }
+        }
+        if (n == 0 && out > itemStart) {
+            bufferReserve(&items, 1);
+            items.data[out++] = 0;  // the last item needs no delimiter
+            itemStart = out;
+            itemCount++;
+        }
+        items.len = out;
+        // start the commands that are full, the rest once the input ends
+        char* next = items.data;
+        while (itemCount > 0 && !copyInterrupted && (n == 0 || (opts.maxItems != 0 && itemCount >= opts.maxItems) ||
+            (long)(items.data + itemStart - next + itemCount * sizeof(char*)) > limit)) {
+            struct command child = batchCommand(com, cmd, cmdCount, limit, opts.maxItems, &next, &itemCount, 0, io.out);
+            strcpy(child.input, "/dev/null");   // stdin holds the items
+            struct builtin* b = findBuiltin(&child);
+            batches++;
+            // a data builtin runs in the shell when the batches run one at a time; any other
+            // is a subshell, so it cannot change the shell and -P runs it alongside the rest
+            if (b != NULL && dataBuiltin(b) && procs == 1) {
+                b->run(&child);
+                worst = xargsStatus(worst, lfStatus);
+                free(child.args);
+                continue;
+            }
+            while (runningCount == procs)
+                worst = xargsWait(running, &runningCount, worst);
+            struct spawned sp;
+            if (spawnBatch(&child, b, &sp) == 1) {
+                worst = xargsStatus(worst, 1 << 8);
+            }
+            else if ((running[runningCount] = addJob(&child, &sp, getpid())) != -1) {
+                runningCount++;
+            }
+            else {
+                waitForeground(&child, &sp);    // job table full
+                worst = xargsStatus(worst, lfStatus);
+            }
+            free(child.args);
+        }
+        memmove(items.data, next, items.len - (next - items.data));
+        items.len -= next - items.data;
+        itemStart -= next - items.data;
+        if (n == 0)
+            break;
+    }
+    // like xargs, empty input still runs the command once unless -r
+    if (batches == 0 && !opts.noEmpty && !copyInterrupted && !readError) {
+        size_t none = 0;
+        char* at = NULL;
+        struct command child = batchCommand(com, cmd, cmdCount, limit, 0, &at, &none, 0, io.out);
+        strcpy(child.input, "/dev/null");
+        struct builtin* b = findBuiltin(&child);
+        struct spawned sp;
+        if (b != NULL && dataBuiltin(b)) {
+            b->run(&child);
+            worst = xargsStatus(worst, lfStatus);
+        }
+        else if (spawnBatch(&child, b, &sp) == 0) {
+            waitForeground(&child, &sp);
+            worst = xargsStatus(worst, lfStatus);
+        }
+        free(child.args);
+    }
+    while (runningCount > 0) {
+        worst = xargsWait(running, &runningCount, worst);
+    }
+    free(running);
+    free(items.data);
+    return dataFinish(&io, worst == 0 && readError ? 1 : worst);
+}
+
+// before com runs, give back to stdin what was read ahead of the commands and of read's
+// lines, if com may read stdin itself: a foreground command without input of its own that
+// is external or a builtin reading data
+void stdinGiveBack(struct command* com, struct builtin* b) {
+    if (strcmp(com->input, "") != 0 || com->inFD != -1 || com->background == 1)
+        return;
+    if (b != NULL && !dataBuiltin(b))
+        return;
+    if (input.fd == 0)
+        readerGiveBack(&input);
+    readerGiveBack(&stdinReader);
+}
+
+// run com: a builtin, a background job queued for admission or a spawned command, which
+// is a subshell for a data builtin in the background
+void runCommand(struct command* com) {
+    struct builtin* b = findBuiltin(com);
+    stdinGiveBack(com, b);
+    if (b != NULL && !(com->background == 1 && builtinJob(com, b))) {
+        b->run(com);
+    }
+    else if (com->background == 1 && (admitQueued > 0 || admissionBlocked() != NULL)) {
+        // over the admission thresholds: queue behind any earlier waiting jobs
+        if (admitQueued == sizeof(admitQueue) / sizeof(struct command*)) {
+            printf("admission queue full, job not started\n");
+            fflush(stdout);
+            return;
+        }
+        const char* reason = admissionBlocked();
+        admitQueue[admitQueued++] = queueCopy(com);
+        com->auxCount = 0;  // its substitution pipes went with it
+        printf("job queued (%s), %d waiting\n", reason != NULL ? reason : "queue", admitQueued);
+        fflush(stdout);
+    }
+    else {
+        launchCommand(com);
+    }
+}
+
+// run one command line, its words and fields expanded into arena
+int runLine(char* line, struct arena* arena) {
+    // instantiate a command and initialize data members 
+    struct command com;
+    commandInit(&com);
+
+    // split into words, expand variables and build the com structure; nothing to run if
+    // there are no arguments
+    if (parseCommand(line, &com, arena) == 0 && prepareCommand(&com) == 0)
+        runCommand(&com);
+    // a here-document is read even for a line that does not run
+    closeCommandFDs(&com);
+    return 0;
+}
+
+// 1 if text stops inside a quote, substitution or ${...}, so the command goes on in the next
+// line. Comment lines are always complete
+int inputIncomplete(char* p) {
+    if (p[strspn(p, " \t")] == '#')
+        return 0;
+    while (*p != 0) {
+        char* next = p + 1;
+        if (*p == '\\' && p[1] != 0)
+            next = p + 2;
+        else if (*p == '\'' || *p == '"' || *p == '`')
+            next = skipQuoted(p);
+        else if ((*p == '$' && p[1] == '{') || ((*p == '$' || *p == '<' || *p == '>') && p[1] == '('))
+            next = skipQuoted(p + 1);
+        if (next == NULL)
+            return 1;
+        p = next;
+    }
+    return 0;
+}
+
+// read one command from the input into b, NUL terminated and without its final newline.
+// A line ending in an unescaped backslash is joined with the next, and an unclosed quote or
+// substitution continues on the next line with its newline kept; a terminal gets a "> "
+// prompt for each of those. Returns -1 if a signal interrupted it before anything was read,
+// 0 at end of input and 1 otherwise
+int readCommand(struct buffer* b) {
+    b->len = 0;
+    while (1) {
+        ssize_t n = readerLine(&input, b);
+        if (n == -1 && b->len == 0)
+            return -1;
+        if (n == -1)
+            continue;   // a signal in the middle of a command: keep reading it
+        if (n == 0 && b->len == 0)
+            return 0;
+        if (b->len > 0 && b->data[b->len - 1] == '\n')
+            b->len--;
+        b->data[b->len] = 0;
+        if (n == 0) {
+            if (inputIncomplete(b->data)) {
+                printf("smallsh: unexpected end of file in command\n");
+                fflush(stdout);
+                return 0;
+            }
+            return 1;
+        }
+        size_t slashes = 0;
+        while (slashes < b->len && b->data[b->len - 1 - slashes] == '\\')
+            slashes++;
+        if (inputIncomplete(b->data)) {
+            b->data[b->len++] = '\n';
+        }
+        else if (slashes % 2 == 1) {
+            b->len--;   // backslash newline: the command goes on without either
+        }
+        else {
+            return 1;
+        }
+        if (isatty(input.fd)) {
+            printf("> ");
+            fflush(stdout);
+        }
+    }
+}
+
+// gets user command, runs forked child with execvp in foreground or background, I/O redirection enabled
+int runShell() {
+    static struct buffer command = { NULL, 0, 0 };  // reused for every command
+    int nread;
+
+    // instantiate and install foreground only mode handler
+    struct sigaction foregroundMode = { 0 };
+    foregroundMode.sa_handler = tstpHandler;
+    sigfillset(&foregroundMode.sa_mask); // Block all catchable signals while handle_SIGINT is running
+    foregroundMode.sa_flags = 0; // // No flags set
+    sigaction(SIGTSTP, &foregroundMode, NULL);
+    if (sigTSTPChange == 1 && foregroundOnly == 1) {
+        printf("Entering foreground-only mode (& is now ignored)\n");
+        fflush(stdout);
+        sigTSTPChange = 0;
+    }
+    else if (sigTSTPChange == 1 && foregroundOnly == 0) {
+        printf("Exiting foreground-only mode\n");
+        fflush(stdout);
+        sigTSTPChange = 0;
+    }
+    // instantiate and install parent ignore SIGINT handler
+    struct sigaction sigIgnore = { 0 };
+    sigIgnore.sa_handler = SIG_IGN;
+    sigaction(SIGINT, &sigIgnore, NULL);
+
+    // checking status of background processes not yet verified to have exited
+    reapJobs();
+
+    // start queued background jobs the reaped ones made room for
+    admitJobs();
+
+    // print what followed files gained while the last command ran
+    followEvents();
+
+    // prompt command, get input and remove \n
+    if (!scriptMode) {
+        printf(":");
+        fflush(stdout);
+    }
+    nread = waitForInput();
+    if (nread == 0)
+        nread = readCommand(&command);
+    // -1 if interrupted by signal handler functions, get next user command
+    if (nread == -1) {
+        printf("\n");
+        fflush(stdout);
+        return -1;
+    }
+    // end of input ends the shell like exit
+    if (nread == 0) {
+        if (!scriptMode) {
+            printf("\n");
+            fflush(stdout);
+        }
+        exitBuiltin(NULL);
+    }
+    char* line = command.data;
+
+    // ignore comment lines by returning 0
+    char* first = line + strspn(line, " \t");
+    if (*first == '#') {
+        if (!scriptMode) {
+            printf("\n");
+            fflush(stdout);
+        }
+        return 0;
+    }
+
+    arenaReset(&lineArena);
+    return runLine(line, &lineArena);
+}
+
+int main(int argc, char* argv[]) {
+    varInit();
+    // smallsh SCRIPT [ARGS...] runs the commands in SCRIPT, which sees its arguments as $1...
+    shellArgs = argv;
+    shellArgCount = 1;
+    if (argc > 1) {
+        input.fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+        if (input.fd == -1) {
+            perror(argv[1]);
+            exit(127);
+        }
+        scriptMode = 1;
+        shellArgs = argv + 1;
+        shellArgCount = argc - 1;
+    }
+    else {
+        // commands from a pipe are read a byte at a time, as stdin left past them is for the
+        // commands to read, which cannot be given back to a pipe
+        input.exact = lseek(0, 0, SEEK_CUR) == -1;
+    }
+    // start the fork server up front, while the shell's address space is still small
+    if (getenv("SMALLSH_FORKSERVER") != NULL) {
+        forkServerStart();
+    }
     // run shell until exit signal received
     while (1) {
         runShell();